@@ -1,294 +1,7766 @@
+// POSIX and BSD interfaces (pread, pwrite, MAP_ANONYMOUS) stay visible under a strict -std=c11
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#include <direct.h>
+#define fsync _commit
+#define ftruncate _chsize
+#define mkdir(path, mode) _mkdir(path)
+#define rmdir _rmdir
+#define S_ISDIR(mode) (((mode) & _S_IFMT) == _S_IFDIR)
+#else
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#endif
 
-// Define the Patient structure to store patient information
+// In server mode readers run alongside the writer without locks, so the writer
+// publishes new links with release stores and readers follow them with acquire
+// loads. On common hardware both are plain moves on the single-threaded paths.
+#if defined(__GNUC__) || defined(__clang__)
+#define LOAD_ACQUIRE(source) __atomic_load_n(&(source), __ATOMIC_ACQUIRE)
+#define LOAD_RELAXED(source) __atomic_load_n(&(source), __ATOMIC_RELAXED)
+#define STORE_RELEASE(target, value) __atomic_store_n(&(target), (value), __ATOMIC_RELEASE)
+#define FENCE_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define FENCE_RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define FENCE_FULL() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define ADD_RELAXED(target, value) __atomic_fetch_add(&(target), (value), __ATOMIC_RELAXED)
+#else
+#define LOAD_ACQUIRE(source) (source)
+#define LOAD_RELAXED(source) (source)
+#define STORE_RELEASE(target, value) ((target) = (value))
+#define FENCE_ACQUIRE()
+#define FENCE_RELEASE()
+#define FENCE_FULL()
+#define ADD_RELAXED(target, value) ((target) += (value))
+#endif
+
+#define MAX_AGE 150
+
+// String heap: append-only storage for names and clinical free text, addressed by
+// 64-bit offsets. Chunks never move once allocated (unless a page file holds them,
+// see HeapPool), so a string is stored once at its real length and never copied
+// again. Space of replaced or deleted strings is reclaimed when the records are
+// saved and loaded again.
+#define HEAP_CHUNK_SHIFT 16
+#define HEAP_CHUNK_SIZE ((uint64_t)1 << HEAP_CHUNK_SHIFT)
+#define HEAP_MAX_CHUNKS (1 << 22)
+#define HEAP_MAX_STRING (HEAP_CHUNK_SIZE / 2)  // Longest single field, so a notes record always fits one chunk
+
+struct StringHeap {
+    char* chunks[HEAP_MAX_CHUNKS];
+    size_t chunk_count;  // Chunks allocated or borrowed so far (allocated ones are kept across resets)
+    size_t borrowed;     // Leading chunks that live in a mapped snapshot
+    uint64_t used;       // Offset of the next free byte
+};
+
+struct StringHeap string_heap;
+
+// Buffer pool: with a page file, the string heap's chunks are the pages of a
+// disk-backed store and only `frame_limit` of them stay in memory. Slabs and
+// index nodes are not paged. A missing page is read back when a string on it is
+// asked for. A CLOCK hand picks the page that gives up its frame, writing it back
+// first if it changed. heap_string pins the page it returns until the next
+// heap_release, which callers reach only when they hold no heap pointers, so a
+// string never moves under its reader. Pages of a mapped snapshot are left to the
+// OS.
+#define HEAP_POOL_DEFAULT_MB 256
+#define HEAP_POOL_MIN_FRAMES 16   // Enough for every string one record touches
+#define HEAP_PAGE_REFERENCED 1    // Used since the hand last passed
+#define HEAP_PAGE_DIRTY 2         // Changed since it was last written out
+
+struct HeapPool {
+    int fd;                 // Page file, or -1 when the whole heap is in memory
+    long owner;             // Process that writes pages back (a forked saver only reads)
+    uint64_t file_base;     // Page of the file where heap page 0 goes
+    size_t frame_limit;
+    uint32_t* frame_pages;  // Heap page held by each frame
+    size_t frame_count;
+    size_t frame_capacity;
+    size_t hand;
+    uint8_t* flags;         // Per heap page
+    uint32_t* stamps;       // Per heap page: the generation that last used it
+    uint32_t generation;    // Pages stamped with it are pinned
+    uint64_t faults;
+    uint64_t evictions;
+    uint64_t writebacks;
+};
+
+struct HeapPool heap_pool = {-1, 0, 0, 0, NULL, 0, 0, 0, NULL, NULL, 1, 0, 0, 0};
+
+// Cold text store: with --cold, medical histories are kept in compressed blocks
+// rather than as one heap string each. The patient's notes record then holds the
+// two dictionary codes and a reference to the text: a block and a position in it.
+// New text gathers in an open block; once COLD_BLOCK_TARGET bytes are there the
+// block is compressed into the string heap and the references to it are
+// rewritten. Reading a history decompresses its block into a small cache, which
+// a CLOCK hand manages like the buffer pool and which is pinned the same way
+// until the next heap_release. The blocks are heap strings, so a snapshot carries
+// them compressed and maps them back as they are.
+#define COLD_BLOCK_TARGET (16 << 10)      // Raw bytes gathered before a block is sealed
+#define COLD_BLOCK_MAX (48 << 10)         // Never more, so a stored block fits in a heap chunk
+#define COLD_BLOCK_HEADER 8               // Raw length, then stored length (equal when kept raw)
+#define COLD_CACHE_BLOCKS 64
+#define COLD_NOTES ((uint64_t)1 << 63)    // On Patient.notes: the record refers to cold text
+#define COLD_OPEN ((uint64_t)1 << 63)     // On a text reference: the text is in the open block
+#define COLD_NO_BLOCK UINT64_MAX
+#define COLD_FILE_SUFFIX ".lz"            // Text saves with this suffix are compressed in frames
+#define COLD_FILE_MAGIC "MRMSLZ1\n"
+#define COLD_FILE_FRAME ((size_t)256 << 10)
+
+// LZ77 codec for the blocks, in the style of LZ4: each sequence is a token (literal
+// count and match length, 4 bits each, 15 meaning more bytes follow), the
+// literals, and a 2-byte offset back to the match. The last sequence has literals
+// only. A hash of the next 4 bytes finds the candidate match.
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_LAST_LITERALS 5               // Matches stop this far from the end
+#define LZ_BOUND(length) ((length) + (length) / 255 + 16)
+
+struct ColdStore {
+    int enabled;              // New notes go to the cold store (--cold, or a cold snapshot was loaded)
+    char* open;               // The block being filled, COLD_BLOCK_MAX bytes
+    size_t open_length;
+    uint64_t* open_records;   // Notes records whose text is in the open block
+    size_t open_count;
+    size_t open_capacity;
+    uint8_t* packed;          // Compression scratch, LZ_BOUND(COLD_BLOCK_MAX) bytes
+    uint64_t* cache_blocks;   // Heap offset of the block each cache slot holds
+    char** cache_data;        // Its text, decompressed
+    uint32_t* cache_stamps;   // Generation that last used each slot; the current one pins it
+    uint8_t* cache_referenced;
+    size_t cache_count;
+    size_t cache_capacity;
+    size_t last;              // Slot of the last hit, tried first
+    size_t hand;
+    uint32_t generation;
+    uint64_t blocks;          // Blocks sealed, and their raw and stored bytes
+    uint64_t raw_bytes;
+    uint64_t stored_bytes;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+struct ColdStore cold_store;
+
+// Distinct gender values; a patient stores the index into this table
+#define GENDER_CODES 256
+
+uint64_t gender_table[GENDER_CODES];
+int gender_count = 0;
+
+// Dictionaries for diagnosis and prescription, which repeat a small set of values
+// across many patients: each distinct value is stored once in the string heap
+// and patients hold its 32-bit code, given out in first-seen order. Readers
+// decode codes without locks, so a grown value array is published like a slab
+// array. A patient's notes are one heap record, the two codes followed by the
+// medical history text, so replacing them is still a single store.
+#define NOTES_CODES_SIZE (2 * sizeof(uint32_t))
+#define NO_CODE 0xFFFFFFFFu
+
+struct Dictionary {
+    uint64_t* values;   // Heap offset of each code's string
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t* slots;    // Open addressing over code + 1, 0 when empty
+    size_t slot_capacity;
+    int borrowed;       // Values live in a mapped snapshot and must not be freed
+};
+
+struct Dictionary diagnosis_dictionary;
+struct Dictionary prescription_dictionary;
+
+// Records and index nodes refer to each other by 32-bit pool handles rather than
+// pointers, so a dataset can be written to disk and mapped back in unchanged
+#define NO_HANDLE 0xFFFFFFFFu
+
+// Define the Patient structure to store patient information. Only the fields that
+// searches touch live here; the text is kept in the string heap.
 struct Patient {
-    char name[50];
+    uint32_t handle;   // Own slot in patient_pool, which is also the patient's ID
+    uint32_t age_prev; // Neighbours in the same age bucket (see add_patient_by_age)
+    uint32_t age_next;
+    uint16_t age;
+    uint8_t gender;    // Index into gender_table
+    uint64_t name;     // String heap offset of the name
+    uint64_t notes;    // String heap offset of medical history, diagnosis and prescription, back to back
+};
+
+// Name index: a B+tree whose nodes span a few cache lines. Every key carries the
+// first 8 bytes of the name packed big-endian, so most comparisons are a single
+// integer compare and strcmp only runs when two prefixes tie. Patients may share
+// a name, so a key is the name and then the patient handle, which keeps equal
+// names together in ID order. Leaves are linked so in-order scans walk memory
+// sequentially instead of chasing tree pointers.
+#define NAME_PREFIX_LEN 8
+#define BPT_LEAF_KEYS 14
+#define BPT_INNER_KEYS 14
+#define BPT_MIN_LEAF_KEYS (BPT_LEAF_KEYS / 2)
+#define BPT_MIN_INNER_KEYS (BPT_INNER_KEYS / 2)
+#define BPT_MAX_HEIGHT 32
+
+struct BptLeaf {
+    uint16_t count;
+    uint16_t is_leaf;
+    uint32_t next;
+    uint64_t prefixes[BPT_LEAF_KEYS];
+    uint32_t patients[BPT_LEAF_KEYS];
+};
+
+struct BptInner {
+    uint16_t count;  // Number of separators; the node has count + 1 children
+    uint16_t is_leaf;
+    uint64_t prefixes[BPT_INNER_KEYS];
+    uint64_t separators[BPT_INNER_KEYS];  // Heap offsets of names; they outlive the patient if it is deleted
+    uint32_t separator_patients[BPT_INNER_KEYS];  // Handle half of each separator; only compared, never followed
+    uint32_t children[BPT_INNER_KEYS + 1];
+};
+
+// One entry of a bulk load: the key of a patient, or of the first patient under a
+// node while the levels above the leaves are built
+struct NameKey {
+    uint64_t prefix;
+    uint64_t name;    // String heap offset
+    uint32_t patient; // Patient the key belongs to
+    uint32_t handle;  // That patient, or the leaf or inner node it starts
+};
+
+// Name search: the B+tree keeps names in byte order, so it already is a trie laid
+// out flat. A depth-first walk over it carries one Levenshtein row per character
+// of the current name (with adjacent transpositions, ignoring ASCII case), reuses
+// the rows of the prefix it shares with the previous name, and skips every name
+// under a prefix whose row can no longer lead to a good enough match with one
+// seek. Matches rank by distance, then by name, and only the best `limit` are kept;
+// once they are all closer than what a subtree could offer, it is skipped too.
+#define NAME_SEARCH_MAX_QUERY 64
+#define NAME_SEARCH_MAX_EDITS 3
+#define NAME_SEARCH_MAX_DEPTH (NAME_SEARCH_MAX_QUERY + NAME_SEARCH_MAX_EDITS + 1)
+#define NAME_SEARCH_MAX_RESULTS 100
+#define NAME_SEARCH_DEFAULT_RESULTS 10
+
+struct NameMatch {
+    uint32_t handle;
+    int distance;
+};
+
+struct NameSearch {
+    char query[NAME_SEARCH_MAX_QUERY + 1];  // Lower-cased
+    int length;
+    int prefix;                             // Rank names by their closest prefix instead
+    char path[NAME_SEARCH_MAX_DEPTH];       // Name characters the rows were computed for
+    int depth;                              // Rows 0 to depth are valid
+    uint8_t rows[NAME_SEARCH_MAX_DEPTH + 1][NAME_SEARCH_MAX_QUERY + 1];
+    uint8_t row_min[NAME_SEARCH_MAX_DEPTH + 1];  // No name under path[0..d) gets closer than this
+    uint8_t best[NAME_SEARCH_MAX_DEPTH + 1];     // Closest a prefix of path[0..d) came
+};
+
+// Exact-name hash index: open addressing with Robin Hood displacement. A slot is
+// just a 32-bit hash tag and a patient handle, so eight slots share a cache line
+// and a lookup usually costs that line plus the patient it lands on. Each patient
+// has its own slot, so patients sharing a name sit in the same probe run. It lives
+// beside the B+tree and does not depend on it.
+#define NAME_HASH_MIN_CAPACITY 64
+
+struct NameHashSlot {
+    uint32_t hash;    // 0 marks an empty slot
+    uint32_t handle;
+};
+
+struct NameHash {
+    struct NameHashSlot* slots;
+    size_t capacity;  // Power of two
+    size_t count;
+    int borrowed;     // Slots live in a mapped snapshot and must not be freed
+    uint64_t version; // Odd while slots are being moved; see search_patient
+};
+
+struct NameIndex {
+    uint32_t root;
+    int height;  // 1 when the root is a leaf
+    size_t count;
+    struct NameHash hash;
+};
+
+// Age index: ages are a small bounded domain, so there is one bucket per age, a
+// doubly linked list of patients threaded through their own age_prev/age_next
+// handles. A Fenwick tree over the bucket sizes answers "how many patients aged
+// a-b" in O(log MAX_AGE), and range scans walk only the buckets in range.
+struct AgeIndex {
+    uint32_t heads[MAX_AGE + 1];      // First patient of each age, or NO_HANDLE
+    uint32_t fenwick[MAX_AGE + 2];    // 1-based Fenwick tree of bucket sizes
+    uint64_t count;
+};
+
+// Cursor over the patients of an age range, youngest bucket first
+struct AgeRange {
+    struct AgeIndex* index;
+    int age;        // Bucket the cursor is in
+    int max_age;
+    uint32_t next;  // Next patient to hand out, or NO_HANDLE at the end of the bucket
+#ifndef NO_METRICS
+    uint64_t started;  // The scan is timed from its start to its end, 0 once counted
+    uint64_t rows;
+#endif
+};
+
+// Full-text index: the words of each patient's medical history, diagnosis and
+// prescription, lower-cased, map to posting lists of patient handles. A list is
+// kept sorted and delta + varint encoded, with a skip entry every
+// TEXT_SKIP_INTERVAL handles so an intersection can jump over whole blocks. A
+// handle above the last one is appended in place; other changes wait in small
+// unsorted buffers until enough pile up or a query reads the list. The index is
+// built by the first query and kept up to date by add, update and delete after that.
+#define TEXT_MAX_TERM 31        // Longer words are cut, the same way in records and queries
+#define TEXT_SKIP_INTERVAL 128
+#define TEXT_MIN_PENDING 64     // Changes a list buffers before merging (more for long lists)
+#define TEXT_MAX_QUERY_TERMS 32 // Words per AND group of a query
+
+struct PostingSkip {
+    uint32_t first;   // First handle of the block
+    uint32_t base;    // Handle before it, which its first delta is taken from
+    uint32_t offset;  // Byte offset of the block
+};
+
+struct Postings {
+    char term[TEXT_MAX_TERM + 1];
+    uint8_t* data;       // Sorted handles as varint deltas
+    size_t length;
+    size_t capacity;
+    uint32_t count;      // Handles in data
+    uint32_t last;       // Largest handle in data
+    struct PostingSkip* skips;
+    size_t skip_count;
+    size_t skip_capacity;
+    uint32_t* added;     // Handles to add, not in data yet
+    size_t added_count;
+    size_t added_capacity;
+    uint32_t* removed;   // Handles to drop from data
+    size_t removed_count;
+    size_t removed_capacity;
+};
+
+struct TextIndex {
+    int built;
+    struct Postings* terms;
+    size_t term_count;
+    size_t term_capacity;
+    uint32_t* slots;     // Open-addressing table of term id + 1, 0 when empty
+    size_t slot_capacity;
+    uint32_t* scratch;   // Term ids of the patient being indexed
+    size_t scratch_capacity;
+};
+
+struct TextIndex text_index;
+
+// Column store for analytics: the age, gender and diagnosis and prescription codes
+// of every patient in dense arrays, one row per patient, so a group-by is a few
+// tight loops over contiguous memory instead of a walk over the name tree. Like
+// the text index it is built by the first query and kept up to date by add,
+// update and delete after that; a delete moves the last row into the hole.
+#define COLUMN_BLOCK 2048                 // Rows per pass, so a block's group ids stay in L1
+#define COLUMN_MAX_GROUPS (1 << 20)       // Product of the key cardinalities
+#define COLUMN_MAX_KEYS 2
+#define COLUMN_MAX_THREADS 16
+#define COLUMN_MIN_THREAD_ROWS (1 << 18)  // Rows worth starting another thread for
+#define COLUMN_GENDER 0
+#define COLUMN_DIAGNOSIS 1
+#define COLUMN_PRESCRIPTION 2
+#define COLUMN_AGE 3
+
+struct Columns {
+    int built;
+    uint8_t* ages;
+    uint8_t* genders;
+    uint32_t* diagnoses;
+    uint32_t* prescriptions;
+    uint32_t* handles;   // Patient of each row
+    size_t count;
+    size_t capacity;
+    uint32_t* rows;      // Row of each patient, by handle
+    size_t row_capacity;
+};
+
+struct Columns columns;
+
+// A group-by key: a column, with ages cut into bands
+struct GroupKey {
+    int column;
+    uint32_t band;                   // Width of an age band
+    uint32_t cardinality;            // Values the key can take
+    uint8_t band_of[MAX_AGE + 1];    // Band of each age, so no row needs a division
+};
+
+// A group-by query: per group, the patient count and the youngest and oldest age
+struct GroupBy {
+    struct GroupKey keys[COLUMN_MAX_KEYS];
+    int key_count;
+    uint32_t groups;
+    uint64_t* counts;
+    uint8_t* min_ages;
+    uint8_t* max_ages;
+};
+
+// A slice of the rows scanned by one thread into its own tallies
+struct GroupTask {
+    struct GroupBy* query;
+    size_t begin;
+    size_t end;
+    uint64_t* counts;
+    uint8_t* min_ages;
+    uint8_t* max_ages;
+};
+
+// Secondary indexes, declared with INDEX over one or more of gender, diagnosis,
+// prescription and age, e.g. "gender,age". Each maps a key, the values of its
+// fields, to a posting list of the patients that have it, and the list lengths
+// are the statistics the query planner estimates from. Declarations last until
+// exit; the lists are built when declared and again by the first query after a
+// load, and kept up to date by add, update and delete.
+#define SECONDARY_MAX_INDEXES 8
+#define SECONDARY_MAX_FIELDS 4
+
+struct SecondaryList {
+    uint32_t key[SECONDARY_MAX_FIELDS];
+    struct Postings postings;
+};
+
+struct SecondaryIndex {
+    int fields[SECONDARY_MAX_FIELDS];  // COLUMN_* in key order
+    int field_count;
+    int built;
+    struct SecondaryList* lists;
+    size_t list_count;
+    size_t list_capacity;
+    uint32_t* slots;                   // Open addressing over list + 1, 0 when empty
+    size_t slot_capacity;
+};
+
+struct SecondaryIndex secondary_indexes[SECONDARY_MAX_INDEXES];
+int secondary_index_count = 0;
+
+// A multi-field search: every condition must hold. The planner estimates how many
+// patients each access path yields (the age index and the secondary indexes know
+// exactly, a notes word its list length, a name its hash entries), drives the
+// search from the cheapest and checks the other conditions on what it yields,
+// intersecting posting lists for notes words.
+#define QUERY_MAX_CONDITIONS 8
+#define QUERY_SCAN 0        // Access paths
+#define QUERY_NAME 1
+#define QUERY_AGE 2
+#define QUERY_NOTES 3
+#define QUERY_INDEX 4
+#define QUERY_HAS_NAME 16   // Condition bits beside 1 << COLUMN_*
+#define QUERY_HAS_NOTES 32
+
+struct Query {
+    uint32_t codes[3];      // Gender, diagnosis and prescription codes, by COLUMN_*
+    int min_age;
+    int max_age;
+    const char* name;
+    uint32_t terms[TEXT_MAX_QUERY_TERMS];
+    size_t term_count;
+    int conditions;         // Bits of the conditions given
+    int empty;              // A condition no patient can meet, e.g. an unknown value
+    int path;               // QUERY_*
+    int index;              // The secondary index, for QUERY_INDEX
+    int covered;            // Condition bits the path meets by itself
+    uint64_t estimate;      // Patients the path yields
+};
+
+// Forward cursor over a posting list
+struct PostingCursor {
+    struct Postings* list;
+    const uint8_t* at;
+    uint32_t value;  // Handle under the cursor
+    uint32_t index;  // Its position in the list; count once past the end
+};
+
+// Slab allocator: fixed-size objects are carved out of large contiguous slabs and
+// recycled through an intrusive free list. An object is named by its handle, its
+// position across the slabs. Resetting a pool hands every slab back for reuse at
+// once, which is how a whole dataset is released in O(1).
+#define SLAB_SHIFT 12  // 4096 objects a slab
+#define SLAB_OBJECTS (1 << SLAB_SHIFT)
+#define POOL_OBJECT_SIZE(type) ((sizeof(type) + 7) & ~(size_t)7)
+
+struct SlabPool {
+    size_t object_size;    // Rounded to 8 so every object stays aligned
+    char** slabs;
+    size_t slab_count;     // Slabs allocated or borrowed so far (allocated ones are kept across resets)
+    size_t slab_capacity;
+    size_t borrowed;       // Leading slabs that live in a mapped snapshot
+    uint32_t used;         // Handles handed out by the bump pointer
+    uint32_t free_list;
+    size_t live;           // Objects currently handed out
+};
+
+struct SlabPool patient_pool = {POOL_OBJECT_SIZE(struct Patient), NULL, 0, 0, 0, 0, NO_HANDLE, 0};
+struct SlabPool leaf_pool = {POOL_OBJECT_SIZE(struct BptLeaf), NULL, 0, 0, 0, 0, NO_HANDLE, 0};
+struct SlabPool inner_pool = {POOL_OBJECT_SIZE(struct BptInner), NULL, 0, 0, 0, 0, NO_HANDLE, 0};
+
+// Epoch-based reclamation: while server readers may be running, a patient or an
+// array the writer unlinks is retired with the current epoch instead of freed, and
+// is freed once every reader that could still hold it has left its read section.
+// Without readers, retiring frees at once.
+#define EPOCH_MAX_READERS 64
+
+struct EpochReader {
+    uint64_t epoch;     // Global epoch when the read section began, or 0 outside one
+    char padding[56];   // A cache line per reader, so readers never write a shared line
+};
+
+struct Retired {
+    uint64_t epoch;
+    void* memory;       // Block to free, or NULL
+    uint32_t patient;   // Patient handle to give back, or NO_HANDLE
+};
+
+struct Epochs {
+    int active;         // Set while readers may run alongside the writer
+    uint64_t global;
+    struct EpochReader readers[EPOCH_MAX_READERS];
+    struct Retired* retired;
+    size_t retired_count;
+    size_t retired_capacity;
+    int closed;         // The writer is applying a write batch; readers wait outside
+};
+
+struct Epochs epochs = {0, 1, {{0, {0}}}, NULL, 0, 0, 0};
+
+// Operation metrics: a call count and a log2 latency histogram for each core
+// operation, and probe and path-length counters for the name index. Server
+// threads share them through relaxed atomic adds. Building with -DNO_METRICS
+// compiles every hook out; the structural stats are computed on demand either way.
+#define METRIC_CREATE 0
+#define METRIC_ADD 1
+#define METRIC_SEARCH 2
+#define METRIC_DELETE 3
+#define METRIC_RANGE 4
+#define METRIC_SAVE 5
+#define METRIC_LOAD 6
+#define METRIC_FIND 7
+#define METRIC_NAME_SEARCH 8
+#define METRIC_GROUP 9
+#define METRIC_QUERY 10
+#define METRIC_BATCH 11
+#define METRIC_OPS 12
+#define METRIC_BUCKETS 32  // Bucket b counts latencies below 2^b ns (and at least 2^(b-1)); the last takes the rest
+
+#ifndef NO_METRICS
+struct OpMetrics {
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t buckets[METRIC_BUCKETS];
+};
+
+struct Metrics {
+    struct OpMetrics ops[METRIC_OPS];
+    uint64_t hash_lookups;
+    uint64_t hash_probes;    // Slots visited by those lookups
+    uint64_t tree_descents;  // Root-to-leaf walks by inserts and deletes
+    uint64_t tree_nodes;     // Nodes visited by those walks
+    uint64_t range_rows;
+    uint64_t query_rows;     // Patients the access paths of queries yielded
+    uint64_t batch_changes;  // Changes applied by committed write batches
+    uint64_t batch_merges;   // Batches applied by merging along the leaves
+};
+
+struct Metrics metrics;
+
+#define METRIC_START(started) uint64_t started = clock_ns()
+#define METRIC_STOP(op, started) metrics_record((op), (started))
+#define METRIC_COUNT(counter, value) ADD_RELAXED(metrics.counter, (uint64_t)(value))
+#else
+#define METRIC_START(started)
+#define METRIC_STOP(op, started)
+#define METRIC_COUNT(counter, value)
+#endif
+
+// Binary snapshot: the pools, the string heap and the gender table are written
+// verbatim at page-aligned offsets, so loading maps the file and uses the records
+// and the B+tree in place. Nothing is parsed or re-inserted; pages fault in as
+// queries touch them, and the private mapping copies a page only when it is changed.
+#define SNAPSHOT_MAGIC "MRMSNAP"
+#define SNAPSHOT_VERSION 8
+#define SNAPSHOT_ALIGN 4096
+
+struct SnapshotPool {
+    uint64_t offset;       // Whole slabs, so the last one can keep taking new objects
+    uint32_t used;
+    uint32_t free_list;
+    uint64_t live;
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t slab_objects;
+    uint32_t patient_size;  // Object sizes guard against loading a file from a different build
+    uint32_t leaf_size;
+    uint32_t inner_size;
+    uint32_t gender_count;
+    uint64_t heap_chunk_size;
+    struct SnapshotPool patients;
+    struct SnapshotPool leaves;
+    struct SnapshotPool inners;
+    uint64_t heap_offset;
+    uint64_t heap_used;
+    uint64_t genders_offset;
+    uint32_t index_root;
+    int32_t index_height;
+    uint64_t index_count;
+    uint64_t journal_sequence;  // Last journal record folded into this snapshot
+    uint64_t hash_offset;
+    uint64_t hash_capacity;
+    uint64_t ages_offset;
+    uint64_t diagnoses_offset;
+    uint64_t prescriptions_offset;
+    uint32_t diagnosis_count;
+    uint32_t prescription_count;
+    uint32_t cold_text;         // Notes may refer to compressed blocks, so loading turns the cold store on
+    uint64_t cold_blocks;
+    uint64_t cold_raw_bytes;
+    uint64_t cold_stored_bytes;
+    uint64_t file_size;
+};
+
+// The mapping that borrowed slabs and heap chunks point into, if any
+void* snapshot_base = NULL;
+size_t snapshot_size = 0;
+
+// Write-ahead journal: every add, update and delete is appended as a compact
+// binary record and made durable in group commits, so persisting a change costs
+// one small write instead of rewriting the database. The journal sits next to the
+// database snapshot and is folded back into it by a background compaction.
+#define JOURNAL_ADD_UNNUMBERED 1     // An add from before adds recorded their ID; replay allocates in order
+#define JOURNAL_UPDATE 2
+#define JOURNAL_DELETE 3
+#define JOURNAL_BATCH 4              // Payload: the records of a write batch, each [payload length][op][payload]
+#define JOURNAL_ADD 5                // Carries the ID the patient got, which replay hands out again
+#define JOURNAL_HEADER_BYTES 17      // Payload length, checksum, sequence number, op
+#define JOURNAL_ENTRY_BYTES 5        // Payload length and op of a record inside a batch
+#define JOURNAL_GROUP_RECORDS 64     // Records per group commit (the menu also commits when idle)
+#define JOURNAL_COMPACT_BYTES ((uint64_t)64 << 20)
+
+struct Journal {
+    char* database;        // Snapshot path; NULL when no database is open
+    struct NameIndex* index;
+    struct AgeIndex* ages;
+    int fd;
+    char* buffer;          // Records waiting for the next group commit
+    size_t length;
+    size_t capacity;
+    int pending;
+    uint64_t sequence;     // Sequence number of the last record logged or replayed
+    uint64_t size;         // Bytes in the journal file
+    long compactor;        // Process id of a running compaction, or 0
+    int batching;          // Records go into the open batch record
+    size_t batch;          // Where that record starts in the buffer
+};
+
+struct Journal journal = {NULL, NULL, NULL, -1, NULL, 0, 0, 0, 0, 0, 0, 0, 0};
+
+// Output engine: records are formatted into one large reusable buffer and handed
+// to the OS with a single write whenever it fills, instead of several stdio calls
+// per record. Display, range queries and exports all go through it. Long listings
+// are formatted by several threads at once, each into a buffer of its own that
+// grows instead of being written, and the buffers are then written in order.
+#define OUTPUT_BUFFER_SIZE ((size_t)1 << 20)
+#define OUTPUT_TEXT 0
+#define OUTPUT_TSV 1
+#define OUTPUT_JSON 2
+#define OUTPUT_RECORDS 3  // Text save files: TSV rows without the ID column or the header
+#define OUTPUT_SCAN_ROUND (1 << 16)          // Records a scan collects before formatting them
+#define OUTPUT_MIN_THREAD_RECORDS (1 << 12)  // Records worth starting another thread for
+#define OUTPUT_MAX_THREADS 16
+
+struct Output {
+    int fd;          // -1 for an in-memory buffer
+    int format;
+    char* buffer;
+    size_t length;
+    size_t capacity;
+    size_t records;  // Records written so far
+    int failed;      // Set when a write to fd fails
+};
+
+struct OutputTask {
+    struct Output out;
+    const uint32_t* handles;
+    size_t count;
+};
+
+// Background saves: a forked child writes the file from its copy-on-write image
+// of memory, which is frozen at the moment of the fork, while this process keeps
+// taking changes. Pages are copied only when the parent writes to them, so the
+// foreground pays for the fork and a fault per page it touches meanwhile. The
+// file is written beside the target and renamed over it. One runs at a time.
+struct BackgroundSave {
+    long pid;        // Process id of the running save, or 0
+    char* filename;
+    int child;       // Set in the forked child, which must not start threads
+};
+
+struct BackgroundSave background_save = {0, NULL, 0};
+
+// Write batches: a caller stages adds, updates and deletes, then commits them as
+// one unit. Commit checks every staged change against the dataset before making
+// any, so a batch that cannot be applied whole changes nothing. The changes are
+// sorted by name and applied in that order: a small batch through the usual
+// per-record paths, whose descents then walk neighbouring nodes, and a batch that
+// touches a large part of the tree in one merge along the leaf level followed by
+// a bottom-up rebuild. The journal logs the batch as a single record, and server
+// readers are held out while it is applied, so a batch is seen whole or not at all.
+#define WRITE_ADD 1
+#define WRITE_UPDATE 2
+#define WRITE_DELETE 3
+#define WRITE_BATCH_MERGE_RATIO 8            // Merge when adds and deletes reach 1/8 of the tree
+#define WRITE_PENDING ((uint64_t)1 << 32)    // Target flag: the patient an earlier add of the batch creates
+
+struct WriteOp {
+    uint8_t kind;
+    uint8_t by_id;     // An update or delete names its patient by ID rather than by name
+    uint16_t age;
+    uint32_t id;       // Patient of an update or delete by ID; after commit, the patient an add created (NO_HANDLE if the batch deleted it)
+    uint64_t target;   // Set by commit: the patient's handle, or WRITE_PENDING | the add's op
+    size_t name;       // Offsets into the batch text: the name (for an ID, filled in by commit)
+    size_t fields;     // and the other fields, one after another: gender first for an add
+    size_t line;       // Caller's label for errors, such as the line the op came from
+};
+
+struct WriteBatch {
+    struct WriteOp* ops;
+    size_t count;
+    size_t capacity;
+    char* text;
+    size_t text_length;
+    size_t text_capacity;
+    size_t failed;      // Op that stopped the last commit
+    const char* error;  // and why
+    int open;           // The batch protocol is between BEGIN and COMMIT
+    size_t rejected;    // Line of the first write that could not be staged, or 0
+};
+
+// Sort key of a staged op during commit
+struct WriteKey {
+    uint64_t prefix;
+    const char* name;
+    size_t op;
+};
+
+// Batch mode: commands arrive one per line with tab-separated fields, escaped the
+// same way as TSV output, and every command answers with zero or more TSV record
+// rows followed by a status line ("OK", "OK <count>", "NOT FOUND" or "ERROR ...");
+// ADD answers "OK <id>" with the new patient's ID.
+// BEGIN opens a write batch: ADD, UPDATE and DELETE then answer "QUEUED" and wait
+// for COMMIT, which answers with the rows of the patients added and "OK <count>",
+// or with an ERROR for the staged line that could not be applied and no changes
+// made. ABORT drops the batch. A write that cannot even be staged spoils the
+// batch: the writes after it are refused, and COMMIT discards the batch with an
+// ERROR for that line.
+// Input is read in large blocks and the journal is committed once per block, so a
+// stream of writes costs a few group commits rather than one per command.
+#define BATCH_BUFFER_SIZE ((size_t)1 << 20)
+#define BATCH_MAX_FIELDS 8
+#define BATCH_NAME_MATCHES 16  // Patients sharing a name that GET collects without allocating
+
+struct BatchSession {
+    struct Output out;
+    struct NameIndex* index;
+    struct AgeIndex* ages;
+    size_t line_number;
+    int failures;
+    int reader;   // Epoch slot of a server connection, or -1 for a batch run
+    int wrote;    // A write ran since the journal was last committed
+    struct WriteBatch batch;  // Changes staged since BEGIN
+};
+
+#ifndef _WIN32
+// Server mode: clients connect to a Unix domain socket and speak the batch
+// protocol, served by a pool of worker threads. GET and RANGE take no lock: they
+// run inside an epoch read section while writers, serialized by one mutex, keep
+// changing the dataset. Writes are committed to the journal before the replies to
+// the block of commands that carried them are sent.
+#define SERVER_MIN_THREADS 8  // A thread serves one connection at a time, so keep a few even on small machines
+#define SERVER_QUEUE 64
+
+struct Server {
+    pthread_mutex_t writer;      // Serializes writers; readers never take it
+    pthread_mutex_t queue_lock;  // Hands accepted connections to idle workers
+    pthread_cond_t queue_ready;
+    int queue[SERVER_QUEUE];
+    size_t queue_head;
+    size_t queue_count;
+    struct NameIndex* index;
+    struct AgeIndex* ages;
+};
+
+struct Server server = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, {0}, 0, 0, NULL, NULL};
+volatile sig_atomic_t server_stopping = 0;
+#endif
+
+// Benchmark mode: a deterministic generator makes synthetic patients with skewed
+// surnames, ages and diagnoses, and every operation is timed at each requested
+// size. Results are JSON lines on stdout (lines that start with '{'), one per
+// operation, with throughput, p50/p99 latency and the peak RSS so far. Messages
+// from the loads and saves it times go to stderr meanwhile.
+#define BENCH_DEFAULT_SIZES "1000,10000,100000,1000000,10000000"
+#define BENCH_RANGE_QUERIES 200
+#define BENCH_RANGE_WIDTH 10
+#define BENCH_GROUP_QUERIES 30
+#define BENCH_TEXT_FILE "mrms-bench.txt"
+#define BENCH_SNAPSHOT_FILE "mrms-bench.snap"
+#define BENCH_SHARD_DIRECTORY "mrms-bench.shards"
+#define BENCH_COMPRESSED_FILE "mrms-bench.txt" COLD_FILE_SUFFIX
+int bench_running = 0;
+
+// Text import: the file is read whole and cut into newline-aligned chunks, one per
+// worker thread. Each worker splits its lines in place and keeps the records and
+// errors it finds in its own arrays; the main thread then reports the errors with
+// their line numbers, creates the patients in file order and bulk-loads them.
+//
+// A text file holds one patient a line: name, age, gender, medical history,
+// diagnosis and prescription, separated by tabs. Backslashes, tabs, newlines and
+// carriage returns inside a field are escaped as in TSV listings (\\, \t, \n,
+// \r), so every value reads back as it was saved. A line without any tab is read
+// the way older files were written: six words separated by spaces.
+#define IMPORT_FIELDS 6
+#define IMPORT_MAX_THREADS 64
+#define IMPORT_MIN_CHUNK ((size_t)1 << 20)  // Smaller files are not worth a thread
+
+struct ImportRecord {
+    char* fields[IMPORT_FIELDS];  // Point into the file buffer
     int age;
-    char gender[10];
-    char medical_history[100];
-    char diagnosis[100];
-    char prescription[100];
-    struct Patient* left;
-    struct Patient* right;
 };
 
-struct AgeNode {
-    int age;
-    struct Patient* patients;  // Linked list of patients with the same age
-    struct AgeNode* left;
-    struct AgeNode* right;
-};
+struct ImportError {
+    size_t line;         // Line number within the chunk, from 1
+    const char* name;    // First field of the line, or ""
+    const char* reason;
+};
+
+struct ImportChunk {
+    char* start;
+    char* end;
+    size_t lines;
+    struct ImportRecord* records;
+    size_t record_count;
+    size_t record_capacity;
+    struct ImportError* errors;
+    size_t error_count;
+    size_t error_capacity;
+};
+
+// Sharded layout: a directory named "*.shards" holds a manifest and one text file
+// per shard, and a patient goes to the shard its name hashes to. Shards are saved
+// in parallel. Loading the directory reads only the manifest; a command about one
+// name reads that name's shard the first time, and anything else reads the rest,
+// one thread per shard, into the same index. Patients get their IDs as their
+// shard is read, so after reopening a directory the IDs depend on which shards
+// the commands reached first; they are not stable across sessions.
+#define SHARD_SUFFIX ".shards"
+#define SHARD_COUNT 16
+#define SHARD_MAX 64
+#define SHARD_MANIFEST "MRMS shards %d records %llu\n"
+
+struct Shards {
+    char* directory;          // Set while some shards are not loaded yet
+    int count;
+    uint8_t loaded[SHARD_MAX];
+    struct NameIndex* index;  // Dataset they load into
+    struct AgeIndex* ages;
+};
+
+struct Shards shards = {NULL, 0, {0}, NULL, NULL};
+
+struct ShardSave {
+    char* path;
+    uint32_t* handles;  // The shard's patients, in name order
+    size_t count;
+    size_t capacity;
+    int ok;
+};
+
+// Function prototypes
+struct Patient* create_patient(const char* name, int age, const char* gender, const char* medical_history, const char* diagnosis, const char* prescription);
+struct Patient* fill_patient(uint32_t handle, const char* name, int age, const char* gender, const char* medical_history, const char* diagnosis, const char* prescription);
+void add_patient(struct NameIndex* index, struct Patient* new_patient);
+void name_index_insert(struct NameIndex* index, struct Patient* new_patient);
+struct Patient* search_patient(struct NameIndex* index, const char* name);
+size_t search_patients(struct NameIndex* index, const char* name, uint32_t* handles, size_t max);
+struct Patient* patient_by_id(struct NameIndex* index, uint32_t id);
+int delete_patient_record(struct NameIndex* index, struct AgeIndex* ages, struct Patient* patient);
+int name_index_delete(struct NameIndex* index, struct AgeIndex* ages, struct Patient* patient);
+void display_all_records(struct NameIndex* index, int format);
+size_t display_patients_named(struct NameIndex* index, const char* name, int format);
+struct Patient* choose_patient(struct NameIndex* index, const char* name, char** field, size_t* field_capacity);
+void save_records_to_file(struct NameIndex* index, struct AgeIndex* ages, const char* filename);
+int save_records(struct NameIndex* index, struct AgeIndex* ages, const char* filename);
+void save_records_in_background(struct NameIndex* index, struct AgeIndex* ages, const char* filename);
+void background_save_finish(int wait);
+int load_records_from_file(struct NameIndex* index, struct AgeIndex* ages, const char* filename);
+int load_check(const char* filename);
+int replace_records_from_file(struct NameIndex* index, struct AgeIndex* ages, const char* filename);
+int save_text_file(const char* filename, const uint32_t* handles, size_t count);
+char* read_file(const char* filename, size_t* length);
+void import_parse_all(struct ImportChunk* chunks, size_t chunk_count);
+int import_records(struct NameIndex* index, struct AgeIndex* ages, struct ImportChunk* chunks, size_t chunk_count);
+
+// Function prototypes for the sharded layout
+char* shard_path(const char* directory, const char* file, int shard);
+int save_shards(struct NameIndex* index, const char* directory);
+int shards_open(struct NameIndex* index, struct AgeIndex* ages, const char* directory);
+int shards_manifest(const char* directory, int* count, unsigned long long* records);
+void shards_need(const char* name);
+void shards_close();
+void free_patient(struct Patient* patient);
+void update_patient_notes(struct Patient* patient, const char* medical_history, const char* diagnosis, const char* prescription);
+const char* patient_name(struct Patient* patient);
+const char* patient_gender(struct Patient* patient);
+const char* patient_medical_history(struct Patient* patient);
+const char* patient_diagnosis(struct Patient* patient);
+const char* patient_prescription(struct Patient* patient);
+int read_field(FILE* in, char** buffer, size_t* capacity, int whole_line);
+void* import_parse_chunk(void* argument);
+size_t import_unescape(char* field);
+
+// Function prototypes for the output engine
+void output_open(struct Output* out, int fd, int format);
+void output_string(struct Output* out, const char* text);
+void output_uint(struct Output* out, unsigned long long value);
+void output_patient(struct Output* out, struct Patient* patient);
+void output_close(struct Output* out);
+int output_format_code(const char* name);
+void output_patients(struct Output* out, const uint32_t* handles, size_t count);
+void output_age_range(struct Output* out, struct AgeIndex* ages, int min_age, int max_age);
+
+// Function prototypes for the string heap
+uint64_t heap_reserve(uint64_t size, char** dest);
+uint64_t heap_append(const char* text);
+const char* heap_string(uint64_t offset);
+void heap_reset();
+void heap_adopt(char* base, uint64_t used);
+void heap_release();
+
+// Function prototypes for the heap buffer pool
+int heap_pool_open(const char* path, size_t megabytes);
+char* heap_page(size_t page);
+char* heap_pool_frame(uint32_t page);
+size_t heap_pool_victim();
+void heap_pool_clear();
+uint8_t gender_code(const char* gender);
+char* heap_writable(uint64_t offset);
+
+// Function prototypes for the cold text store
+size_t lz_emit(uint8_t* out, const uint8_t* literals, size_t literal_count, size_t offset, size_t match_length);
+size_t lz_compress(const uint8_t* in, size_t length, uint8_t* out);
+int lz_decompress(const uint8_t* in, size_t stored, uint8_t* out, size_t length);
+uint64_t cold_append(const char* medical_history, const uint32_t* codes);
+void cold_seal();
+size_t cold_cache_slot();
+const char* cold_block(uint64_t block);
+const char* cold_text(const char* reference);
+void cold_release();
+void cold_reset();
+int cold_file_frame(int fd, const char* data, size_t length);
+char* cold_file_expand(const char* filename, char* data, size_t* length);
+
+// Function prototypes for the diagnosis and prescription dictionaries
+uint32_t dictionary_code(struct Dictionary* dictionary, const char* text);
+uint32_t dictionary_find(struct Dictionary* dictionary, const char* text);
+const char* dictionary_string(struct Dictionary* dictionary, uint32_t code);
+void dictionary_rehash(struct Dictionary* dictionary, size_t capacity);
+void dictionary_reset(struct Dictionary* dictionary);
+uint64_t notes_append(const char* medical_history, const char* diagnosis, const char* prescription);
+uint32_t patient_diagnosis_code(struct Patient* patient);
+uint32_t patient_prescription_code(struct Patient* patient);
+long filter_patients(struct NameIndex* index, const char* field, const char* value, uint32_t** results);
+
+// Function prototypes for the column store and group-by queries
+void columns_add(struct Patient* patient);
+void columns_remove(struct Patient* patient);
+void columns_update(struct Patient* patient);
+void columns_reset();
+void columns_build(struct NameIndex* index);
+int group_key_parse(struct GroupKey* key, const char* text);
+void group_key_ids(struct GroupKey* key, size_t begin, size_t count, uint32_t* ids);
+void* group_scan(void* arg);
+long group_by(struct NameIndex* index, struct GroupBy* query, char** keys, int key_count);
+void group_output(struct Output* out, struct GroupBy* query);
+void group_free(struct GroupBy* query);
+uint32_t patient_field(struct Patient* patient, int column);
+int secondary_column(const char* name);
+uint32_t secondary_hash(const uint32_t* key, int count);
+void secondary_rehash(struct SecondaryIndex* secondary, size_t capacity);
+long secondary_find(struct SecondaryIndex* secondary, const uint32_t* key, int create);
+void secondary_index_patient(struct SecondaryIndex* secondary, struct Patient* patient, int add);
+void secondary_add(struct Patient* patient);
+void secondary_remove(struct Patient* patient);
+void secondary_update(struct Patient* patient, int add);
+void secondary_reset();
+void secondary_build(struct NameIndex* index, struct SecondaryIndex* secondary);
+int secondary_declare(struct NameIndex* index, const char* fields);
+void secondary_describe(struct SecondaryIndex* secondary, char* text, size_t size);
+int query_parse(struct NameIndex* index, struct Query* query, char** conditions, int count);
+uint64_t query_index_probe(struct SecondaryIndex* secondary, struct Query* query, uint32_t** handles, size_t* count);
+void query_plan(struct NameIndex* index, struct AgeIndex* ages, struct Query* query);
+int query_match(struct Query* query, struct Patient* patient);
+long query_run(struct NameIndex* index, struct AgeIndex* ages, struct Query* query, uint32_t** results);
+void query_explain(struct Output* out, struct Query* query);
+
+// Function prototypes for the B+tree name index
+uint64_t name_prefix(const char* name);
+int name_key_compare(uint64_t prefix, const char* name, uint64_t other_prefix, const char* other_name);
+int bpt_key_compare(uint64_t prefix, const char* name, uint32_t patient, uint64_t other_prefix, const char* other_name, uint32_t other_patient);
+void name_index_forget(struct NameIndex* index, struct AgeIndex* ages, struct Patient* patient);
+struct BptLeaf* name_index_first_leaf(struct NameIndex* index);
+struct BptLeaf* name_index_next_leaf(struct BptLeaf* leaf);
+size_t name_index_bulk_load(struct NameIndex* index, struct AgeIndex* ages, struct NameKey* keys, size_t count);
+void name_index_build(struct NameIndex* index, struct NameKey* keys, size_t count);
+void name_index_free_nodes(uint32_t node, int height);
+struct BptLeaf* name_index_seek(struct NameIndex* index, const char* name, int* pos);
+long name_search(struct NameIndex* index, const char* query, int max_edits, int prefix, size_t limit, struct NameMatch* matches);
+struct Patient* patient_at(uint32_t handle);
+
+// Function prototypes for the exact-name hash index
+uint32_t name_hash_of(const char* name);
+struct Patient* name_hash_find(struct NameHash* hash, const char* name);
+size_t name_hash_find_all(struct NameHash* hash, const char* name, uint32_t* handles, size_t max);
+void name_hash_insert(struct NameHash* hash, uint32_t tag, uint32_t handle);
+void name_hash_place(struct NameHash* hash, uint32_t tag, uint32_t handle);
+size_t name_hash_slot(struct NameHash* hash, uint32_t tag, uint32_t handle);
+void name_hash_remove(struct NameHash* hash, uint32_t tag, uint32_t handle);
+void name_hash_clear(struct NameHash* hash);
+
+// Function prototypes for the slab allocator
+uint32_t pool_alloc(struct SlabPool* pool);
+uint32_t pool_bump(struct SlabPool* pool);
+int pool_claim(struct SlabPool* pool, uint32_t handle);
+void* pool_at(struct SlabPool* pool, uint32_t handle);
+void pool_free(struct SlabPool* pool, uint32_t handle);
+void pool_reset(struct SlabPool* pool);
+void pool_adopt(struct SlabPool* pool, char* base, uint32_t used, uint32_t free_list, size_t live);
+void release_all_records(struct NameIndex* index, struct AgeIndex* ages);
+
+// Function prototypes for epoch-based reclamation
+void epoch_enter(int reader);
+void epoch_leave(int reader);
+void epoch_retire(void* memory, uint32_t patient);
+void epoch_reclaim();
+void epoch_close();
+void epoch_open();
+
+// Function prototypes for write batches
+size_t write_batch_text(struct WriteBatch* batch, const char* text);
+struct WriteOp* write_batch_stage(struct WriteBatch* batch, uint8_t kind, const char* name, uint32_t id, const char** fields, int field_count);
+struct WriteOp* write_batch_add(struct WriteBatch* batch, const char* name, int age, const char* gender, const char* medical_history, const char* diagnosis, const char* prescription);
+struct WriteOp* write_batch_update(struct WriteBatch* batch, const char* name, uint32_t id, const char* medical_history, const char* diagnosis, const char* prescription);
+struct WriteOp* write_batch_delete(struct WriteBatch* batch, const char* name, uint32_t id);
+void write_batch_clear(struct WriteBatch* batch);
+void write_batch_free(struct WriteBatch* batch);
+int write_key_compare(const void* a, const void* b);
+void write_batch_sort(struct WriteKey* keys, size_t count);
+int write_batch_fail(struct WriteBatch* batch, size_t op, const char* error);
+int write_batch_check(struct WriteBatch* batch, struct NameIndex* index, struct WriteKey* keys);
+struct Patient* write_batch_target(struct WriteBatch* batch, struct WriteOp* op);
+struct Patient* write_batch_apply(struct WriteBatch* batch, struct NameIndex* index, struct AgeIndex* ages, struct WriteOp* op, int merging);
+void write_batch_merge(struct WriteBatch* batch, struct NameIndex* index, struct AgeIndex* ages, struct WriteKey* keys);
+int write_batch_commit(struct WriteBatch* batch, struct NameIndex* index, struct AgeIndex* ages);
+
+// Function prototypes for binary snapshots
+int save_snapshot(struct NameIndex* index, struct AgeIndex* ages, const char* filename);
+int load_snapshot(struct NameIndex* index, struct AgeIndex* ages, const char* filename);
+int is_snapshot_file(const char* filename);
+int snapshot_range_valid(uint64_t offset, uint64_t length, size_t size);
+int snapshot_pool_valid(const struct SnapshotPool* pool, size_t object_size, size_t size);
+int snapshot_header_valid(const struct SnapshotHeader* header, size_t size);
+
+// Function prototypes for the write-ahead journal
+void journal_log_add(struct Patient* patient);
+void journal_log_update(struct Patient* patient);
+void journal_log_delete(struct Patient* patient);
+void journal_batch_begin();
+void journal_batch_end();
+void journal_commit();
+int journal_apply(uint8_t op, const char* cursor, const char* end, char** fields, size_t* capacities, struct NameIndex* index, struct AgeIndex* ages);
+void journal_compact();
+int journal_checkpoint();
+int journal_open_database(const char* database, struct NameIndex* index, struct AgeIndex* ages);
+void journal_close();
+
+// Function prototypes for batch, server and benchmark mode
+int run_batch(FILE* in, struct NameIndex* index, struct AgeIndex* ages);
+int batch_number(const char* field, long max);
+int batch_id(const char* field, uint32_t* id);
+int batch_stage(char** fields, int count, size_t line_number, struct Output* out, struct WriteBatch* batch);
+int batch_write_command(const char* command);
+int batch_reject(struct Output* out, size_t line_number, const char* reason, struct WriteBatch* batch);
+int batch_patient(struct NameIndex* index, int by_id, const char* field, struct Patient** patient);
+int run_server(const char* path, struct NameIndex* index, struct AgeIndex* ages);
+int run_bench(const char* sizes);
+FILE* status_output();
+
+// Function prototypes for the full-text index
+void text_index_add(struct Patient* patient);
+void text_index_remove(struct Patient* patient);
+void text_index_reset();
+long text_search(struct NameIndex* index, struct AgeIndex* ages, const char* query, uint32_t** results);
+
+// Function prototypes for metrics
+uint64_t clock_ns();
+void metrics_record(int op, uint64_t started);
+void metrics_report(struct Output* out, struct NameIndex* index, struct AgeIndex* ages);
+
+// Function prototypes for the age index
+void age_index_clear(struct AgeIndex* ages);
+void add_patient_by_age(struct AgeIndex* ages, struct Patient* new_patient);
+void remove_patient_by_age(struct AgeIndex* ages, struct Patient* patient);
+uint64_t count_patients_by_age_range(struct AgeIndex* ages, int min_age, int max_age);
+struct AgeRange search_patients_by_age_range(struct AgeIndex* ages, int min_age, int max_age);
+struct Patient* age_range_next(struct AgeRange* range);
+
+// Hand out one object, preferring recycled ones, then the bump pointer (adding a slab when it runs out)
+uint32_t pool_alloc(struct SlabPool* pool) {
+    uint32_t handle = pool->free_list;
+    if (handle != NO_HANDLE) {
+        pool->free_list = *(uint32_t*)pool_at(pool, handle);
+        pool->live++;
+        return handle;
+    }
+
+    handle = pool_bump(pool);
+    pool->live++;
+    return handle;
+}
+
+// Take the next never-used object, adding a slab when the last one is full
+uint32_t pool_bump(struct SlabPool* pool) {
+    uint32_t handle = pool->used++;
+    if ((handle >> SLAB_SHIFT) == pool->slab_count) {
+        if (pool->slab_count == pool->slab_capacity) {
+            // Readers may still be using the old array, so publish a copy and retire it
+            char** old_slabs = pool->slabs;
+            pool->slab_capacity = pool->slab_capacity ? pool->slab_capacity * 2 : 16;
+            char** slabs = (char**)malloc(pool->slab_capacity * sizeof(char*));
+            if (pool->slab_count > 0) {
+                memcpy(slabs, old_slabs, pool->slab_count * sizeof(char*));
+            }
+            STORE_RELEASE(pool->slabs, slabs);
+            epoch_retire(old_slabs, NO_HANDLE);
+        }
+        pool->slabs[pool->slab_count++] = (char*)malloc(SLAB_OBJECTS * pool->object_size);
+    }
+    return handle;
+}
+
+// Hand out one particular object, as journal replay must to give a patient back
+// the ID it had. Never-used objects skipped on the way join the free list.
+// Returns 0 if the object is in use.
+int pool_claim(struct SlabPool* pool, uint32_t handle) {
+    while (pool->used < handle) {
+        uint32_t skipped = pool_bump(pool);
+        pool->live++;
+        pool_free(pool, skipped);
+    }
+    if (pool->used == handle) {
+        pool_bump(pool);
+        pool->live++;
+        return 1;
+    }
+    uint32_t* link = &pool->free_list;
+    while (*link != NO_HANDLE && *link != handle) {
+        link = (uint32_t*)pool_at(pool, *link);
+    }
+    if (*link == NO_HANDLE) {
+        return 0;
+    }
+    *link = *(uint32_t*)pool_at(pool, handle);
+    pool->live++;
+    return 1;
+}
+
+void* pool_at(struct SlabPool* pool, uint32_t handle) {
+    return LOAD_ACQUIRE(pool->slabs)[handle >> SLAB_SHIFT] + (handle & (SLAB_OBJECTS - 1)) * pool->object_size;
+}
+
+// Return one object to the pool's free list
+void pool_free(struct SlabPool* pool, uint32_t handle) {
+    *(uint32_t*)pool_at(pool, handle) = pool->free_list;
+    pool->free_list = handle;
+    pool->live--;
+}
+
+// Forget every object at once; allocated slabs stay and are refilled from the start
+void pool_reset(struct SlabPool* pool) {
+    if (pool->borrowed > 0) {
+        memmove(pool->slabs, pool->slabs + pool->borrowed, (pool->slab_count - pool->borrowed) * sizeof(char*));
+        pool->slab_count -= pool->borrowed;
+        pool->borrowed = 0;
+    }
+    pool->used = 0;
+    pool->free_list = NO_HANDLE;
+    pool->live = 0;
+}
+
+// Make an empty pool use whole slabs that already sit in memory (a mapped snapshot)
+void pool_adopt(struct SlabPool* pool, char* base, uint32_t used, uint32_t free_list, size_t live) {
+    size_t count = ((size_t)used + SLAB_OBJECTS - 1) >> SLAB_SHIFT;
+    if (pool->slab_count + count > pool->slab_capacity) {
+        pool->slab_capacity = pool->slab_count + count;
+        pool->slabs = (char**)realloc(pool->slabs, pool->slab_capacity * sizeof(char*));
+    }
+    if (pool->slab_count > 0) {
+        memmove(pool->slabs + count, pool->slabs, pool->slab_count * sizeof(char*));
+    }
+    for (size_t i = 0; i < count; i++) {
+        pool->slabs[i] = base + i * SLAB_OBJECTS * pool->object_size;
+    }
+    pool->slab_count += count;
+    pool->borrowed = count;
+    pool->used = used;
+    pool->free_list = free_list;
+    pool->live = live;
+}
+
+// Start a read section: nothing retired from now on is freed until it ends. While
+// the writer applies a write batch the section waits for it, so it never sees
+// the batch half done.
+void epoch_enter(int reader) {
+    while (1) {
+        STORE_RELEASE(epochs.readers[reader].epoch, LOAD_ACQUIRE(epochs.global));
+        FENCE_FULL();  // The epoch is visible before any index is read, and before closed is checked
+        if (!LOAD_ACQUIRE(epochs.closed)) {
+            return;
+        }
+        STORE_RELEASE(epochs.readers[reader].epoch, 0);
+#ifndef _WIN32
+        while (LOAD_ACQUIRE(epochs.closed)) {
+            sched_yield();
+        }
+#endif
+    }
+}
+
+void epoch_leave(int reader) {
+    STORE_RELEASE(epochs.readers[reader].epoch, 0);
+}
+
+// Free a block and/or a patient once no reader can reach it any more
+void epoch_retire(void* memory, uint32_t patient) {
+    if (!epochs.active) {
+        free(memory);
+        if (patient != NO_HANDLE) {
+            pool_free(&patient_pool, patient);
+        }
+        return;
+    }
+    if (epochs.retired_count == epochs.retired_capacity) {
+        epochs.retired_capacity = epochs.retired_capacity ? epochs.retired_capacity * 2 : 64;
+        epochs.retired = (struct Retired*)realloc(epochs.retired, epochs.retired_capacity * sizeof(struct Retired));
+    }
+    struct Retired* item = &epochs.retired[epochs.retired_count++];
+    item->epoch = epochs.global;
+    item->memory = memory;
+    item->patient = patient;
+}
+
+// Writer: stop new read sections from starting and wait for the running ones to
+// end. A reader publishes its epoch before it checks closed and the writer sets
+// closed before it checks the epochs, so one of the two always sees the other.
+void epoch_close() {
+    if (!epochs.active) {
+        return;
+    }
+    STORE_RELEASE(epochs.closed, 1);
+    FENCE_FULL();
+    for (int i = 0; i < EPOCH_MAX_READERS; i++) {
+        while (LOAD_ACQUIRE(epochs.readers[i].epoch) != 0) {
+#ifndef _WIN32
+            sched_yield();
+#endif
+        }
+    }
+}
+
+// Writer: let read sections start again
+void epoch_open() {
+    STORE_RELEASE(epochs.closed, 0);
+}
+
+// Writer: open a new epoch, then free whatever was retired before the oldest
+// epoch a reader is still in
+void epoch_reclaim() {
+    if (epochs.retired_count == 0) {
+        return;
+    }
+    STORE_RELEASE(epochs.global, epochs.global + 1);
+    FENCE_FULL();  // Unlinks and the new epoch are visible before the readers are scanned
+    uint64_t oldest = epochs.global;
+    for (int i = 0; i < EPOCH_MAX_READERS; i++) {
+        uint64_t epoch = LOAD_ACQUIRE(epochs.readers[i].epoch);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < epochs.retired_count; i++) {
+        struct Retired* item = &epochs.retired[i];
+        if (item->epoch < oldest) {
+            free(item->memory);
+            if (item->patient != NO_HANDLE) {
+                pool_free(&patient_pool, item->patient);
+            }
+        } else {
+            epochs.retired[kept++] = *item;
+        }
+    }
+    epochs.retired_count = kept;
+}
+
+// Release every patient and index node of the current dataset
+void release_all_records(struct NameIndex* index, struct AgeIndex* ages) {
+    shards_close();
+    pool_reset(&patient_pool);
+    pool_reset(&leaf_pool);
+    pool_reset(&inner_pool);
+    heap_reset();
+    index->root = NO_HANDLE;
+    index->height = 0;
+    index->count = 0;
+    name_hash_clear(&index->hash);
+    age_index_clear(ages);
+    text_index_reset();
+    columns_reset();
+    secondary_reset();
+
+    if (snapshot_base != NULL) {
+#ifdef _WIN32
+        free(snapshot_base);
+#else
+        munmap(snapshot_base, snapshot_size);
+#endif
+        snapshot_base = NULL;
+        snapshot_size = 0;
+    }
+}
+
+// Monotonic clock in nanoseconds, for metrics and the benchmark
+uint64_t clock_ns() {
+    struct timespec now;
+#ifdef _WIN32
+    timespec_get(&now, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+#ifndef NO_METRICS
+// Count one call of an operation that began at `started`
+void metrics_record(int op, uint64_t started) {
+    uint64_t elapsed = clock_ns() - started;
+#if defined(__GNUC__) || defined(__clang__)
+    int bucket = elapsed != 0 ? 64 - __builtin_clzll(elapsed) : 0;
+#else
+    int bucket = 0;
+    while (bucket < METRIC_BUCKETS && elapsed >> bucket != 0) {
+        bucket++;
+    }
+#endif
+    if (bucket > METRIC_BUCKETS - 1) {
+        bucket = METRIC_BUCKETS - 1;
+    }
+    ADD_RELAXED(metrics.ops[op].calls, 1);
+    ADD_RELAXED(metrics.ops[op].total_ns, elapsed);
+    ADD_RELAXED(metrics.ops[op].buckets[bucket], 1);
+}
+#endif
+
+// Write one metric as a "key: value" line, or a key/value row in TSV
+void metrics_field(struct Output* out, const char* key, unsigned long long value) {
+    output_string(out, key);
+    output_string(out, out->format == OUTPUT_TSV ? "\t" : ": ");
+    output_uint(out, value);
+    output_string(out, "\n");
+}
+
+// Report the operation metrics and the shape of the indexes and the memory
+// behind them. Averages are given in hundredths to stay in integers.
+void metrics_report(struct Output* out, struct NameIndex* index, struct AgeIndex* ages) {
+#ifndef NO_METRICS
+    char key[64];
+    static const char* names[METRIC_OPS] = {"create", "add", "search", "delete", "range", "save", "load", "find", "name_search", "group", "query", "batch"};
+    for (int op = 0; op < METRIC_OPS; op++) {
+        struct OpMetrics* entry = &metrics.ops[op];
+        uint64_t calls = LOAD_RELAXED(entry->calls);
+        snprintf(key, sizeof(key), "%s.calls", names[op]);
+        metrics_field(out, key, calls);
+        snprintf(key, sizeof(key), "%s.total_ns", names[op]);
+        metrics_field(out, key, LOAD_RELAXED(entry->total_ns));
+        for (int bucket = 0; bucket < METRIC_BUCKETS; bucket++) {
+            uint64_t count = LOAD_RELAXED(entry->buckets[bucket]);
+            if (count > 0) {
+                if (bucket < METRIC_BUCKETS - 1) {
+                    snprintf(key, sizeof(key), "%s.latency_ns_below_%llu", names[op], 1ull << bucket);
+                } else {
+                    snprintf(key, sizeof(key), "%s.latency_ns_above_%llu", names[op], 1ull << (bucket - 1));
+                }
+                metrics_field(out, key, count);
+            }
+        }
+    }
+    uint64_t lookups = LOAD_RELAXED(metrics.hash_lookups);
+    uint64_t descents = LOAD_RELAXED(metrics.tree_descents);
+    metrics_field(out, "name_hash.lookups", lookups);
+    metrics_field(out, "name_hash.probes_per_lookup_x100", lookups > 0 ? LOAD_RELAXED(metrics.hash_probes) * 100 / lookups : 0);
+    metrics_field(out, "name_tree.descents", descents);
+    metrics_field(out, "name_tree.nodes_per_descent_x100", descents > 0 ? LOAD_RELAXED(metrics.tree_nodes) * 100 / descents : 0);
+    metrics_field(out, "range.rows", LOAD_RELAXED(metrics.range_rows));
+    metrics_field(out, "query.rows", LOAD_RELAXED(metrics.query_rows));
+    metrics_field(out, "batch.changes", LOAD_RELAXED(metrics.batch_changes));
+    metrics_field(out, "batch.merges", LOAD_RELAXED(metrics.batch_merges));
+#endif
+
+    metrics_field(out, "name_tree.height", (unsigned long long)index->height);
+    metrics_field(out, "name_tree.leaves", leaf_pool.live);
+    metrics_field(out, "name_tree.inner_nodes", inner_pool.live);
+    metrics_field(out, "name_tree.leaf_fill_percent", leaf_pool.live > 0 ? index->count * 100 / (leaf_pool.live * BPT_LEAF_KEYS) : 0);
+    metrics_field(out, "name_hash.capacity", index->hash.capacity);
+    metrics_field(out, "name_hash.load_percent", index->hash.capacity > 0 ? index->hash.count * 100 / index->hash.capacity : 0);
+    size_t occupied = 0;
+    uint64_t largest = 0;
+    for (int age = 0; age <= MAX_AGE; age++) {
+        uint64_t size = count_patients_by_age_range(ages, age, age);
+        occupied += size > 0;
+        largest = size > largest ? size : largest;
+    }
+    uint64_t postings = 0;
+    uint64_t text_bytes = text_index.slot_capacity * sizeof(uint32_t) + text_index.term_capacity * sizeof(struct Postings);
+    for (size_t i = 0; i < text_index.term_count; i++) {
+        struct Postings* list = &text_index.terms[i];
+        postings += list->count + list->added_count - list->removed_count;
+        text_bytes += list->capacity + list->skip_capacity * sizeof(struct PostingSkip);
+    }
+    metrics_field(out, "text_index.built", (unsigned long long)text_index.built);
+    metrics_field(out, "text_index.terms", text_index.term_count);
+    metrics_field(out, "text_index.postings", postings);
+    metrics_field(out, "dictionary.diagnoses", diagnosis_dictionary.count);
+    metrics_field(out, "dictionary.prescriptions", prescription_dictionary.count);
+    metrics_field(out, "dictionary.genders", (unsigned long long)gender_count);
+    metrics_field(out, "columns.built", (unsigned long long)columns.built);
+    metrics_field(out, "columns.rows", columns.count);
+    uint64_t secondary_lists = 0, secondary_bytes = 0;
+    for (int i = 0; i < secondary_index_count; i++) {
+        secondary_lists += secondary_indexes[i].list_count;
+        secondary_bytes += secondary_indexes[i].list_capacity * sizeof(struct SecondaryList) + secondary_indexes[i].slot_capacity * sizeof(uint32_t);
+        for (size_t list = 0; list < secondary_indexes[i].list_count; list++) {
+            struct Postings* list_postings = &secondary_indexes[i].lists[list].postings;
+            secondary_bytes += list_postings->capacity + list_postings->skip_capacity * sizeof(struct PostingSkip);
+        }
+    }
+    metrics_field(out, "secondary_index.count", (unsigned long long)secondary_index_count);
+    metrics_field(out, "secondary_index.lists", secondary_lists);
+    metrics_field(out, "age_index.patients", ages->count);
+    metrics_field(out, "age_index.buckets_used", occupied);
+    metrics_field(out, "age_index.largest_bucket", largest);
+
+    // Mapped snapshot memory is counted with the rest: it is resident once touched
+    struct SlabPool* pools[3] = {&patient_pool, &leaf_pool, &inner_pool};
+    uint64_t pool_bytes = 0;
+    for (int i = 0; i < 3; i++) {
+        pool_bytes += (uint64_t)pools[i]->slab_count * SLAB_OBJECTS * pools[i]->object_size;
+    }
+    metrics_field(out, "memory.pool_bytes", pool_bytes);
+    uint64_t heap_chunks = heap_pool.fd >= 0 ? string_heap.borrowed + heap_pool.frame_count : string_heap.chunk_count;
+    metrics_field(out, "memory.heap_bytes", heap_chunks * HEAP_CHUNK_SIZE);
+    metrics_field(out, "memory.heap_used_bytes", string_heap.used);
+    if (heap_pool.fd >= 0) {
+        metrics_field(out, "heap_pool.frames", heap_pool.frame_count);
+        metrics_field(out, "heap_pool.frame_limit", heap_pool.frame_limit);
+        metrics_field(out, "heap_pool.faults", heap_pool.faults);
+        metrics_field(out, "heap_pool.evictions", heap_pool.evictions);
+        metrics_field(out, "heap_pool.writebacks", heap_pool.writebacks);
+    }
+    if (cold_store.enabled) {
+        metrics_field(out, "cold.blocks", cold_store.blocks);
+        metrics_field(out, "cold.raw_bytes", cold_store.raw_bytes);
+        metrics_field(out, "cold.stored_bytes", cold_store.stored_bytes);
+        metrics_field(out, "cold.open_bytes", cold_store.open_length);
+        metrics_field(out, "cold.cache_hits", cold_store.hits);
+        metrics_field(out, "cold.cache_misses", cold_store.misses);
+        metrics_field(out, "memory.cold_cache_bytes", (cold_store.cache_count + 1) * (uint64_t)COLD_BLOCK_MAX);
+    }
+    metrics_field(out, "memory.hash_bytes", index->hash.capacity * sizeof(struct NameHashSlot));
+    metrics_field(out, "memory.text_index_bytes", text_bytes);
+    metrics_field(out, "memory.column_bytes", columns.capacity * (2 + 3 * sizeof(uint32_t)) + columns.row_capacity * sizeof(uint32_t));
+    metrics_field(out, "memory.secondary_index_bytes", secondary_bytes);
+    metrics_field(out, "memory.retired_blocks", epochs.retired_count);
+}
+
+// Empty every age bucket
+void age_index_clear(struct AgeIndex* ages) {
+    for (int age = 0; age <= MAX_AGE; age++) {
+        ages->heads[age] = NO_HANDLE;
+    }
+    memset(ages->fenwick, 0, sizeof(ages->fenwick));
+    ages->count = 0;
+}
+
+// Adjust the size of one age bucket in the Fenwick tree
+void age_index_adjust(struct AgeIndex* ages, int age, int delta) {
+    for (int i = age + 1; i <= MAX_AGE + 1; i += i & -i) {
+        ages->fenwick[i] += (uint32_t)delta;
+    }
+}
+
+// Number of patients aged 0 to `age`
+uint64_t age_index_prefix(struct AgeIndex* ages, int age) {
+    uint64_t total = 0;
+    for (int i = age + 1; i > 0; i -= i & -i) {
+        total += ages->fenwick[i];
+    }
+    return total;
+}
+
+// Add patient to the front of their age bucket. Buckets are read-copy-update
+// lists: forward links are published with release stores, so a concurrent scan
+// sees each bucket either with or without the patient. Back links are only
+// followed by the writer.
+void add_patient_by_age(struct AgeIndex* ages, struct Patient* new_patient) {
+    uint32_t head = ages->heads[new_patient->age];
+    new_patient->age_prev = NO_HANDLE;
+    new_patient->age_next = head;
+    if (head != NO_HANDLE) {
+        patient_at(head)->age_prev = new_patient->handle;
+    }
+    STORE_RELEASE(ages->heads[new_patient->age], new_patient->handle);
+    age_index_adjust(ages, new_patient->age, 1);
+    ages->count++;
+}
+
+// Unlink a patient from their age bucket. The patient keeps its forward link, so
+// a scan standing on it carries on; it is only reused after free_patient retires it.
+void remove_patient_by_age(struct AgeIndex* ages, struct Patient* patient) {
+    if (patient->age_prev != NO_HANDLE) {
+        STORE_RELEASE(patient_at(patient->age_prev)->age_next, patient->age_next);
+    } else {
+        STORE_RELEASE(ages->heads[patient->age], patient->age_next);
+    }
+    if (patient->age_next != NO_HANDLE) {
+        patient_at(patient->age_next)->age_prev = patient->age_prev;
+    }
+    age_index_adjust(ages, patient->age, -1);
+    ages->count--;
+}
+
+// Count the patients within an age range without visiting them
+uint64_t count_patients_by_age_range(struct AgeIndex* ages, int min_age, int max_age) {
+    if (min_age < 0) {
+        min_age = 0;
+    }
+    if (max_age > MAX_AGE) {
+        max_age = MAX_AGE;
+    }
+    if (min_age > max_age) {
+        return 0;
+    }
+    return age_index_prefix(ages, max_age) - (min_age > 0 ? age_index_prefix(ages, min_age - 1) : 0);
+}
+
+// Start a scan of the patients within an age range; age_range_next hands them out
+struct AgeRange search_patients_by_age_range(struct AgeIndex* ages, int min_age, int max_age) {
+    struct AgeRange range;
+    range.index = ages;
+    range.age = min_age < 0 ? 0 : min_age;
+    range.max_age = max_age > MAX_AGE ? MAX_AGE : max_age;
+    range.next = range.age <= range.max_age ? LOAD_ACQUIRE(ages->heads[range.age]) : NO_HANDLE;
+#ifndef NO_METRICS
+    range.started = clock_ns();
+    range.rows = 0;
+#endif
+    return range;
+}
+
+// Next patient of an age range scan, or NULL when it is done
+struct Patient* age_range_next(struct AgeRange* range) {
+    while (range->next == NO_HANDLE) {
+        if (range->age >= range->max_age) {
+#ifndef NO_METRICS
+            if (range->started != 0) {  // Count the scan once even if it is asked again
+                METRIC_STOP(METRIC_RANGE, range->started);
+                METRIC_COUNT(range_rows, range->rows);
+                range->started = 0;
+            }
+#endif
+            return NULL;
+        }
+        range->age++;
+        range->next = LOAD_ACQUIRE(range->index->heads[range->age]);
+    }
+    struct Patient* patient = patient_at(range->next);
+    range->next = LOAD_ACQUIRE(patient->age_next);
+#ifndef NO_METRICS
+    range->rows++;
+#endif
+    return patient;
+}
+
+int text_compare_handles(const void* a, const void* b) {
+    uint32_t left = *(const uint32_t*)a;
+    uint32_t right = *(const uint32_t*)b;
+    return left < right ? -1 : left > right;
+}
+
+void text_push(uint32_t** array, size_t* count, size_t* capacity, uint32_t value) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        *array = (uint32_t*)realloc(*array, *capacity * sizeof(uint32_t));
+    }
+    (*array)[(*count)++] = value;
+}
+
+int text_word_byte(unsigned char c) {
+    return isalnum(c) || c >= 0x80;
+}
+
+// Copy the next word of the text at *cursor into `token`, lower-cased and cut to
+// TEXT_MAX_TERM bytes, and return its length, or 0 when there are no more. Words
+// are runs of letters, digits and non-ASCII bytes.
+size_t text_next_token(const char** cursor, char* token) {
+    const unsigned char* at = (const unsigned char*)*cursor;
+    while (*at != '\0' && !text_word_byte(*at)) {
+        at++;
+    }
+    size_t length = 0;
+    for (; text_word_byte(*at); at++) {
+        if (length < TEXT_MAX_TERM) {
+            token[length++] = (char)tolower(*at);
+        }
+    }
+    token[length] = '\0';
+    *cursor = (const char*)at;
+    return length;
+}
+
+uint32_t text_hash(const char* token) {
+    uint32_t hash = 2166136261u;  // FNV-1a
+    for (; *token != '\0'; token++) {
+        hash = (hash ^ (uint8_t)*token) * 16777619u;
+    }
+    return hash;
+}
+
+// Look a term up, adding it when `create` is set. Returns its id or -1.
+long text_term_find(const char* token, int create) {
+    if (create && (text_index.term_count + 1) * 2 > text_index.slot_capacity) {
+        size_t capacity = text_index.slot_capacity ? text_index.slot_capacity * 2 : 1024;
+        uint32_t* slots = (uint32_t*)calloc(capacity, sizeof(uint32_t));
+        for (size_t id = 0; id < text_index.term_count; id++) {
+            size_t slot = text_hash(text_index.terms[id].term) & (capacity - 1);
+            while (slots[slot] != 0) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            slots[slot] = (uint32_t)id + 1;
+        }
+        free(text_index.slots);
+        text_index.slots = slots;
+        text_index.slot_capacity = capacity;
+    }
+    if (text_index.slot_capacity == 0) {
+        return -1;
+    }
+
+    size_t mask = text_index.slot_capacity - 1;
+    for (size_t slot = text_hash(token) & mask;; slot = (slot + 1) & mask) {
+        uint32_t entry = text_index.slots[slot];
+        if (entry == 0) {
+            if (!create) {
+                return -1;
+            }
+            if (text_index.term_count == text_index.term_capacity) {
+                text_index.term_capacity = text_index.term_capacity ? text_index.term_capacity * 2 : 256;
+                text_index.terms = (struct Postings*)realloc(text_index.terms, text_index.term_capacity * sizeof(struct Postings));
+            }
+            struct Postings* list = &text_index.terms[text_index.term_count];
+            memset(list, 0, sizeof(struct Postings));
+            strcpy(list->term, token);
+            text_index.slots[slot] = (uint32_t)text_index.term_count + 1;
+            return (long)text_index.term_count++;
+        }
+        if (strcmp(text_index.terms[entry - 1].term, token) == 0) {
+            return (long)entry - 1;
+        }
+    }
+}
+
+void postings_put(struct Postings* list, uint32_t value) {
+    if (list->length + 5 > list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        list->data = (uint8_t*)realloc(list->data, list->capacity);
+    }
+    while (value >= 0x80) {
+        list->data[list->length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    list->data[list->length++] = (uint8_t)value;
+}
+
+uint32_t postings_get(const uint8_t** cursor) {
+    const uint8_t* at = *cursor;
+    uint32_t value = 0;
+    int shift = 0;
+    while (*at & 0x80) {
+        value |= (uint32_t)(*at++ & 0x7f) << shift;
+        shift += 7;
+    }
+    value |= (uint32_t)*at++ << shift;
+    *cursor = at;
+    return value;
+}
+
+// Append a handle larger than every handle in the list's data
+void postings_append(struct Postings* list, uint32_t handle) {
+    uint32_t base = list->count > 0 ? list->last : 0;
+    if (list->count % TEXT_SKIP_INTERVAL == 0) {
+        if (list->skip_count == list->skip_capacity) {
+            list->skip_capacity = list->skip_capacity ? list->skip_capacity * 2 : 4;
+            list->skips = (struct PostingSkip*)realloc(list->skips, list->skip_capacity * sizeof(struct PostingSkip));
+        }
+        struct PostingSkip* skip = &list->skips[list->skip_count++];
+        skip->first = handle;
+        skip->base = base;
+        skip->offset = (uint32_t)list->length;
+    }
+    postings_put(list, handle - base);
+    list->last = handle;
+    list->count++;
+}
+
+// Decode the list's data into `out`, which has room for list->count handles
+void postings_decode(struct Postings* list, uint32_t* out) {
+    const uint8_t* at = list->data;
+    uint32_t value = 0;
+    for (uint32_t i = 0; i < list->count; i++) {
+        value += postings_get(&at);
+        out[i] = value;
+    }
+}
+
+// Fold the buffered changes into the encoded data
+void postings_merge(struct Postings* list) {
+    if (list->added_count == 0 && list->removed_count == 0) {
+        return;
+    }
+    qsort(list->added, list->added_count, sizeof(uint32_t), text_compare_handles);
+    qsort(list->removed, list->removed_count, sizeof(uint32_t), text_compare_handles);
+    size_t old_count = list->count;
+    uint32_t* old = (uint32_t*)malloc((old_count > 0 ? old_count : 1) * sizeof(uint32_t));
+    postings_decode(list, old);
+    list->length = 0;
+    list->count = 0;
+    list->skip_count = 0;
+
+    // Removed handles are all in the old data and added ones are all missing from it
+    size_t i = 0, j = 0, k = 0;
+    while (i < old_count || j < list->added_count) {
+        if (j == list->added_count || (i < old_count && old[i] < list->added[j])) {
+            while (k < list->removed_count && list->removed[k] < old[i]) {
+                k++;
+            }
+            if (k == list->removed_count || list->removed[k] != old[i]) {
+                postings_append(list, old[i]);
+            }
+            i++;
+        } else {
+            postings_append(list, list->added[j++]);
+        }
+    }
+    list->added_count = 0;
+    list->removed_count = 0;
+    free(old);
+}
+
+// Take a handle out of a change buffer; returns 0 if it was not there
+int postings_cancel(uint32_t* array, size_t* count, uint32_t handle) {
+    for (size_t i = 0; i < *count; i++) {
+        if (array[i] == handle) {
+            array[i] = array[--*count];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Add a handle to a list or remove it. A handle is only added while it is absent
+// and only removed while it is present.
+void postings_change(struct Postings* list, uint32_t handle, int add) {
+    if (add) {
+        if (list->count == 0 || handle > list->last) {
+            postings_append(list, handle);
+            return;
+        }
+        // A recycled handle may be re-added before its removal was merged
+        if (!postings_cancel(list->removed, &list->removed_count, handle)) {
+            text_push(&list->added, &list->added_count, &list->added_capacity, handle);
+        }
+    } else if (!postings_cancel(list->added, &list->added_count, handle)) {
+        text_push(&list->removed, &list->removed_count, &list->removed_capacity, handle);
+    }
+    if (list->added_count + list->removed_count >= TEXT_MIN_PENDING + list->count / 256) {
+        postings_merge(list);
+    }
+}
+
+// Add a patient's handle to the list of every distinct word of their notes, or
+// remove it from them
+void text_index_patient(struct Patient* patient, int add) {
+    const char* fields[3] = {patient_medical_history(patient), patient_diagnosis(patient), patient_prescription(patient)};
+    char token[TEXT_MAX_TERM + 1];
+    size_t count = 0;
+    for (int i = 0; i < 3; i++) {
+        const char* cursor = fields[i];
+        while (text_next_token(&cursor, token) > 0) {
+            long id = text_term_find(token, add);
+            if (id >= 0) {
+                text_push(&text_index.scratch, &count, &text_index.scratch_capacity, (uint32_t)id);
+            }
+        }
+    }
+    qsort(text_index.scratch, count, sizeof(uint32_t), text_compare_handles);
+    for (size_t i = 0; i < count; i++) {
+        if (i == 0 || text_index.scratch[i] != text_index.scratch[i - 1]) {
+            postings_change(&text_index.terms[text_index.scratch[i]], patient->handle, add);
+        }
+    }
+}
+
+void text_index_add(struct Patient* patient) {
+    if (text_index.built) {
+        text_index_patient(patient, 1);
+    }
+}
+
+void text_index_remove(struct Patient* patient) {
+    if (text_index.built) {
+        text_index_patient(patient, 0);
+    }
+}
+
+// Drop the index; the next query builds it again
+void text_index_reset() {
+    for (size_t i = 0; i < text_index.term_count; i++) {
+        struct Postings* list = &text_index.terms[i];
+        free(list->data);
+        free(list->skips);
+        free(list->added);
+        free(list->removed);
+    }
+    free(text_index.terms);
+    free(text_index.slots);
+    free(text_index.scratch);
+    memset(&text_index, 0, sizeof(text_index));
+}
+
+// Index every patient, in handle order so the lists are built by appends alone
+void text_index_build(struct NameIndex* index) {
+    uint32_t* handles = (uint32_t*)malloc((index->count > 0 ? index->count : 1) * sizeof(uint32_t));
+    size_t count = 0;
+    for (struct BptLeaf* leaf = name_index_first_leaf(index); leaf != NULL; leaf = name_index_next_leaf(leaf)) {
+        for (int i = 0; i < leaf->count; i++) {
+            handles[count++] = leaf->patients[i];
+        }
+    }
+    qsort(handles, count, sizeof(uint32_t), text_compare_handles);
+    for (size_t i = 0; i < count; i++) {
+        text_index_patient(patient_at(handles[i]), 1);
+        heap_release();
+    }
+    free(handles);
+    text_index.built = 1;
+}
+
+void posting_cursor_open(struct PostingCursor* cursor, struct Postings* list) {
+    cursor->list = list;
+    cursor->at = list->data;
+    cursor->index = 0;
+    cursor->value = list->count > 0 ? postings_get(&cursor->at) : 0;
+}
+
+// Move to the first handle at or after `target`, jumping through the skip entries
+// first. Returns 0 when the list has no such handle.
+int posting_cursor_seek(struct PostingCursor* cursor, uint32_t target) {
+    struct Postings* list = cursor->list;
+    if (cursor->index >= list->count) {
+        return 0;
+    }
+    if (cursor->value >= target) {
+        return 1;
+    }
+    size_t block = cursor->index / TEXT_SKIP_INTERVAL;
+    size_t low = block + 1, high = list->skip_count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (list->skips[mid].first <= target) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low - 1 > block) {
+        struct PostingSkip* skip = &list->skips[low - 1];
+        cursor->at = list->data + skip->offset;
+        cursor->value = skip->base + postings_get(&cursor->at);
+        cursor->index = (uint32_t)((low - 1) * TEXT_SKIP_INTERVAL);
+    }
+    while (cursor->value < target) {
+        if (++cursor->index >= list->count) {
+            return 0;
+        }
+        cursor->value += postings_get(&cursor->at);
+    }
+    return 1;
+}
+
+int text_compare_lists(const void* a, const void* b) {
+    uint32_t left = text_index.terms[*(const uint32_t*)a].count;
+    uint32_t right = text_index.terms[*(const uint32_t*)b].count;
+    return left < right ? -1 : left > right;
+}
+
+// Patients matching one AND group: every listed term, within the age range. The
+// shortest list is decoded and the others only seeked through.
+size_t text_search_group(struct AgeIndex* ages, uint32_t* terms, size_t term_count, int min_age, int max_age, uint32_t** matches) {
+    size_t count = 0;
+    if (term_count == 0) {
+        // An age range alone
+        size_t capacity = 0;
+        *matches = NULL;
+        struct AgeRange range = search_patients_by_age_range(ages, min_age, max_age);
+        for (struct Patient* patient = age_range_next(&range); patient != NULL; patient = age_range_next(&range)) {
+            text_push(matches, &count, &capacity, patient->handle);
+        }
+        if (count > 0) {
+            qsort(*matches, count, sizeof(uint32_t), text_compare_handles);
+        }
+        return count;
+    }
+
+    for (size_t i = 0; i < term_count; i++) {
+        postings_merge(&text_index.terms[terms[i]]);
+    }
+    qsort(terms, term_count, sizeof(uint32_t), text_compare_lists);
+    struct Postings* shortest = &text_index.terms[terms[0]];
+    *matches = (uint32_t*)malloc((shortest->count > 0 ? shortest->count : 1) * sizeof(uint32_t));
+    postings_decode(shortest, *matches);
+    count = shortest->count;
+    for (size_t i = 1; i < term_count && count > 0; i++) {
+        struct PostingCursor cursor;
+        posting_cursor_open(&cursor, &text_index.terms[terms[i]]);
+        size_t kept = 0;
+        for (size_t j = 0; j < count; j++) {
+            if (!posting_cursor_seek(&cursor, (*matches)[j])) {
+                break;
+            }
+            if (cursor.value == (*matches)[j]) {
+                (*matches)[kept++] = (*matches)[j];
+            }
+        }
+        count = kept;
+    }
+    if (min_age > 0 || max_age < MAX_AGE) {
+        // Handles are in order, so this walks the patient slabs front to back
+        size_t kept = 0;
+        for (size_t j = 0; j < count; j++) {
+            int age = patient_at((*matches)[j])->age;
+            if (age >= min_age && age <= max_age) {
+                (*matches)[kept++] = (*matches)[j];
+            }
+        }
+        count = kept;
+    }
+    return count;
+}
+
+// Function to find patients by the words of their notes. A query is words joined
+// by AND (the default between words) and OR, which binds looser; "age:MIN-MAX"
+// limits an AND group to an age range. For example
+//     metformin AND age:50-70 OR insulin
+// Sets *results to the matching handles in ascending order and returns how many
+// there are, or -1 if the query is malformed.
+long text_search(struct NameIndex* index, struct AgeIndex* ages, const char* query, uint32_t** results) {
+    METRIC_START(started);
+    if (!text_index.built) {
+        text_index_build(index);
+    }
+
+    *results = NULL;
+    size_t result_count = 0;
+    const char* cursor = query;
+    int done = 0;
+    while (!done) {
+        // Parse one AND group up to the next OR
+        uint32_t terms[TEXT_MAX_QUERY_TERMS];
+        size_t term_count = 0;
+        int min_age = 0, max_age = MAX_AGE, has_age = 0, unknown = 0;
+        while (1) {
+            while (isspace((unsigned char)*cursor)) {
+                cursor++;
+            }
+            if (*cursor == '\0') {
+                done = 1;
+                break;
+            }
+            const char* word = cursor;
+            while (*cursor != '\0' && !isspace((unsigned char)*cursor)) {
+                cursor++;
+            }
+            size_t length = (size_t)(cursor - word);
+            if (length == 2 && strncmp(word, "OR", 2) == 0) {
+                break;
+            }
+            if (length == 3 && strncmp(word, "AND", 3) == 0) {
+                continue;
+            }
+            if (length > 4 && strncmp(word, "age:", 4) == 0) {
+                char* end;
+                long low = strtol(word + 4, &end, 10);
+                long high = *end == '-' ? strtol(end + 1, &end, 10) : low;
+                if (end != cursor || low < 0 || high > MAX_AGE || low > high) {
+                    free(*results);
+                    *results = NULL;
+                    return -1;
+                }
+                min_age = (int)(has_age && min_age > low ? min_age : low);
+                max_age = (int)(has_age && max_age < high ? max_age : high);
+                has_age = 1;
+                continue;
+            }
+            char text[TEXT_MAX_TERM * 4];
+            char token[TEXT_MAX_TERM + 1];
+            snprintf(text, sizeof(text), "%.*s", (int)length, word);
+            for (const char* at = text; text_next_token(&at, token) > 0;) {
+                long id = text_term_find(token, 0);
+                if (id < 0) {
+                    unknown = 1;
+                } else if (term_count == TEXT_MAX_QUERY_TERMS) {
+                    free(*results);
+                    *results = NULL;
+                    return -1;
+                } else {
+                    terms[term_count++] = (uint32_t)id;
+                }
+            }
+        }
+        if (unknown || (term_count == 0 && !has_age) || min_age > max_age) {
+            continue;
+        }
+
+        // OR the group's matches into the results
+        uint32_t* matches;
+        size_t match_count = text_search_group(ages, terms, term_count, min_age, max_age, &matches);
+        if (result_count == 0) {
+            free(*results);
+            *results = matches;
+            result_count = match_count;
+            continue;
+        }
+        uint32_t* merged = (uint32_t*)malloc((result_count + match_count) * sizeof(uint32_t));
+        size_t i = 0, j = 0, count = 0;
+        while (i < result_count || j < match_count) {
+            if (j == match_count || (i < result_count && (*results)[i] < matches[j])) {
+                merged[count++] = (*results)[i++];
+            } else {
+                if (i < result_count && (*results)[i] == matches[j]) {
+                    i++;
+                }
+                merged[count++] = matches[j++];
+            }
+        }
+        free(*results);
+        free(matches);
+        *results = merged;
+        result_count = count;
+    }
+    METRIC_STOP(METRIC_FIND, started);
+    return (long)result_count;
+}
+
+// Hand the buffered output to the OS
+void output_flush(struct Output* out) {
+    size_t written = 0;
+    while (written < out->length) {
+        long result = (long)write(out->fd, out->buffer + written, (unsigned)(out->length - written));
+        if (result <= 0) {
+            out->failed = 1;
+            break;
+        }
+        written += (size_t)result;
+    }
+    out->length = 0;
+}
+
+void output_bytes(struct Output* out, const char* data, size_t length) {
+    while (length > 0) {
+        if (out->length == out->capacity && out->fd < 0) {
+            out->capacity *= 2;
+            out->buffer = (char*)realloc(out->buffer, out->capacity);
+        } else if (out->length == out->capacity) {
+            output_flush(out);
+        }
+        size_t room = out->capacity - out->length;
+        size_t part = length < room ? length : room;
+        memcpy(out->buffer + out->length, data, part);
+        out->length += part;
+        data += part;
+        length -= part;
+    }
+}
+
+void output_string(struct Output* out, const char* text) {
+    output_bytes(out, text, strlen(text));
+}
+
+void output_uint(struct Output* out, unsigned long long value) {
+    char digits[20];
+    int count = 0;
+    do {
+        digits[sizeof(digits) - 1 - count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    output_bytes(out, digits + sizeof(digits) - count, (size_t)count);
+}
+
+// Copy a field, escaping what the format cannot carry verbatim: tabs, newlines and
+// backslashes for TSV; quotes, backslashes and control characters for JSON
+void output_field(struct Output* out, const char* text) {
+    if (out->format == OUTPUT_TEXT) {
+        output_string(out, text);
+        return;
+    }
+    const char* run = text;
+    for (const char* c = text; *c != '\0'; c++) {
+        unsigned char ch = (unsigned char)*c;
+        const char* escape = NULL;
+        char code[7];
+        if (ch == '\\') {
+            escape = "\\\\";
+        } else if (ch == '\t') {
+            escape = "\\t";
+        } else if (ch == '\n') {
+            escape = "\\n";
+        } else if (ch == '\r') {
+            escape = "\\r";
+        } else if (out->format == OUTPUT_JSON && ch == '"') {
+            escape = "\\\"";
+        } else if (out->format == OUTPUT_JSON && ch < 0x20) {
+            snprintf(code, sizeof(code), "\\u%04x", ch);
+            escape = code;
+        }
+        if (escape != NULL) {
+            output_bytes(out, run, (size_t)(c - run));
+            output_string(out, escape);
+            run = c + 1;
+        }
+    }
+    output_string(out, run);
+}
+
+// Start a listing; TSV gets a header row and JSON an array
+void output_open(struct Output* out, int fd, int format) {
+    if (fd == 1) {
+        fflush(stdout);  // Keep anything printf has buffered ahead of the records
+    }
+    out->fd = fd;
+    out->format = format;
+    out->buffer = (char*)malloc(OUTPUT_BUFFER_SIZE);
+    out->length = 0;
+    out->capacity = OUTPUT_BUFFER_SIZE;
+    out->records = 0;
+    out->failed = 0;
+    if (format == OUTPUT_TSV) {
+        output_string(out, "id\tname\tage\tgender\tmedical_history\tdiagnosis\tprescription\n");
+    } else if (format == OUTPUT_JSON) {
+        output_string(out, "[");
+    }
+}
+
+// Format one thread's share of a listing into its own buffer
+void* output_task_run(void* argument) {
+    struct OutputTask* task = (struct OutputTask*)argument;
+    for (size_t i = 0; i < task->count; i++) {
+        output_patient(&task->out, patient_at(task->handles[i]));
+    }
+    return NULL;
+}
+
+// Function to write a list of patients. A long list is cut into one slice per
+// core; each slice is formatted on its own thread and the slices are written in
+// order. A paged heap and the cold store are not thread-safe, so with either one
+// thread does it all.
+void output_patients(struct Output* out, const uint32_t* handles, size_t count) {
+    long threads = 1;
+#ifndef _WIN32
+    threads = heap_pool.fd < 0 && !cold_store.enabled ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+#endif
+    if ((size_t)threads > count / OUTPUT_MIN_THREAD_RECORDS) {
+        threads = (long)(count / OUTPUT_MIN_THREAD_RECORDS);
+    }
+    threads = threads < 1 ? 1 : threads > OUTPUT_MAX_THREADS ? OUTPUT_MAX_THREADS : threads;
+    if (threads == 1) {
+        for (size_t i = 0; i < count; i++) {
+            output_patient(out, patient_at(handles[i]));
+        }
+        return;
+    }
+
+    struct OutputTask tasks[OUTPUT_MAX_THREADS];
+    for (long t = 0; t < threads; t++) {
+        size_t begin = count * (size_t)t / (size_t)threads;
+        tasks[t].handles = handles + begin;
+        tasks[t].count = count * (size_t)(t + 1) / (size_t)threads - begin;
+        tasks[t].out.fd = -1;
+        tasks[t].out.format = out->format;
+        tasks[t].out.capacity = OUTPUT_BUFFER_SIZE;
+        tasks[t].out.buffer = (char*)malloc(OUTPUT_BUFFER_SIZE);
+        tasks[t].out.length = 0;
+        tasks[t].out.records = out->records + begin;  // So JSON separators come out right
+        tasks[t].out.failed = 0;
+    }
+
+#ifdef _WIN32
+    output_task_run(&tasks[0]);
+#else
+    pthread_t workers[OUTPUT_MAX_THREADS];
+    int running[OUTPUT_MAX_THREADS];
+    for (long t = 1; t < threads; t++) {
+        running[t] = pthread_create(&workers[t], NULL, output_task_run, &tasks[t]) == 0;
+    }
+    output_task_run(&tasks[0]);
+    for (long t = 1; t < threads; t++) {
+        if (running[t]) {
+            pthread_join(workers[t], NULL);
+        } else {
+            output_task_run(&tasks[t]);
+        }
+    }
+#endif
+
+    for (long t = 0; t < threads; t++) {
+        output_bytes(out, tasks[t].out.buffer, tasks[t].out.length);
+        free(tasks[t].out.buffer);
+    }
+    out->records += count;
+}
+
+// Format one patient in the listing's format
+void output_patient(struct Output* out, struct Patient* patient) {
+    // Read the notes offset once, so an update made meanwhile is seen whole or not at all
+    uint64_t record = LOAD_ACQUIRE(patient->notes);
+    const char* notes = heap_string(record & ~COLD_NOTES);
+    uint32_t codes[2];
+    memcpy(codes, notes, NOTES_CODES_SIZE);
+    const char* medical_history = record & COLD_NOTES ? cold_text(notes + NOTES_CODES_SIZE) : notes + NOTES_CODES_SIZE;
+    const char* diagnosis = dictionary_string(&diagnosis_dictionary, codes[0]);
+    const char* prescription = dictionary_string(&prescription_dictionary, codes[1]);
+    if (out->format == OUTPUT_TSV || out->format == OUTPUT_RECORDS) {
+        if (out->format == OUTPUT_TSV) {
+            output_uint(out, patient->handle);
+            output_string(out, "\t");
+        }
+        output_field(out, patient_name(patient));
+        output_string(out, "\t");
+        output_uint(out, patient->age);
+        output_string(out, "\t");
+        output_field(out, patient_gender(patient));
+        output_string(out, "\t");
+        output_field(out, medical_history);
+        output_string(out, "\t");
+        output_field(out, diagnosis);
+        output_string(out, "\t");
+        output_field(out, prescription);
+        output_string(out, "\n");
+    } else if (out->format == OUTPUT_JSON) {
+        output_string(out, out->records > 0 ? ",\n{\"id\":" : "\n{\"id\":");
+        output_uint(out, patient->handle);
+        output_string(out, ",\"name\":\"");
+        output_field(out, patient_name(patient));
+        output_string(out, "\",\"age\":");
+        output_uint(out, patient->age);
+        output_string(out, ",\"gender\":\"");
+        output_field(out, patient_gender(patient));
+        output_string(out, "\",\"medical_history\":\"");
+        output_field(out, medical_history);
+        output_string(out, "\",\"diagnosis\":\"");
+        output_field(out, diagnosis);
+        output_string(out, "\",\"prescription\":\"");
+        output_field(out, prescription);
+        output_string(out, "\"}");
+    } else {
+        output_string(out, "ID: ");
+        output_uint(out, patient->handle);
+        output_string(out, "\nName: ");
+        output_field(out, patient_name(patient));
+        output_string(out, "\nAge: ");
+        output_uint(out, patient->age);
+        output_string(out, "\nGender: ");
+        output_field(out, patient_gender(patient));
+        output_string(out, "\nMedical History: ");
+        output_field(out, medical_history);
+        output_string(out, "\nDiagnosis: ");
+        output_field(out, diagnosis);
+        output_string(out, "\nPrescription: ");
+        output_field(out, prescription);
+        output_string(out, "\n-----------------------------\n");
+    }
+    out->records++;
+    heap_release();  // The record is copied out, so its pages may go
+}
+
+// Finish the listing, write what is left and release the buffer
+void output_close(struct Output* out) {
+    if (out->format == OUTPUT_JSON) {
+        output_string(out, out->records > 0 ? "\n]\n" : "]\n");
+    }
+    output_flush(out);
+    free(out->buffer);
+    out->buffer = NULL;
+}
+
+// Map a format name to its code, or -1 if it is not one
+int output_format_code(const char* name) {
+    if (strcmp(name, "text") == 0) {
+        return OUTPUT_TEXT;
+    }
+    if (strcmp(name, "tsv") == 0) {
+        return OUTPUT_TSV;
+    }
+    if (strcmp(name, "json") == 0) {
+        return OUTPUT_JSON;
+    }
+    return -1;
+}
+
+// Function to create a new patient node
+struct Patient* create_patient(const char* name, int age, const char* gender, const char* medical_history, const char* diagnosis, const char* prescription) {
+    METRIC_START(started);
+    struct Patient* new_patient = fill_patient(pool_alloc(&patient_pool), name, age, gender, medical_history, diagnosis, prescription);
+    METRIC_STOP(METRIC_CREATE, started);
+    return new_patient;
+}
+
+// Set up the patient object `handle` once it is taken from the pool
+struct Patient* fill_patient(uint32_t handle, const char* name, int age, const char* gender, const char* medical_history, const char* diagnosis, const char* prescription) {
+    struct Patient* new_patient = patient_at(handle);
+    new_patient->handle = handle;
+    new_patient->name = heap_append(name);
+    new_patient->notes = notes_append(medical_history, diagnosis, prescription);
+    new_patient->age = (uint16_t)age;
+    new_patient->gender = gender_code(gender);
+    new_patient->age_prev = NO_HANDLE;
+    new_patient->age_next = NO_HANDLE;
+    return new_patient;
+}
+
+// Function to replace a patient's clinical notes. The new text is appended to the
+// heap; the old text stays there until the records are next saved and reloaded.
+void update_patient_notes(struct Patient* patient, const char* medical_history, const char* diagnosis, const char* prescription) {
+    text_index_remove(patient);
+    secondary_update(patient, 0);
+    STORE_RELEASE(patient->notes, notes_append(medical_history, diagnosis, prescription));
+    text_index_add(patient);
+    columns_update(patient);
+    secondary_update(patient, 1);
+}
+
+const char* patient_name(struct Patient* patient) {
+    return heap_string(patient->name);
+}
+
+const char* patient_gender(struct Patient* patient) {
+    return heap_string(gender_table[patient->gender]);
+}
+
+const char* patient_medical_history(struct Patient* patient) {
+    if (patient->notes & COLD_NOTES) {
+        return cold_text(heap_string((patient->notes & ~COLD_NOTES) + NOTES_CODES_SIZE));
+    }
+    return heap_string(patient->notes + NOTES_CODES_SIZE);
+}
+
+uint32_t patient_diagnosis_code(struct Patient* patient) {
+    uint32_t code;
+    memcpy(&code, heap_string(patient->notes & ~COLD_NOTES), sizeof(code));
+    return code;
+}
+
+uint32_t patient_prescription_code(struct Patient* patient) {
+    uint32_t code;
+    memcpy(&code, heap_string(patient->notes & ~COLD_NOTES) + sizeof(uint32_t), sizeof(code));
+    return code;
+}
+
+const char* patient_diagnosis(struct Patient* patient) {
+    return dictionary_string(&diagnosis_dictionary, patient_diagnosis_code(patient));
+}
+
+const char* patient_prescription(struct Patient* patient) {
+    return dictionary_string(&prescription_dictionary, patient_prescription_code(patient));
+}
+
+// Reserve `size` bytes that do not straddle a chunk boundary; returns their
+// offset and points *dest at them
+uint64_t heap_reserve(uint64_t size, char** dest) {
+    uint64_t offset = string_heap.used;
+    if ((offset & (HEAP_CHUNK_SIZE - 1)) + size > HEAP_CHUNK_SIZE) {
+        offset = (offset + HEAP_CHUNK_SIZE - 1) & ~(HEAP_CHUNK_SIZE - 1);
+    }
+    size_t chunk = (size_t)(offset >> HEAP_CHUNK_SHIFT);
+    if (chunk == string_heap.chunk_count) {
+        string_heap.chunks[chunk] = heap_pool.fd >= 0 ? heap_pool_frame((uint32_t)chunk) : (char*)malloc(HEAP_CHUNK_SIZE);
+        string_heap.chunk_count++;
+    }
+
+    char* base = string_heap.chunks[chunk];
+    if (heap_pool.fd >= 0) {
+        base = heap_page(chunk);
+        heap_pool.flags[chunk] |= HEAP_PAGE_DIRTY;
+    }
+    *dest = base + (offset & (HEAP_CHUNK_SIZE - 1));
+    string_heap.used = offset + size;
+    return offset;
+}
+
+// Append a string and return its offset
+uint64_t heap_append(const char* text) {
+    size_t length = strlen(text) + 1;
+    char* dest;
+    uint64_t offset = heap_reserve(length, &dest);
+    memcpy(dest, text, length);
+    return offset;
+}
+
+// Append a notes record: the dictionary codes, then the medical history, or a
+// reference to it in the cold store
+uint64_t notes_append(const char* medical_history, const char* diagnosis, const char* prescription) {
+    uint32_t codes[2];
+    codes[0] = dictionary_code(&diagnosis_dictionary, diagnosis);
+    codes[1] = dictionary_code(&prescription_dictionary, prescription);
+    if (cold_store.enabled) {
+        return cold_append(medical_history, codes);
+    }
+    size_t length = strlen(medical_history) + 1;
+    char* dest;
+    uint64_t offset = heap_reserve(NOTES_CODES_SIZE + length, &dest);
+    memcpy(dest, codes, NOTES_CODES_SIZE);
+    memcpy(dest + NOTES_CODES_SIZE, medical_history, length);
+    return offset;
+}
+
+const char* heap_string(uint64_t offset) {
+    size_t page = (size_t)(offset >> HEAP_CHUNK_SHIFT);
+    char* chunk = heap_pool.fd >= 0 ? heap_page(page) : string_heap.chunks[page];
+    return chunk + (offset & (HEAP_CHUNK_SIZE - 1));
+}
+
+// Drop every string at once; allocated chunks stay for the next dataset
+void heap_reset() {
+    if (heap_pool.fd >= 0) {
+        heap_pool_clear();
+    }
+    if (string_heap.borrowed > 0) {
+        memmove(string_heap.chunks, string_heap.chunks + string_heap.borrowed,
+                (string_heap.chunk_count - string_heap.borrowed) * sizeof(char*));
+        string_heap.chunk_count -= string_heap.borrowed;
+        string_heap.borrowed = 0;
+    }
+    string_heap.used = 0;
+    cold_reset();
+    gender_count = 0;
+    dictionary_reset(&diagnosis_dictionary);
+    dictionary_reset(&prescription_dictionary);
+}
+
+// Make an empty heap read its first `used` bytes from memory that is already laid
+// out chunk by chunk (a mapped snapshot). New strings start in a fresh chunk.
+void heap_adopt(char* base, uint64_t used) {
+    size_t count = (size_t)((used + HEAP_CHUNK_SIZE - 1) >> HEAP_CHUNK_SHIFT);
+    memmove(string_heap.chunks + count, string_heap.chunks, string_heap.chunk_count * sizeof(char*));
+    for (size_t i = 0; i < count; i++) {
+        string_heap.chunks[i] = base + i * HEAP_CHUNK_SIZE;
+    }
+    string_heap.chunk_count += count;
+    string_heap.borrowed = count;
+    string_heap.used = (uint64_t)count << HEAP_CHUNK_SHIFT;
+}
+
+// Unpin every page: the caller holds no heap pointers. Frames taken over the
+// limit while everything was pinned are given back.
+void heap_release() {
+    if (cold_store.enabled) {
+        cold_release();
+    }
+    if (heap_pool.fd < 0) {
+        return;
+    }
+    heap_pool.generation++;
+    while (heap_pool.frame_count > heap_pool.frame_limit) {
+        size_t frame = heap_pool_victim();
+        if (frame == heap_pool.frame_count) {
+            break;
+        }
+        uint32_t page = heap_pool.frame_pages[frame];
+        free(string_heap.chunks[page]);
+        string_heap.chunks[page] = NULL;
+        heap_pool.frame_pages[frame] = heap_pool.frame_pages[--heap_pool.frame_count];
+        heap_pool.evictions++;
+    }
+    if (heap_pool.hand >= heap_pool.frame_count) {
+        heap_pool.hand = 0;
+    }
+}
+
+// Function to page the string heap through `path`, keeping at most `megabytes`
+// of it in memory. The file is scratch space: it is created here, unlinked at once
+// and only read back by this process (and its forked savers).
+int heap_pool_open(const char* path, size_t megabytes) {
+#ifdef _WIN32
+    (void)path;
+    (void)megabytes;
+    printf("Paged storage is not available on this platform.\n");
+    return 0;
+#else
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        printf("Error creating page file %s (it must not exist yet).\n", path);
+        return 0;
+    }
+    unlink(path);
+    heap_pool.fd = fd;
+    heap_pool.owner = (long)getpid();
+    heap_pool.frame_limit = (size_t)(((uint64_t)megabytes << 20) / HEAP_CHUNK_SIZE);
+    if (heap_pool.frame_limit < HEAP_POOL_MIN_FRAMES) {
+        heap_pool.frame_limit = HEAP_POOL_MIN_FRAMES;
+    }
+    heap_pool.flags = (uint8_t*)calloc(HEAP_MAX_CHUNKS, sizeof(uint8_t));
+    heap_pool.stamps = (uint32_t*)calloc(HEAP_MAX_CHUNKS, sizeof(uint32_t));
+    return 1;
+#endif
+}
+
+// Return a page that is in memory, reading it from the page file if it was
+// evicted, and pin it until the next heap_release
+char* heap_page(size_t page) {
+    char* chunk = string_heap.chunks[page];
+    if (page < string_heap.borrowed) {
+        return chunk;
+    }
+    if (chunk == NULL) {
+        chunk = heap_pool_frame((uint32_t)page);
+#ifndef _WIN32
+        ssize_t got = pread(heap_pool.fd, chunk, HEAP_CHUNK_SIZE, (off_t)((heap_pool.file_base + page) << HEAP_CHUNK_SHIFT));
+        if (got < 0) {
+            printf("Error reading the page file.\n");
+            exit(1);
+        }
+        memset(chunk + got, 0, HEAP_CHUNK_SIZE - (size_t)got);  // Never written: only the tail past `used`
+#endif
+        string_heap.chunks[page] = chunk;
+        heap_pool.faults++;
+    }
+    heap_pool.flags[page] |= HEAP_PAGE_REFERENCED;
+    heap_pool.stamps[page] = heap_pool.generation;
+    return chunk;
+}
+
+// Find a frame for `page`: a new one while the pool is below its limit, else the
+// frame of the page the CLOCK hand evicts. When every page is pinned the pool
+// goes over its limit until the next heap_release.
+char* heap_pool_frame(uint32_t page) {
+    heap_pool.flags[page] = 0;
+    if (heap_pool.frame_count >= heap_pool.frame_limit) {
+        size_t frame = heap_pool_victim();
+        if (frame < heap_pool.frame_count) {
+            uint32_t old_page = heap_pool.frame_pages[frame];
+            char* memory = string_heap.chunks[old_page];
+            string_heap.chunks[old_page] = NULL;
+            heap_pool.frame_pages[frame] = page;
+            heap_pool.evictions++;
+            return memory;
+        }
+    }
+    if (heap_pool.frame_count == heap_pool.frame_capacity) {
+        heap_pool.frame_capacity = heap_pool.frame_capacity ? heap_pool.frame_capacity * 2 : heap_pool.frame_limit;
+        heap_pool.frame_pages = (uint32_t*)realloc(heap_pool.frame_pages, heap_pool.frame_capacity * sizeof(uint32_t));
+    }
+    heap_pool.frame_pages[heap_pool.frame_count++] = page;
+    return (char*)malloc(HEAP_CHUNK_SIZE);
+}
+
+// Advance the CLOCK hand to a page that can leave memory: not pinned, not used
+// since the hand last passed (the mark is cleared on the way), and written back
+// if it changed. A forked saver never writes pages back, so it keeps changed
+// ones. Returns the frame, or frame_count when none can go.
+size_t heap_pool_victim() {
+    int owner = heap_pool.owner == (long)getpid();
+    for (size_t step = 0; step < 2 * heap_pool.frame_count; step++) {
+        size_t frame = heap_pool.hand;
+        heap_pool.hand = frame + 1 < heap_pool.frame_count ? frame + 1 : 0;
+        uint32_t page = heap_pool.frame_pages[frame];
+        uint8_t* flags = &heap_pool.flags[page];
+        if (heap_pool.stamps[page] == heap_pool.generation) {
+            continue;
+        }
+        if (*flags & HEAP_PAGE_REFERENCED) {
+            *flags &= (uint8_t)~HEAP_PAGE_REFERENCED;
+            continue;
+        }
+        if (*flags & HEAP_PAGE_DIRTY) {
+#ifndef _WIN32
+            off_t position = (off_t)((heap_pool.file_base + page) << HEAP_CHUNK_SHIFT);
+            if (!owner || pwrite(heap_pool.fd, string_heap.chunks[page], HEAP_CHUNK_SIZE, position) != (ssize_t)HEAP_CHUNK_SIZE) {
+                continue;
+            }
+#endif
+            *flags &= (uint8_t)~HEAP_PAGE_DIRTY;
+            heap_pool.writebacks++;
+        }
+        return frame;
+    }
+    return heap_pool.frame_count;
+}
+
+// Drop every page. Saving in the background reads the page file, so while a
+// saver may be running the next dataset's pages go after the old ones.
+void heap_pool_clear() {
+    for (size_t i = 0; i < heap_pool.frame_count; i++) {
+        free(string_heap.chunks[heap_pool.frame_pages[i]]);
+        string_heap.chunks[heap_pool.frame_pages[i]] = NULL;
+    }
+    heap_pool.frame_count = 0;
+    heap_pool.hand = 0;
+    memset(heap_pool.flags, 0, string_heap.chunk_count);
+    memset(heap_pool.stamps, 0, string_heap.chunk_count * sizeof(uint32_t));
+#ifndef _WIN32
+    if (background_save.pid == 0 && journal.compactor == 0) {
+        heap_pool.file_base = 0;
+        ftruncate(heap_pool.fd, 0);
+    } else {
+        heap_pool.file_base += string_heap.chunk_count;
+    }
+#endif
+    string_heap.chunk_count = string_heap.borrowed;
+}
+
+// Point at bytes already in the heap so they can be changed in place. A paged
+// heap then writes their page back before it leaves memory.
+char* heap_writable(uint64_t offset) {
+    char* bytes = (char*)heap_string(offset);
+    size_t page = (size_t)(offset >> HEAP_CHUNK_SHIFT);
+    if (heap_pool.fd >= 0 && page >= string_heap.borrowed) {
+        heap_pool.flags[page] |= HEAP_PAGE_DIRTY;
+    }
+    return bytes;
+}
+
+// Write one sequence; a match length of 0 ends the block with literals only
+size_t lz_emit(uint8_t* out, const uint8_t* literals, size_t literal_count, size_t offset, size_t match_length) {
+    uint8_t* at = out;
+    uint8_t* token = at++;
+    size_t extra_match = match_length > 0 ? match_length - LZ_MIN_MATCH : 0;
+    *token = (uint8_t)((literal_count < 15 ? literal_count : 15) << 4 | (extra_match < 15 ? extra_match : 15));
+    if (literal_count >= 15) {
+        size_t rest = literal_count - 15;
+        for (; rest >= 255; rest -= 255) {
+            *at++ = 255;
+        }
+        *at++ = (uint8_t)rest;
+    }
+    memcpy(at, literals, literal_count);
+    at += literal_count;
+    if (match_length > 0) {
+        *at++ = (uint8_t)offset;
+        *at++ = (uint8_t)(offset >> 8);
+        if (extra_match >= 15) {
+            size_t rest = extra_match - 15;
+            for (; rest >= 255; rest -= 255) {
+                *at++ = 255;
+            }
+            *at++ = (uint8_t)rest;
+        }
+    }
+    return (size_t)(at - out);
+}
+
+// Compress `length` bytes into `out`, which has room for LZ_BOUND(length), and
+// return the compressed size
+size_t lz_compress(const uint8_t* in, size_t length, uint8_t* out) {
+    uint32_t table[1 << LZ_HASH_BITS];  // Position + 1 of the last 4 bytes with each hash
+    memset(table, 0, sizeof(table));
+    size_t written = 0, anchor = 0, position = 0;
+    size_t limit = length > LZ_LAST_LITERALS + LZ_MIN_MATCH ? length - LZ_LAST_LITERALS : 0;
+    while (position + LZ_MIN_MATCH <= limit) {
+        uint32_t sequence;
+        memcpy(&sequence, in + position, sizeof(sequence));
+        uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[hash];
+        table[hash] = (uint32_t)position + 1;
+        uint32_t previous;
+        if (candidate == 0 || position - (candidate - 1) > 0xFFFF
+            || (memcpy(&previous, in + candidate - 1, sizeof(previous)), previous != sequence)) {
+            position++;
+            continue;
+        }
+        candidate--;
+        size_t match_length = LZ_MIN_MATCH;
+        while (position + match_length < limit && in[candidate + match_length] == in[position + match_length]) {
+            match_length++;
+        }
+        written += lz_emit(out + written, in + anchor, position - anchor, position - candidate, match_length);
+        position += match_length;
+        anchor = position;
+    }
+    return written + lz_emit(out + written, in + anchor, length - anchor, 0, 0);
+}
+
+// Decompress into exactly `length` bytes. Every length and offset is checked, so a
+// damaged block is refused rather than read past. Returns 0 for a damaged block.
+int lz_decompress(const uint8_t* in, size_t stored, uint8_t* out, size_t length) {
+    const uint8_t* end = in + stored;
+    size_t written = 0;
+    while (in < end) {
+        uint8_t token = *in++;
+        size_t literal_count = token >> 4;
+        if (literal_count == 15) {
+            uint8_t more;
+            do {
+                if (in == end) {
+                    return 0;
+                }
+                more = *in++;
+                literal_count += more;
+            } while (more == 255);
+        }
+        if (literal_count > (size_t)(end - in) || literal_count > length - written) {
+            return 0;
+        }
+        memcpy(out + written, in, literal_count);
+        in += literal_count;
+        written += literal_count;
+        if (in == end) {
+            break;
+        }
+
+        if (end - in < 2) {
+            return 0;
+        }
+        size_t offset = (size_t)in[0] | (size_t)in[1] << 8;
+        in += 2;
+        size_t match_length = token & 15;
+        if (match_length == 15) {
+            uint8_t more;
+            do {
+                if (in == end) {
+                    return 0;
+                }
+                more = *in++;
+                match_length += more;
+            } while (more == 255);
+        }
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > written || match_length > length - written) {
+            return 0;
+        }
+        // Copied a byte at a time, since a match may overlap what it produces
+        for (size_t i = 0; i < match_length; i++) {
+            out[written + i] = out[written + i - offset];
+        }
+        written += match_length;
+    }
+    return written == length;
+}
+
+// Add a medical history to the open block and write the notes record that refers
+// to it; returns the record's offset, marked COLD_NOTES
+uint64_t cold_append(const char* medical_history, const uint32_t* codes) {
+    size_t length = strlen(medical_history) + 1;
+    if (cold_store.open == NULL) {
+        cold_store.open = (char*)malloc(COLD_BLOCK_MAX);
+        cold_store.packed = (uint8_t*)malloc(LZ_BOUND(COLD_BLOCK_MAX));
+    }
+    if (cold_store.open_length + length > COLD_BLOCK_MAX) {
+        cold_seal();
+    }
+    uint64_t reference = COLD_OPEN | cold_store.open_length;
+    memcpy(cold_store.open + cold_store.open_length, medical_history, length);
+    cold_store.open_length += length;
+
+    char* dest;
+    uint64_t offset = heap_reserve(NOTES_CODES_SIZE + sizeof(reference), &dest);
+    memcpy(dest, codes, NOTES_CODES_SIZE);
+    memcpy(dest + NOTES_CODES_SIZE, &reference, sizeof(reference));
+    if (cold_store.open_count == cold_store.open_capacity) {
+        cold_store.open_capacity = cold_store.open_capacity ? cold_store.open_capacity * 2 : 256;
+        cold_store.open_records = (uint64_t*)realloc(cold_store.open_records, cold_store.open_capacity * sizeof(uint64_t));
+    }
+    cold_store.open_records[cold_store.open_count++] = offset;
+    if (cold_store.open_length >= COLD_BLOCK_TARGET) {
+        cold_seal();
+    }
+    return offset | COLD_NOTES;
+}
+
+// Function to compress the open block into the heap, point the records that
+// refer to it at the stored block, and keep its text in the cache, where readers
+// still holding it find it. A block that does not shrink is stored raw.
+void cold_seal() {
+    if (cold_store.open_length == 0) {
+        return;
+    }
+    uint32_t header[2];
+    header[0] = (uint32_t)cold_store.open_length;
+    header[1] = (uint32_t)lz_compress((const uint8_t*)cold_store.open, cold_store.open_length, cold_store.packed);
+    const void* payload = cold_store.packed;
+    if (header[1] >= header[0]) {
+        header[1] = header[0];
+        payload = cold_store.open;
+    }
+    char* dest;
+    uint64_t block = heap_reserve(COLD_BLOCK_HEADER + header[1], &dest);
+    memcpy(dest, header, COLD_BLOCK_HEADER);
+    memcpy(dest + COLD_BLOCK_HEADER, payload, header[1]);
+
+    for (size_t i = 0; i < cold_store.open_count; i++) {
+        // Records replaced since are rewritten too; nothing reads them any more
+        char* reference = heap_writable(cold_store.open_records[i] + NOTES_CODES_SIZE);
+        uint64_t value;
+        memcpy(&value, reference, sizeof(value));
+        value = block << 16 | (value & ~COLD_OPEN);
+        memcpy(reference, &value, sizeof(value));
+    }
+
+    size_t slot = cold_cache_slot();
+    char* spare = cold_store.cache_data[slot];
+    cold_store.cache_data[slot] = cold_store.open;
+    cold_store.cache_blocks[slot] = block;
+    cold_store.open = spare;
+    cold_store.blocks++;
+    cold_store.raw_bytes += header[0];
+    cold_store.stored_bytes += COLD_BLOCK_HEADER + header[1];
+    cold_store.open_length = 0;
+    cold_store.open_count = 0;
+}
+
+// Take a cache slot for a new block and pin it: a new slot while the cache is
+// below COLD_CACHE_BLOCKS, else the one the CLOCK hand passes over unused and
+// unpinned. When every slot is pinned the cache grows until the next heap_release.
+size_t cold_cache_slot() {
+    size_t slot = cold_store.cache_count;
+    for (size_t step = 0; cold_store.cache_count >= COLD_CACHE_BLOCKS && step < 2 * cold_store.cache_count; step++) {
+        size_t candidate = cold_store.hand;
+        cold_store.hand = candidate + 1 < cold_store.cache_count ? candidate + 1 : 0;
+        if (cold_store.cache_stamps[candidate] == cold_store.generation) {
+            continue;
+        }
+        if (cold_store.cache_referenced[candidate]) {
+            cold_store.cache_referenced[candidate] = 0;
+            continue;
+        }
+        slot = candidate;
+        break;
+    }
+    if (slot == cold_store.cache_count) {
+        if (cold_store.cache_count == cold_store.cache_capacity) {
+            cold_store.cache_capacity = cold_store.cache_capacity ? cold_store.cache_capacity * 2 : COLD_CACHE_BLOCKS;
+            cold_store.cache_blocks = (uint64_t*)realloc(cold_store.cache_blocks, cold_store.cache_capacity * sizeof(uint64_t));
+            cold_store.cache_data = (char**)realloc(cold_store.cache_data, cold_store.cache_capacity * sizeof(char*));
+            cold_store.cache_stamps = (uint32_t*)realloc(cold_store.cache_stamps, cold_store.cache_capacity * sizeof(uint32_t));
+            cold_store.cache_referenced = (uint8_t*)realloc(cold_store.cache_referenced, cold_store.cache_capacity);
+        }
+        cold_store.cache_data[slot] = (char*)malloc(COLD_BLOCK_MAX);
+        cold_store.cache_count++;
+    }
+    cold_store.cache_blocks[slot] = COLD_NO_BLOCK;
+    cold_store.cache_stamps[slot] = cold_store.generation;
+    cold_store.cache_referenced[slot] = 1;
+    cold_store.last = slot;
+    return slot;
+}
+
+// The text of a stored block, decompressed into the cache if it is not there
+const char* cold_block(uint64_t block) {
+    size_t slot = cold_store.last;
+    if (slot >= cold_store.cache_count || cold_store.cache_blocks[slot] != block) {
+        for (slot = 0; slot < cold_store.cache_count && cold_store.cache_blocks[slot] != block; slot++) {
+        }
+    }
+    if (slot < cold_store.cache_count) {
+        cold_store.hits++;
+        cold_store.cache_stamps[slot] = cold_store.generation;
+        cold_store.cache_referenced[slot] = 1;
+        cold_store.last = slot;
+        return cold_store.cache_data[slot];
+    }
+
+    cold_store.misses++;
+    const char* stored = heap_string(block);
+    uint32_t header[2];
+    memcpy(header, stored, COLD_BLOCK_HEADER);
+    slot = cold_cache_slot();
+    char* text = cold_store.cache_data[slot];
+    if (header[1] == header[0]) {
+        memcpy(text, stored + COLD_BLOCK_HEADER, header[0]);
+    } else if (header[0] > COLD_BLOCK_MAX
+               || !lz_decompress((const uint8_t*)stored + COLD_BLOCK_HEADER, header[1], (uint8_t*)text, header[0])) {
+        printf("Error: damaged text block in the records.\n");
+        exit(1);
+    }
+    cold_store.cache_blocks[slot] = block;
+    return text;
+}
+
+// The text a cold notes record refers to; `reference` points at the reference
+const char* cold_text(const char* reference) {
+    uint64_t value;
+    memcpy(&value, reference, sizeof(value));
+    if (value & COLD_OPEN) {
+        return cold_store.open + (value & ~COLD_OPEN);
+    }
+    return cold_block(value >> 16) + (value & 0xFFFF);
+}
+
+// Unpin the cache, and give back the slots taken over its size meanwhile
+void cold_release() {
+    cold_store.generation++;
+    while (cold_store.cache_count > COLD_CACHE_BLOCKS) {
+        free(cold_store.cache_data[--cold_store.cache_count]);
+    }
+    if (cold_store.hand >= cold_store.cache_count) {
+        cold_store.hand = 0;
+    }
+}
+
+// Forget the open block and the cached blocks, whose heap offsets are about to be reused
+void cold_reset() {
+    cold_store.open_length = 0;
+    cold_store.open_count = 0;
+    cold_store.blocks = 0;
+    cold_store.raw_bytes = 0;
+    cold_store.stored_bytes = 0;
+    for (size_t slot = 0; slot < cold_store.cache_count; slot++) {
+        cold_store.cache_blocks[slot] = COLD_NO_BLOCK;
+    }
+}
+
+// Write one frame of a compressed text file: raw length, stored length, then the
+// data, raw when it does not shrink. Returns 0 if the write failed.
+int cold_file_frame(int fd, const char* data, size_t length) {
+    uint8_t* packed = (uint8_t*)malloc(COLD_BLOCK_HEADER + LZ_BOUND(length));
+    uint32_t header[2];
+    header[0] = (uint32_t)length;
+    header[1] = (uint32_t)lz_compress((const uint8_t*)data, length, packed + COLD_BLOCK_HEADER);
+    if (header[1] >= header[0]) {
+        header[1] = header[0];
+        memcpy(packed + COLD_BLOCK_HEADER, data, length);
+    }
+    memcpy(packed, header, COLD_BLOCK_HEADER);
+    size_t total = COLD_BLOCK_HEADER + header[1];
+    size_t written = 0;
+    while (written < total) {
+        long result = (long)write(fd, packed + written, (unsigned)(total - written));
+        if (result <= 0) {
+            break;
+        }
+        written += (size_t)result;
+    }
+    free(packed);
+    return written == total;
+}
+
+// Expand a compressed text file read whole into `data`, which is freed. Returns
+// the text, with a spare byte at the end like read_file, or NULL if it is damaged.
+char* cold_file_expand(const char* filename, char* data, size_t* length) {
+    size_t magic = sizeof(COLD_FILE_MAGIC) - 1;
+    size_t total = 0;
+    size_t position = magic;
+    while (position + COLD_BLOCK_HEADER <= *length) {
+        uint32_t header[2];
+        memcpy(header, data + position, COLD_BLOCK_HEADER);
+        position += COLD_BLOCK_HEADER + header[1];
+        total += header[0];
+    }
+    char* text = position == *length ? (char*)malloc(total + 1) : NULL;
+    size_t written = 0;
+    for (position = magic; text != NULL && position < *length;) {
+        uint32_t header[2];
+        memcpy(header, data + position, COLD_BLOCK_HEADER);
+        const char* payload = data + position + COLD_BLOCK_HEADER;
+        if (header[1] == header[0]) {
+            memcpy(text + written, payload, header[0]);
+        } else if (!lz_decompress((const uint8_t*)payload, header[1], (uint8_t*)text + written, header[0])) {
+            free(text);
+            text = NULL;
+        }
+        written += header[0];
+        position += COLD_BLOCK_HEADER + header[1];
+    }
+    free(data);
+    if (text == NULL) {
+        printf("%s is damaged.\n", filename);
+        return NULL;
+    }
+    *length = total;
+    return text;
+}
+
+// Look up (or add) the code for a gender value
+uint8_t gender_code(const char* gender) {
+    for (int i = 0; i < gender_count; i++) {
+        if (strcmp(heap_string(gender_table[i]), gender) == 0) {
+            return (uint8_t)i;
+        }
+    }
+    if (gender_count == GENDER_CODES) {
+        return GENDER_CODES - 1;  // Table full: fold any further values into the last code
+    }
+    gender_table[gender_count] = heap_append(gender);
+    return (uint8_t)gender_count++;
+}
+
+// Rebuild the lookup table at a new power-of-two capacity
+void dictionary_rehash(struct Dictionary* dictionary, size_t capacity) {
+    free(dictionary->slots);
+    dictionary->slots = (uint32_t*)calloc(capacity, sizeof(uint32_t));
+    dictionary->slot_capacity = capacity;
+    for (uint32_t code = 0; code < dictionary->count; code++) {
+        size_t slot = name_hash_of(heap_string(dictionary->values[code])) & (capacity - 1);
+        while (dictionary->slots[slot] != 0) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        dictionary->slots[slot] = code + 1;
+    }
+}
+
+// Code of a value, or NO_CODE if the dictionary does not hold it
+uint32_t dictionary_find(struct Dictionary* dictionary, const char* text) {
+    if (dictionary->slot_capacity == 0) {
+        return NO_CODE;
+    }
+    size_t mask = dictionary->slot_capacity - 1;
+    for (size_t slot = name_hash_of(text) & mask; dictionary->slots[slot] != 0; slot = (slot + 1) & mask) {
+        uint32_t code = dictionary->slots[slot] - 1;
+        if (strcmp(heap_string(dictionary->values[code]), text) == 0) {
+            return code;
+        }
+    }
+    return NO_CODE;
+}
+
+// Code of a value, adding it when it is new
+uint32_t dictionary_code(struct Dictionary* dictionary, const char* text) {
+    uint32_t code = dictionary_find(dictionary, text);
+    if (code != NO_CODE) {
+        return code;
+    }
+    if (dictionary->count == dictionary->capacity) {
+        // Readers may still be using the old array, so publish a copy and retire it
+        uint64_t* old_values = dictionary->values;
+        dictionary->capacity = dictionary->capacity ? dictionary->capacity * 2 : 64;
+        uint64_t* values = (uint64_t*)malloc(dictionary->capacity * sizeof(uint64_t));
+        if (dictionary->count > 0) {
+            memcpy(values, old_values, dictionary->count * sizeof(uint64_t));
+        }
+        STORE_RELEASE(dictionary->values, values);
+        if (!dictionary->borrowed) {
+            epoch_retire(old_values, NO_HANDLE);
+        }
+        dictionary->borrowed = 0;
+    }
+    code = dictionary->count++;
+    dictionary->values[code] = heap_append(text);
+    if (dictionary->count * 2 > dictionary->slot_capacity) {
+        dictionary_rehash(dictionary, dictionary->slot_capacity ? dictionary->slot_capacity * 2 : 128);
+    } else {
+        size_t mask = dictionary->slot_capacity - 1;
+        size_t slot = name_hash_of(text) & mask;
+        while (dictionary->slots[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        dictionary->slots[slot] = code + 1;
+    }
+    return code;
+}
+
+const char* dictionary_string(struct Dictionary* dictionary, uint32_t code) {
+    return heap_string(LOAD_ACQUIRE(dictionary->values)[code]);
+}
+
+void dictionary_reset(struct Dictionary* dictionary) {
+    if (!dictionary->borrowed) {
+        free(dictionary->values);
+    }
+    free(dictionary->slots);
+    memset(dictionary, 0, sizeof(*dictionary));
+}
+
+// Read one whitespace-delimited token, or with whole_line the rest of the line
+// after leading whitespace, into a buffer that grows as needed. Returns 0 at EOF
+// and -1 when the field is longer than HEAP_MAX_STRING (the field is consumed).
+int read_field(FILE* in, char** buffer, size_t* capacity, int whole_line) {
+    if (*capacity == 0) {
+        *capacity = 64;
+        *buffer = (char*)malloc(*capacity);
+    }
+    (*buffer)[0] = '\0';
+
+    int c = getc(in);
+    while (c != EOF && (c == ' ' || c == '\t' || c == '\n' || c == '\r')) {
+        c = getc(in);
+    }
+    if (c == EOF) {
+        return 0;
+    }
+
+    size_t length = 0;
+    int too_long = 0;
+    while (c != EOF && c != '\n' && (whole_line || (c != ' ' && c != '\t' && c != '\r'))) {
+        if (length == HEAP_MAX_STRING) {
+            too_long = 1;
+        } else {
+            if (length + 1 >= *capacity) {
+                *capacity *= 2;
+                *buffer = (char*)realloc(*buffer, *capacity);
+            }
+            (*buffer)[length++] = (char)c;
+        }
+        c = getc(in);
+    }
+    while (whole_line && length > 0 && (*buffer)[length - 1] == '\r') {
+        length--;
+    }
+    if (c != EOF && c != '\n') {
+        ungetc(c, in);
+    }
+    (*buffer)[length] = '\0';
+    return too_long ? -1 : 1;
+}
+
+// Function to give a patient record back to the pool, once no reader can see it
+void free_patient(struct Patient* patient) {
+    epoch_retire(NULL, patient->handle);
+}
+
+// Pack the first NAME_PREFIX_LEN bytes of a name big-endian, zero padded, so that
+// comparing two prefixes as integers orders them exactly like strcmp would
+uint64_t name_prefix(const char* name) {
+    uint64_t prefix = 0;
+    for (int i = 0; i < NAME_PREFIX_LEN && name[i] != '\0'; i++) {
+        prefix |= (uint64_t)(unsigned char)name[i] << (56 - 8 * i);
+    }
+    return prefix;
+}
+
+// Compare two names given their packed prefixes. strcmp only runs on the tail
+// when both names share the same first NAME_PREFIX_LEN bytes.
+int name_key_compare(uint64_t prefix, const char* name, uint64_t other_prefix, const char* other_name) {
+    if (prefix != other_prefix) {
+        return prefix < other_prefix ? -1 : 1;
+    }
+    if ((prefix & 0xff) == 0) {
+        return 0;  // Both names are shorter than the prefix and identical
+    }
+    return strcmp(name + NAME_PREFIX_LEN, other_name + NAME_PREFIX_LEN);
+}
+
+// Compare two B+tree keys: by name, then by patient handle
+int bpt_key_compare(uint64_t prefix, const char* name, uint32_t patient, uint64_t other_prefix, const char* other_name, uint32_t other_patient) {
+    int cmp = name_key_compare(prefix, name, other_prefix, other_name);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return patient < other_patient ? -1 : patient > other_patient;
+}
+
+struct BptLeaf* bpt_leaf(uint32_t handle) {
+    return (struct BptLeaf*)pool_at(&leaf_pool, handle);
+}
+
+struct BptInner* bpt_inner(uint32_t handle) {
+    return (struct BptInner*)pool_at(&inner_pool, handle);
+}
+
+struct Patient* patient_at(uint32_t handle) {
+    return (struct Patient*)pool_at(&patient_pool, handle);
+}
+
+// FNV-1a over the name with a final avalanche; never returns 0 (the empty tag)
+uint32_t name_hash_of(const char* name) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const unsigned char* c = (const unsigned char*)name; *c != '\0'; c++) {
+        hash = (hash ^ *c) * 1099511628211ull;
+    }
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 32;
+    uint32_t tag = (uint32_t)hash;
+    return tag != 0 ? tag : 1;
+}
+
+// Distance of a slot from the home position of the tag stored in it
+size_t name_hash_distance(struct NameHash* hash, size_t slot, uint32_t tag) {
+    return (slot - (tag & (hash->capacity - 1))) & (hash->capacity - 1);
+}
+
+// Probe for a name. Robin Hood order lets a miss stop as soon as it meets an
+// entry closer to its home than the probe is to ours.
+struct Patient* name_hash_find(struct NameHash* hash, const char* name) {
+    if (hash->count == 0) {
+        return NULL;
+    }
+    uint32_t tag = name_hash_of(name);
+    size_t mask = LOAD_ACQUIRE(hash->capacity) - 1;  // Before the slots: they grow first
+    METRIC_COUNT(hash_lookups, 1);
+    for (size_t slot = tag & mask, distance = 0;; slot = (slot + 1) & mask, distance++) {
+        struct NameHashSlot* entry = &hash->slots[slot];
+        if (entry->hash == 0 || name_hash_distance(hash, slot, entry->hash) < distance || distance > mask) {
+            METRIC_COUNT(hash_probes, distance + 1);
+            return NULL;
+        }
+        if (entry->hash == tag) {
+            struct Patient* patient = patient_at(entry->handle);
+            if (strcmp(patient_name(patient), name) == 0) {
+                METRIC_COUNT(hash_probes, distance + 1);
+                return patient;
+            }
+        }
+    }
+}
+
+// Collect the handles of every patient with this name, up to `max` of them, and
+// return how many there are in all
+size_t name_hash_find_all(struct NameHash* hash, const char* name, uint32_t* handles, size_t max) {
+    if (hash->count == 0) {
+        return 0;
+    }
+    uint32_t tag = name_hash_of(name);
+    size_t mask = LOAD_ACQUIRE(hash->capacity) - 1;
+    size_t found = 0;
+    METRIC_COUNT(hash_lookups, 1);
+    for (size_t slot = tag & mask, distance = 0;; slot = (slot + 1) & mask, distance++) {
+        struct NameHashSlot* entry = &hash->slots[slot];
+        if (entry->hash == 0 || name_hash_distance(hash, slot, entry->hash) < distance || distance > mask) {
+            METRIC_COUNT(hash_probes, distance + 1);
+            return found;
+        }
+        if (entry->hash == tag && strcmp(patient_name(patient_at(entry->handle)), name) == 0) {
+            if (found < max) {
+                handles[found] = entry->handle;
+            }
+            found++;
+        }
+    }
+}
+
+// Writers bracket every change to the slots with these; a reader that overlaps
+// one sees the version move and probes again
+void name_hash_begin_write(struct NameHash* hash) {
+    STORE_RELEASE(hash->version, hash->version + 1);
+    FENCE_RELEASE();
+}
+
+void name_hash_end_write(struct NameHash* hash) {
+    STORE_RELEASE(hash->version, hash->version + 1);
+}
+
+// Double the table (or create it) and reinsert every entry from its stored tag.
+// The larger slots are published before the capacity, so a reader never masks
+// with a capacity bigger than the array it probes.
+void name_hash_grow(struct NameHash* hash) {
+    struct NameHashSlot* old_slots = hash->slots;
+    size_t old_capacity = hash->capacity;
+    size_t capacity = old_capacity ? old_capacity * 2 : NAME_HASH_MIN_CAPACITY;
+    STORE_RELEASE(hash->slots, (struct NameHashSlot*)calloc(capacity, sizeof(struct NameHashSlot)));
+    STORE_RELEASE(hash->capacity, capacity);
+    hash->count = 0;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_slots[i].hash != 0) {
+            name_hash_place(hash, old_slots[i].hash, old_slots[i].handle);
+        }
+    }
+    if (!hash->borrowed) {
+        epoch_retire(old_slots, NO_HANDLE);
+    }
+    hash->borrowed = 0;
+}
+
+// Insert a handle under its tag
+void name_hash_insert(struct NameHash* hash, uint32_t tag, uint32_t handle) {
+    name_hash_begin_write(hash);
+    if ((hash->count + 1) * 8 > hash->capacity * 7) {
+        name_hash_grow(hash);
+    }
+    name_hash_place(hash, tag, handle);
+    name_hash_end_write(hash);
+}
+
+// Robin Hood placement of one entry into a table with room for it
+void name_hash_place(struct NameHash* hash, uint32_t tag, uint32_t handle) {
+    size_t mask = hash->capacity - 1;
+    struct NameHashSlot entry = {tag, handle};
+    for (size_t slot = tag & mask, distance = 0;; slot = (slot + 1) & mask, distance++) {
+        struct NameHashSlot* current = &hash->slots[slot];
+        if (current->hash == 0) {
+            *current = entry;
+            hash->count++;
+            return;
+        }
+        // Take the slot from an entry that is closer to home, and carry it on instead
+        size_t current_distance = name_hash_distance(hash, slot, current->hash);
+        if (current_distance < distance) {
+            struct NameHashSlot displaced = *current;
+            *current = entry;
+            entry = displaced;
+            distance = current_distance;
+        }
+    }
+}
+
+// Slot holding a patient's entry, or the capacity when it has none
+size_t name_hash_slot(struct NameHash* hash, uint32_t tag, uint32_t handle) {
+    if (hash->count == 0) {
+        return hash->capacity;
+    }
+    size_t mask = hash->capacity - 1;
+    for (size_t slot = tag & mask, distance = 0;; slot = (slot + 1) & mask, distance++) {
+        struct NameHashSlot* entry = &hash->slots[slot];
+        if (entry->hash == 0 || name_hash_distance(hash, slot, entry->hash) < distance) {
+            return hash->capacity;
+        }
+        if (entry->hash == tag && entry->handle == handle) {
+            return slot;
+        }
+    }
+}
+
+// Remove a patient's entry, shifting the following run back so no tombstones are needed
+void name_hash_remove(struct NameHash* hash, uint32_t tag, uint32_t handle) {
+    size_t slot = name_hash_slot(hash, tag, handle);
+    if (slot == hash->capacity) {
+        return;
+    }
+
+    size_t mask = hash->capacity - 1;
+    name_hash_begin_write(hash);
+    size_t next = (slot + 1) & mask;
+    while (hash->slots[next].hash != 0 && name_hash_distance(hash, next, hash->slots[next].hash) > 0) {
+        hash->slots[slot] = hash->slots[next];
+        slot = next;
+        next = (next + 1) & mask;
+    }
+    hash->slots[slot].hash = 0;
+    hash->count--;
+    name_hash_end_write(hash);
+}
+
+void name_hash_clear(struct NameHash* hash) {
+    if (!hash->borrowed) {
+        free(hash->slots);
+    }
+    hash->slots = NULL;
+    hash->capacity = 0;
+    hash->count = 0;
+    hash->borrowed = 0;
+}
+
+// Index of the child to follow for a key: the number of separators <= key
+int bpt_inner_slot(struct BptInner* node, uint64_t prefix, const char* name, uint32_t patient) {
+    int i = 0;
+    while (i < node->count
+           && bpt_key_compare(prefix, name, patient, node->prefixes[i], heap_string(node->separators[i]), node->separator_patients[i]) >= 0) {
+        i++;
+    }
+    return i;
+}
+
+// Position of the first entry >= key; *found is set when that entry equals key.
+// Patient handle 0 finds the first entry with the name.
+int bpt_leaf_slot(struct BptLeaf* leaf, uint64_t prefix, const char* name, uint32_t patient, int* found) {
+    int i = 0;
+    int cmp = 1;
+    while (i < leaf->count) {
+        cmp = bpt_key_compare(prefix, name, patient, leaf->prefixes[i], patient_name(patient_at(leaf->patients[i])), leaf->patients[i]);
+        if (cmp <= 0) {
+            break;
+        }
+        i++;
+    }
+    *found = (i < leaf->count && cmp == 0);
+    return i;
+}
+
+uint32_t bpt_new_leaf() {
+    uint32_t handle = pool_alloc(&leaf_pool);
+    struct BptLeaf* leaf = bpt_leaf(handle);
+    leaf->count = 0;
+    leaf->is_leaf = 1;
+    leaf->next = NO_HANDLE;
+    return handle;
+}
+
+uint32_t bpt_new_inner() {
+    uint32_t handle = pool_alloc(&inner_pool);
+    struct BptInner* node = bpt_inner(handle);
+    node->count = 0;
+    node->is_leaf = 0;
+    return handle;
+}
+
+// Function to add a new patient to the name index. Other patients may already
+// have the same name; the patient's ID tells them apart.
+void add_patient(struct NameIndex* index, struct Patient* new_patient) {
+    METRIC_START(started);
+    name_index_insert(index, new_patient);
+    text_index_add(new_patient);
+    columns_add(new_patient);
+    secondary_add(new_patient);
+    METRIC_STOP(METRIC_ADD, started);
+}
+
+// Insert into the hash and the B+tree; add_patient times it
+void name_index_insert(struct NameIndex* index, struct Patient* new_patient) {
+    struct BptInner* path[BPT_MAX_HEIGHT];
+    int slots[BPT_MAX_HEIGHT];
+    const char* name = patient_name(new_patient);
+    uint64_t prefix = name_prefix(name);
+    uint32_t handle = new_patient->handle;
+
+    name_hash_insert(&index->hash, name_hash_of(name), handle);
+
+    if (index->root == NO_HANDLE) {
+        index->root = bpt_new_leaf();
+        struct BptLeaf* leaf = bpt_leaf(index->root);
+        leaf->prefixes[0] = prefix;
+        leaf->patients[0] = new_patient->handle;
+        leaf->count = 1;
+        index->height = 1;
+        index->count = 1;
+        return;
+    }
+
+    // Walk down iteratively, remembering the path for splits
+    uint32_t node = index->root;
+    int depth = 0;
+    while (depth < index->height - 1) {
+        struct BptInner* inner = bpt_inner(node);
+        path[depth] = inner;
+        slots[depth] = bpt_inner_slot(inner, prefix, name, handle);
+        node = inner->children[slots[depth]];
+        depth++;
+    }
+    METRIC_COUNT(tree_descents, 1);
+    METRIC_COUNT(tree_nodes, depth + 1);
+
+    // The handle is new, so the key is never in the tree yet
+    struct BptLeaf* leaf = bpt_leaf(node);
+    int found;
+    int pos = bpt_leaf_slot(leaf, prefix, name, handle, &found);
+    index->count++;
+
+    if (leaf->count < BPT_LEAF_KEYS) {
+        memmove(&leaf->prefixes[pos + 1], &leaf->prefixes[pos], (leaf->count - pos) * sizeof(uint64_t));
+        memmove(&leaf->patients[pos + 1], &leaf->patients[pos], (leaf->count - pos) * sizeof(uint32_t));
+        leaf->prefixes[pos] = prefix;
+        leaf->patients[pos] = new_patient->handle;
+        leaf->count++;
+        return;
+    }
+
+    // Split the full leaf: gather all BPT_LEAF_KEYS + 1 entries, then halve them
+    uint64_t all_prefixes[BPT_LEAF_KEYS + 1];
+    uint32_t all_patients[BPT_LEAF_KEYS + 1];
+    memcpy(all_prefixes, leaf->prefixes, pos * sizeof(uint64_t));
+    memcpy(all_patients, leaf->patients, pos * sizeof(uint32_t));
+    all_prefixes[pos] = prefix;
+    all_patients[pos] = new_patient->handle;
+    memcpy(&all_prefixes[pos + 1], &leaf->prefixes[pos], (BPT_LEAF_KEYS - pos) * sizeof(uint64_t));
+    memcpy(&all_patients[pos + 1], &leaf->patients[pos], (BPT_LEAF_KEYS - pos) * sizeof(uint32_t));
+
+    uint32_t right_handle = bpt_new_leaf();
+    struct BptLeaf* right = bpt_leaf(right_handle);
+    int left_count = (BPT_LEAF_KEYS + 1) / 2;
+    leaf->count = left_count;
+    right->count = BPT_LEAF_KEYS + 1 - left_count;
+    memcpy(leaf->prefixes, all_prefixes, left_count * sizeof(uint64_t));
+    memcpy(leaf->patients, all_patients, left_count * sizeof(uint32_t));
+    memcpy(right->prefixes, &all_prefixes[left_count], right->count * sizeof(uint64_t));
+    memcpy(right->patients, &all_patients[left_count], right->count * sizeof(uint32_t));
+    right->next = leaf->next;
+    leaf->next = right_handle;
+
+    // Push the separator up, splitting inner nodes as long as they overflow
+    uint64_t up_prefix = right->prefixes[0];
+    uint64_t up_separator = patient_at(right->patients[0])->name;
+    uint32_t up_patient = right->patients[0];
+    uint32_t up_child = right_handle;
+    while (depth > 0) {
+        depth--;
+        struct BptInner* parent = path[depth];
+        int slot = slots[depth];
+
+        if (parent->count < BPT_INNER_KEYS) {
+            memmove(&parent->prefixes[slot + 1], &parent->prefixes[slot], (parent->count - slot) * sizeof(uint64_t));
+            memmove(&parent->separators[slot + 1], &parent->separators[slot], (parent->count - slot) * sizeof(uint64_t));
+            memmove(&parent->separator_patients[slot + 1], &parent->separator_patients[slot], (parent->count - slot) * sizeof(uint32_t));
+            memmove(&parent->children[slot + 2], &parent->children[slot + 1], (parent->count - slot) * sizeof(uint32_t));
+            parent->prefixes[slot] = up_prefix;
+            parent->separators[slot] = up_separator;
+            parent->separator_patients[slot] = up_patient;
+            parent->children[slot + 1] = up_child;
+            parent->count++;
+            return;
+        }
+
+        uint64_t keys[BPT_INNER_KEYS + 1];
+        uint64_t separators[BPT_INNER_KEYS + 1];
+        uint32_t separator_patients[BPT_INNER_KEYS + 1];
+        uint32_t children[BPT_INNER_KEYS + 2];
+        memcpy(keys, parent->prefixes, slot * sizeof(uint64_t));
+        memcpy(separators, parent->separators, slot * sizeof(uint64_t));
+        memcpy(separator_patients, parent->separator_patients, slot * sizeof(uint32_t));
+        memcpy(children, parent->children, (slot + 1) * sizeof(uint32_t));
+        keys[slot] = up_prefix;
+        separators[slot] = up_separator;
+        separator_patients[slot] = up_patient;
+        children[slot + 1] = up_child;
+        memcpy(&keys[slot + 1], &parent->prefixes[slot], (BPT_INNER_KEYS - slot) * sizeof(uint64_t));
+        memcpy(&separators[slot + 1], &parent->separators[slot], (BPT_INNER_KEYS - slot) * sizeof(uint64_t));
+        memcpy(&separator_patients[slot + 1], &parent->separator_patients[slot], (BPT_INNER_KEYS - slot) * sizeof(uint32_t));
+        memcpy(&children[slot + 2], &parent->children[slot + 1], (BPT_INNER_KEYS - slot) * sizeof(uint32_t));
+
+        // The middle separator moves up; the halves keep the rest
+        int mid = (BPT_INNER_KEYS + 1) / 2;
+        uint32_t sibling_handle = bpt_new_inner();
+        struct BptInner* sibling = bpt_inner(sibling_handle);
+        parent->count = mid;
+        memcpy(parent->prefixes, keys, mid * sizeof(uint64_t));
+        memcpy(parent->separators, separators, mid * sizeof(uint64_t));
+        memcpy(parent->separator_patients, separator_patients, mid * sizeof(uint32_t));
+        memcpy(parent->children, children, (mid + 1) * sizeof(uint32_t));
+        sibling->count = BPT_INNER_KEYS - mid;
+        memcpy(sibling->prefixes, &keys[mid + 1], sibling->count * sizeof(uint64_t));
+        memcpy(sibling->separators, &separators[mid + 1], sibling->count * sizeof(uint64_t));
+        memcpy(sibling->separator_patients, &separator_patients[mid + 1], sibling->count * sizeof(uint32_t));
+        memcpy(sibling->children, &children[mid + 1], (sibling->count + 1) * sizeof(uint32_t));
+
+        up_prefix = keys[mid];
+        up_separator = separators[mid];
+        up_patient = separator_patients[mid];
+        up_child = sibling_handle;
+    }
+
+    // The root itself split: grow the tree by one level
+    uint32_t root_handle = bpt_new_inner();
+    struct BptInner* new_root = bpt_inner(root_handle);
+    new_root->count = 1;
+    new_root->prefixes[0] = up_prefix;
+    new_root->separators[0] = up_separator;
+    new_root->separator_patients[0] = up_patient;
+    new_root->children[0] = index->root;
+    new_root->children[1] = up_child;
+    index->root = root_handle;
+    index->height++;
+}
+
+// Function to search for a patient by name: an exact match is one hash probe.
+// The probe is optimistic: if a writer moved slots while it ran, it is repeated.
+// When several patients share the name, any one of them is returned.
+struct Patient* search_patient(struct NameIndex* index, const char* name) {
+    METRIC_START(started);
+    while (1) {
+        uint64_t version = LOAD_ACQUIRE(index->hash.version);
+        if (version & 1) {
+            continue;
+        }
+        struct Patient* patient = name_hash_find(&index->hash, name);
+        FENCE_ACQUIRE();
+        if (LOAD_RELAXED(index->hash.version) == version) {
+            METRIC_STOP(METRIC_SEARCH, started);
+            return patient;
+        }
+    }
+}
+
+// Function to find every patient with a name: stores up to `max` handles, lowest
+// ID first, and returns how many patients have the name. Lock-free like search_patient.
+size_t search_patients(struct NameIndex* index, const char* name, uint32_t* handles, size_t max) {
+    METRIC_START(started);
+    size_t found;
+    while (1) {
+        uint64_t version = LOAD_ACQUIRE(index->hash.version);
+        if (version & 1) {
+            continue;
+        }
+        found = name_hash_find_all(&index->hash, name, handles, max);
+        FENCE_ACQUIRE();
+        if (LOAD_RELAXED(index->hash.version) == version) {
+            break;
+        }
+    }
+    size_t stored = found < max ? found : max;
+    for (size_t i = 1; i < stored; i++) {
+        uint32_t handle = handles[i];
+        size_t j = i;
+        for (; j > 0 && handles[j - 1] > handle; j--) {
+            handles[j] = handles[j - 1];
+        }
+        handles[j] = handle;
+    }
+    METRIC_STOP(METRIC_SEARCH, started);
+    return found;
+}
+
+// Function to look a patient up by ID: the handle's slot, if the hash has an
+// entry for it. A deleted patient's slot keeps its name until it is reused, and
+// a reused slot belongs to the new patient, so the check is exact. Returns NULL
+// when no patient has the ID.
+struct Patient* patient_by_id(struct NameIndex* index, uint32_t id) {
+    if (id >= patient_pool.used) {
+        return NULL;
+    }
+    struct Patient* patient = patient_at(id);
+    uint32_t tag = name_hash_of(patient_name(patient));
+    return name_hash_slot(&index->hash, tag, id) != index->hash.capacity ? patient : NULL;
+}
+
+// Remove separator `slot` and the child to its right from an inner node
+void bpt_inner_remove(struct BptInner* node, int slot) {
+    memmove(&node->prefixes[slot], &node->prefixes[slot + 1], (node->count - slot - 1) * sizeof(uint64_t));
+    memmove(&node->separators[slot], &node->separators[slot + 1], (node->count - slot - 1) * sizeof(uint64_t));
+    memmove(&node->separator_patients[slot], &node->separator_patients[slot + 1], (node->count - slot - 1) * sizeof(uint32_t));
+    memmove(&node->children[slot + 1], &node->children[slot + 2], (node->count - slot - 1) * sizeof(uint32_t));
+    node->count--;
+}
+
+// Refill an underfull leaf from a sibling, or merge it into one
+void bpt_rebalance_leaf(struct BptInner* parent, int slot) {
+    struct BptLeaf* leaf = bpt_leaf(parent->children[slot]);
+    struct BptLeaf* left = slot > 0 ? bpt_leaf(parent->children[slot - 1]) : NULL;
+    struct BptLeaf* right = slot < parent->count ? bpt_leaf(parent->children[slot + 1]) : NULL;
+
+    if (left != NULL && left->count > BPT_MIN_LEAF_KEYS) {
+        memmove(&leaf->prefixes[1], &leaf->prefixes[0], leaf->count * sizeof(uint64_t));
+        memmove(&leaf->patients[1], &leaf->patients[0], leaf->count * sizeof(uint32_t));
+        left->count--;
+        leaf->prefixes[0] = left->prefixes[left->count];
+        leaf->patients[0] = left->patients[left->count];
+        leaf->count++;
+        parent->prefixes[slot - 1] = leaf->prefixes[0];
+        parent->separators[slot - 1] = patient_at(leaf->patients[0])->name;
+        parent->separator_patients[slot - 1] = leaf->patients[0];
+        return;
+    }
+
+    if (right != NULL && right->count > BPT_MIN_LEAF_KEYS) {
+        leaf->prefixes[leaf->count] = right->prefixes[0];
+        leaf->patients[leaf->count] = right->patients[0];
+        leaf->count++;
+        right->count--;
+        memmove(&right->prefixes[0], &right->prefixes[1], right->count * sizeof(uint64_t));
+        memmove(&right->patients[0], &right->patients[1], right->count * sizeof(uint32_t));
+        parent->prefixes[slot] = right->prefixes[0];
+        parent->separators[slot] = patient_at(right->patients[0])->name;
+        parent->separator_patients[slot] = right->patients[0];
+        return;
+    }
+
+    // Neither sibling can spare an entry: merge the right one of the pair into the left
+    if (left == NULL) {
+        left = leaf;
+        leaf = right;
+        slot++;
+    }
+    memcpy(&left->prefixes[left->count], leaf->prefixes, leaf->count * sizeof(uint64_t));
+    memcpy(&left->patients[left->count], leaf->patients, leaf->count * sizeof(uint32_t));
+    left->count += leaf->count;
+    left->next = leaf->next;
+    pool_free(&leaf_pool, parent->children[slot]);
+    bpt_inner_remove(parent, slot - 1);
+}
+
+// Refill an underfull inner node by rotating through the parent, or merge it
+void bpt_rebalance_inner(struct BptInner* parent, int slot) {
+    struct BptInner* node = bpt_inner(parent->children[slot]);
+    struct BptInner* left = slot > 0 ? bpt_inner(parent->children[slot - 1]) : NULL;
+    struct BptInner* right = slot < parent->count ? bpt_inner(parent->children[slot + 1]) : NULL;
+
+    if (left != NULL && left->count > BPT_MIN_INNER_KEYS) {
+        memmove(&node->prefixes[1], &node->prefixes[0], node->count * sizeof(uint64_t));
+        memmove(&node->separators[1], &node->separators[0], node->count * sizeof(uint64_t));
+        memmove(&node->separator_patients[1], &node->separator_patients[0], node->count * sizeof(uint32_t));
+        memmove(&node->children[1], &node->children[0], (node->count + 1) * sizeof(uint32_t));
+        node->prefixes[0] = parent->prefixes[slot - 1];
+        node->separators[0] = parent->separators[slot - 1];
+        node->separator_patients[0] = parent->separator_patients[slot - 1];
+        node->children[0] = left->children[left->count];
+        node->count++;
+        left->count--;
+        parent->prefixes[slot - 1] = left->prefixes[left->count];
+        parent->separators[slot - 1] = left->separators[left->count];
+        parent->separator_patients[slot - 1] = left->separator_patients[left->count];
+        return;
+    }
+
+    if (right != NULL && right->count > BPT_MIN_INNER_KEYS) {
+        node->prefixes[node->count] = parent->prefixes[slot];
+        node->separators[node->count] = parent->separators[slot];
+        node->separator_patients[node->count] = parent->separator_patients[slot];
+        node->children[node->count + 1] = right->children[0];
+        node->count++;
+        parent->prefixes[slot] = right->prefixes[0];
+        parent->separators[slot] = right->separators[0];
+        parent->separator_patients[slot] = right->separator_patients[0];
+        right->count--;
+        memmove(&right->prefixes[0], &right->prefixes[1], right->count * sizeof(uint64_t));
+        memmove(&right->separators[0], &right->separators[1], right->count * sizeof(uint64_t));
+        memmove(&right->separator_patients[0], &right->separator_patients[1], right->count * sizeof(uint32_t));
+        memmove(&right->children[0], &right->children[1], (right->count + 1) * sizeof(uint32_t));
+        return;
+    }
+
+    if (left == NULL) {
+        left = node;
+        node = right;
+        slot++;
+    }
+    // The separator between the pair moves down into the merged node
+    left->prefixes[left->count] = parent->prefixes[slot - 1];
+    left->separators[left->count] = parent->separators[slot - 1];
+    left->separator_patients[left->count] = parent->separator_patients[slot - 1];
+    left->count++;
+    memcpy(&left->prefixes[left->count], node->prefixes, node->count * sizeof(uint64_t));
+    memcpy(&left->separators[left->count], node->separators, node->count * sizeof(uint64_t));
+    memcpy(&left->separator_patients[left->count], node->separator_patients, node->count * sizeof(uint32_t));
+    memcpy(&left->children[left->count], node->children, (node->count + 1) * sizeof(uint32_t));
+    left->count += node->count;
+    pool_free(&inner_pool, parent->children[slot]);
+    bpt_inner_remove(parent, slot - 1);
+}
+
+// Function to delete a patient's record from the name and age indexes. Returns 0
+// when the patient is not in the index.
+int delete_patient_record(struct NameIndex* index, struct AgeIndex* ages, struct Patient* patient) {
+    METRIC_START(started);
+    int deleted = name_index_delete(index, ages, patient);
+    METRIC_STOP(METRIC_DELETE, started);
+    return deleted;
+}
+
+// Remove from the B+tree, the hash and the age index; delete_patient_record times it
+int name_index_delete(struct NameIndex* index, struct AgeIndex* ages, struct Patient* patient) {
+    struct BptInner* path[BPT_MAX_HEIGHT];
+    int slots[BPT_MAX_HEIGHT];
+
+    if (index->root == NO_HANDLE) {
+        return 0;
+    }
+
+    const char* name = patient_name(patient);
+    uint32_t handle = patient->handle;
+    uint64_t prefix = name_prefix(name);
+    uint32_t node = index->root;
+    int depth = 0;
+    while (depth < index->height - 1) {
+        struct BptInner* inner = bpt_inner(node);
+        path[depth] = inner;
+        slots[depth] = bpt_inner_slot(inner, prefix, name, handle);
+        node = inner->children[slots[depth]];
+        depth++;
+    }
+    METRIC_COUNT(tree_descents, 1);
+    METRIC_COUNT(tree_nodes, depth + 1);
+
+    struct BptLeaf* leaf = bpt_leaf(node);
+    int found;
+    int pos = bpt_leaf_slot(leaf, prefix, name, handle, &found);
+    if (!found) {
+        return 0;
+    }
+
+    name_index_forget(index, ages, patient);
+    leaf->count--;
+    memmove(&leaf->prefixes[pos], &leaf->prefixes[pos + 1], (leaf->count - pos) * sizeof(uint64_t));
+    memmove(&leaf->patients[pos], &leaf->patients[pos + 1], (leaf->count - pos) * sizeof(uint32_t));
+    index->count--;
+
+    // Fix underflow bottom-up. Stale separators above are still valid bounds.
+    if (depth > 0 && leaf->count < BPT_MIN_LEAF_KEYS) {
+        depth--;
+        bpt_rebalance_leaf(path[depth], slots[depth]);
+        while (depth > 0 && path[depth]->count < BPT_MIN_INNER_KEYS) {
+            depth--;
+            bpt_rebalance_inner(path[depth], slots[depth]);
+        }
+    }
+
+    // Shrink the tree when the root is left with a single child
+    if (index->height > 1 && bpt_inner(index->root)->count == 0) {
+        uint32_t old_root = index->root;
+        index->root = bpt_inner(old_root)->children[0];
+        index->height--;
+        pool_free(&inner_pool, old_root);
+    } else if (index->height == 1 && leaf->count == 0) {
+        pool_free(&leaf_pool, index->root);
+        index->root = NO_HANDLE;
+        index->height = 0;
+    }
+
+    return 1;
+}
+
+// Drop a patient from every index but the B+tree, and free it
+void name_index_forget(struct NameIndex* index, struct AgeIndex* ages, struct Patient* patient) {
+    name_hash_remove(&index->hash, name_hash_of(patient_name(patient)), patient->handle);
+    remove_patient_by_age(ages, patient);
+    text_index_remove(patient);
+    columns_remove(patient);
+    secondary_remove(patient);
+    free_patient(patient);
+}
+
+// Leftmost leaf of the index, the start of every in-order scan
+struct BptLeaf* name_index_first_leaf(struct NameIndex* index) {
+    uint32_t node = index->root;
+    if (node == NO_HANDLE) {
+        return NULL;
+    }
+    for (int depth = 0; depth < index->height - 1; depth++) {
+        node = bpt_inner(node)->children[0];
+    }
+    return bpt_leaf(node);
+}
+
+// Leaf after this one in name order, or NULL at the end
+struct BptLeaf* name_index_next_leaf(struct BptLeaf* leaf) {
+    return leaf->next == NO_HANDLE ? NULL : bpt_leaf(leaf->next);
+}
+
+// Find the first name at or after `name`. Returns its leaf and sets *pos, which
+// is the leaf's count when the name belongs after its last entry.
+struct BptLeaf* name_index_seek(struct NameIndex* index, const char* name, int* pos) {
+    if (index->root == NO_HANDLE) {
+        return NULL;
+    }
+    uint64_t prefix = name_prefix(name);
+    uint32_t node = index->root;
+    for (int depth = 0; depth < index->height - 1; depth++) {
+        struct BptInner* inner = bpt_inner(node);
+        node = inner->children[bpt_inner_slot(inner, prefix, name, 0)];
+    }
+    struct BptLeaf* leaf = bpt_leaf(node);
+    int found;
+    *pos = bpt_leaf_slot(leaf, prefix, name, 0, &found);
+    return leaf;
+}
+
+// Compute the row for one more name character from the rows above it
+void name_search_extend(struct NameSearch* search, char c) {
+    int d = search->depth;
+    int letter = tolower((unsigned char)c);
+    int before = d > 0 ? tolower((unsigned char)search->path[d - 1]) : -1;
+    uint8_t* above = search->rows[d];
+    uint8_t* row = search->rows[d + 1];
+    row[0] = (uint8_t)(d + 1);
+    int smallest = row[0];
+    for (int j = 1; j <= search->length; j++) {
+        int value = above[j - 1] + (letter != (unsigned char)search->query[j - 1]);
+        if (above[j] + 1 < value) {
+            value = above[j] + 1;
+        }
+        if (row[j - 1] + 1 < value) {
+            value = row[j - 1] + 1;
+        }
+        // Two neighbouring letters typed the other way round count as one edit
+        if (j > 1 && letter == (unsigned char)search->query[j - 2] && before == (unsigned char)search->query[j - 1] &&
+            search->rows[d - 1][j - 2] + 1 < value) {
+            value = search->rows[d - 1][j - 2] + 1;
+        }
+        row[j] = (uint8_t)value;
+        smallest = value < smallest ? value : smallest;
+    }
+    search->row_min[d + 1] = (uint8_t)smallest;
+    search->best[d + 1] = row[search->length] < search->best[d] ? row[search->length] : search->best[d];
+    search->path[d] = c;
+    search->depth = d + 1;
+}
+
+// Function to look patients up by an approximate name: whole names within
+// `max_edits` edits of the query or, with `prefix` set, names that start with
+// something that close (autocomplete). Fills `matches` with up to `limit` of the
+// best, closest first and by name among equals, and returns how many, or -1 for
+// a query or limit out of range.
+long name_search(struct NameIndex* index, const char* query, int max_edits, int prefix, size_t limit, struct NameMatch* matches) {
+    size_t length = strlen(query);
+    if (length > NAME_SEARCH_MAX_QUERY || max_edits < 0 || max_edits > NAME_SEARCH_MAX_EDITS || limit == 0 || limit > NAME_SEARCH_MAX_RESULTS) {
+        return -1;
+    }
+    METRIC_START(started);
+    struct NameSearch search;
+    search.length = (int)length;
+    search.prefix = prefix;
+    for (size_t j = 0; j <= length; j++) {
+        search.query[j] = (char)tolower((unsigned char)query[j]);
+        search.rows[0][j] = (uint8_t)j;
+    }
+    search.depth = 0;
+    search.row_min[0] = 0;
+    search.best[0] = (uint8_t)length;
+
+    size_t count = 0;
+    int pos = 0;
+    struct BptLeaf* leaf = name_index_first_leaf(index);
+    while (leaf != NULL) {
+        if (pos >= leaf->count) {
+            leaf = name_index_next_leaf(leaf);
+            pos = 0;
+            continue;
+        }
+        // With `limit` matches kept, a new one must beat the last: later names lose ties
+        int bound = count < limit ? max_edits : matches[count - 1].distance - 1;
+        if (bound < 0) {
+            break;
+        }
+        uint32_t handle = leaf->patients[pos];
+        const char* name = patient_name(patient_at(handle));
+        int depth = 0;
+        while (depth < search.depth && name[depth] == search.path[depth]) {
+            depth++;
+        }
+        search.depth = depth;
+
+        int distance = -1;
+        int pruned = 0;
+        while (search.depth < NAME_SEARCH_MAX_DEPTH) {
+            int d = search.depth;
+            if (prefix && search.best[d] <= bound && search.row_min[d] >= search.best[d]) {
+                distance = search.best[d];  // No longer prefix gets closer
+                break;
+            }
+            if (search.row_min[d] > bound && (!prefix || search.best[d] > bound)) {
+                pruned = 1;
+                break;
+            }
+            if (name[d] == '\0') {
+                int here = prefix ? search.best[d] : search.rows[d][length];
+                distance = here <= bound ? here : -1;
+                break;
+            }
+            name_search_extend(&search, name[d]);
+        }
+
+        if (distance >= 0) {
+            size_t at = count < limit ? count++ : limit - 1;
+            while (at > 0 && matches[at - 1].distance > distance) {
+                matches[at] = matches[at - 1];
+                at--;
+            }
+            matches[at].handle = handle;
+            matches[at].distance = distance;
+        }
+        pos++;
+        if (!pruned) {
+            continue;
+        }
+
+        // Skip the other names under the pruned prefix: in this leaf one by one,
+        // beyond it with a seek to the first name after the prefix
+        int d = search.depth;
+        while (pos < leaf->count && strncmp(patient_name(patient_at(leaf->patients[pos])), search.path, d) == 0) {
+            pos++;
+        }
+        if (pos == leaf->count) {
+            char key[NAME_SEARCH_MAX_DEPTH + 1];
+            memcpy(key, search.path, d);
+            int i = d - 1;
+            while (i >= 0 && (unsigned char)key[i] == 0xFF) {
+                i--;
+            }
+            if (i < 0) {
+                break;
+            }
+            key[i]++;
+            key[i + 1] = '\0';
+            leaf = name_index_seek(index, key, &pos);
+        }
+    }
+    METRIC_STOP(METRIC_NAME_SEARCH, started);
+    return (long)count;
+}
+
+// Order bulk-load keys the way the tree does: by name, then by patient
+int name_key_sort_compare(const void* a, const void* b) {
+    const struct NameKey* left = (const struct NameKey*)a;
+    const struct NameKey* right = (const struct NameKey*)b;
+    heap_release();  // Only the two names compared are in use
+    return bpt_key_compare(left->prefix, heap_string(left->name), left->patient, right->prefix, heap_string(right->name), right->patient);
+}
+
+// Build an empty name index bottom-up from freshly created patients: sort once,
+// pack the leaves, then build each inner level from the one below. Entries are
+// spread evenly so every node is at least half full. The keys array is reused as
+// scratch for the upper levels. Returns the patients indexed.
+size_t name_index_bulk_load(struct NameIndex* index, struct AgeIndex* ages, struct NameKey* keys, size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    qsort(keys, count, sizeof(struct NameKey), name_key_sort_compare);
+
+    for (size_t i = 0; i < count; i++) {
+        struct Patient* patient = patient_at(keys[i].handle);
+        name_hash_insert(&index->hash, name_hash_of(patient_name(patient)), keys[i].handle);
+        add_patient_by_age(ages, patient);
+        heap_release();
+    }
+    name_index_build(index, keys, count);
+    return count;
+}
+
+// Build the B+tree from keys already in tree order, replacing whatever root the
+// index had. Only the tree is touched; the hash and the other indexes are not.
+void name_index_build(struct NameIndex* index, struct NameKey* keys, size_t count) {
+    index->count = count;
+    if (count == 0) {
+        index->root = NO_HANDLE;
+        index->height = 0;
+        return;
+    }
+
+    // Leaves: each level entry becomes the first key of its node and the node handle
+    size_t nodes = (count + BPT_LEAF_KEYS - 1) / BPT_LEAF_KEYS;
+    struct BptLeaf* previous = NULL;
+    for (size_t j = 0; j < nodes; j++) {
+        size_t start = j * count / nodes;
+        size_t end = (j + 1) * count / nodes;
+        uint32_t handle = bpt_new_leaf();
+        struct BptLeaf* leaf = bpt_leaf(handle);
+        for (size_t i = start; i < end; i++) {
+            leaf->prefixes[i - start] = keys[i].prefix;
+            leaf->patients[i - start] = keys[i].handle;
+        }
+        leaf->count = (uint16_t)(end - start);
+        if (previous != NULL) {
+            previous->next = handle;
+        }
+        previous = leaf;
+        // Only the first key of a node is ever a separator, so only its name is read
+        keys[j].prefix = keys[start].prefix;
+        keys[j].name = patient_at(keys[start].patient)->name;
+        keys[j].patient = keys[start].patient;
+        keys[j].handle = handle;
+    }
+    index->height = 1;
+
+    // Inner levels until a single node is left
+    while (nodes > 1) {
+        size_t children = nodes;
+        nodes = (children + BPT_INNER_KEYS) / (BPT_INNER_KEYS + 1);
+        for (size_t j = 0; j < nodes; j++) {
+            size_t start = j * children / nodes;
+            size_t end = (j + 1) * children / nodes;
+            uint32_t handle = bpt_new_inner();
+            struct BptInner* inner = bpt_inner(handle);
+            inner->children[0] = keys[start].handle;
+            for (size_t i = start + 1; i < end; i++) {
+                inner->prefixes[i - start - 1] = keys[i].prefix;
+                inner->separators[i - start - 1] = keys[i].name;
+                inner->separator_patients[i - start - 1] = keys[i].patient;
+                inner->children[i - start] = keys[i].handle;
+            }
+            inner->count = (uint16_t)(end - start - 1);
+            keys[j].prefix = keys[start].prefix;
+            keys[j].name = keys[start].name;
+            keys[j].patient = keys[start].patient;
+            keys[j].handle = handle;
+        }
+        index->height++;
+    }
+    index->root = keys[0].handle;
+}
+
+// Give every node of a subtree back to its pool
+void name_index_free_nodes(uint32_t node, int height) {
+    if (height > 1) {
+        struct BptInner* inner = bpt_inner(node);
+        for (int i = 0; i <= inner->count; i++) {
+            name_index_free_nodes(inner->children[i], height - 1);
+        }
+        pool_free(&inner_pool, node);
+    } else {
+        pool_free(&leaf_pool, node);
+    }
+}
+
+// Copy a string into the batch text and return its offset
+size_t write_batch_text(struct WriteBatch* batch, const char* text) {
+    size_t length = strlen(text) + 1;
+    if (batch->text_length + length > batch->text_capacity) {
+        while (batch->text_length + length > batch->text_capacity) {
+            batch->text_capacity = batch->text_capacity ? batch->text_capacity * 2 : 4096;
+        }
+        batch->text = (char*)realloc(batch->text, batch->text_capacity);
+    }
+    memcpy(batch->text + batch->text_length, text, length);
+    batch->text_length += length;
+    return batch->text_length - length;
+}
+
+// Stage one change of a patient given by name, or by ID when `name` is NULL
+struct WriteOp* write_batch_stage(struct WriteBatch* batch, uint8_t kind, const char* name, uint32_t id, const char** fields, int field_count) {
+    if (batch->count == batch->capacity) {
+        batch->capacity = batch->capacity ? batch->capacity * 2 : 64;
+        batch->ops = (struct WriteOp*)realloc(batch->ops, batch->capacity * sizeof(struct WriteOp));
+    }
+    struct WriteOp* op = &batch->ops[batch->count];
+    op->kind = kind;
+    op->by_id = name == NULL;
+    op->age = 0;
+    op->id = id;
+    op->target = NO_HANDLE;
+    op->name = name != NULL ? write_batch_text(batch, name) : 0;
+    op->fields = batch->text_length;
+    for (int i = 0; i < field_count; i++) {
+        write_batch_text(batch, fields[i]);
+    }
+    op->line = batch->count++;
+    return op;
+}
+
+// Function to stage a new patient in a write batch
+struct WriteOp* write_batch_add(struct WriteBatch* batch, const char* name, int age, const char* gender, const char* medical_history, const char* diagnosis, const char* prescription) {
+    const char* fields[4] = {gender, medical_history, diagnosis, prescription};
+    struct WriteOp* op = write_batch_stage(batch, WRITE_ADD, name, NO_HANDLE, fields, 4);
+    op->age = (uint16_t)age;
+    return op;
+}
+
+// Function to stage new clinical notes for a patient, by name or (name NULL) by ID
+struct WriteOp* write_batch_update(struct WriteBatch* batch, const char* name, uint32_t id, const char* medical_history, const char* diagnosis, const char* prescription) {
+    const char* fields[3] = {medical_history, diagnosis, prescription};
+    return write_batch_stage(batch, WRITE_UPDATE, name, id, fields, 3);
+}
+
+// Function to stage the removal of a patient, by name or (name NULL) by ID
+struct WriteOp* write_batch_delete(struct WriteBatch* batch, const char* name, uint32_t id) {
+    return write_batch_stage(batch, WRITE_DELETE, name, id, NULL, 0);
+}
+
+// Forget every staged change, keeping the buffers for the next batch
+void write_batch_clear(struct WriteBatch* batch) {
+    batch->count = 0;
+    batch->text_length = 0;
+    batch->open = 0;
+    batch->rejected = 0;
+}
+
+void write_batch_free(struct WriteBatch* batch) {
+    free(batch->ops);
+    free(batch->text);
+    memset(batch, 0, sizeof(*batch));
+}
+
+// Order staged ops by name, then by the order they were staged in
+int write_key_compare(const void* a, const void* b) {
+    const struct WriteKey* left = (const struct WriteKey*)a;
+    const struct WriteKey* right = (const struct WriteKey*)b;
+    int order = name_key_compare(left->prefix, left->name, right->prefix, right->name);
+    return order != 0 ? order : (left->op > right->op) - (left->op < right->op);
+}
+
+// Sort keys as write_key_compare does: a stable radix sort on the name prefixes,
+// a byte at a time from the lowest, then qsort only for runs of equal prefixes
+// whose names go on past them
+void write_batch_sort(struct WriteKey* keys, size_t count) {
+    if (count < 2) {
+        return;
+    }
+    struct WriteKey* spare = (struct WriteKey*)malloc(count * sizeof(struct WriteKey));
+    size_t counts[256];
+    for (int shift = 0; shift < 64; shift += 8) {
+        memset(counts, 0, sizeof(counts));
+        for (size_t i = 0; i < count; i++) {
+            counts[(keys[i].prefix >> shift) & 0xff]++;
+        }
+        if (counts[(keys[0].prefix >> shift) & 0xff] == count) {
+            continue;  // Every key has the same byte here
+        }
+        size_t total = 0;
+        for (int b = 0; b < 256; b++) {
+            size_t n = counts[b];
+            counts[b] = total;
+            total += n;
+        }
+        for (size_t i = 0; i < count; i++) {
+            spare[counts[(keys[i].prefix >> shift) & 0xff]++] = keys[i];
+        }
+        memcpy(keys, spare, count * sizeof(struct WriteKey));
+    }
+    free(spare);
+
+    for (size_t start = 0, end; start < count; start = end) {
+        for (end = start + 1; end < count && keys[end].prefix == keys[start].prefix; end++) {
+        }
+        if (end - start > 1 && (keys[start].prefix & 0xff) != 0) {
+            qsort(keys + start, end - start, sizeof(struct WriteKey), write_key_compare);
+        }
+    }
+}
+
+int write_batch_fail(struct WriteBatch* batch, size_t op, const char* error) {
+    batch->failed = op;
+    batch->error = error;
+    return 0;
+}
+
+// Check a batch against the dataset without changing it: find the patient of
+// every update and delete, taking the ops staged before it on the same name into
+// account, and sort the ops into `keys`. Returns 0 at the first op that cannot be
+// applied.
+int write_batch_check(struct WriteBatch* batch, struct NameIndex* index, struct WriteKey* keys) {
+    // An op by ID is about the name its patient has now
+    for (size_t i = 0; i < batch->count; i++) {
+        struct WriteOp* op = &batch->ops[i];
+        if (op->by_id) {
+            struct Patient* patient = patient_by_id(index, op->id);
+            if (patient == NULL) {
+                return write_batch_fail(batch, i, "patient not found");
+            }
+            op->name = write_batch_text(batch, patient_name(patient));
+            heap_release();
+        }
+    }
+    for (size_t i = 0; i < batch->count; i++) {
+        keys[i].name = batch->text + batch->ops[i].name;
+        keys[i].prefix = name_prefix(keys[i].name);
+        keys[i].op = i;
+    }
+    write_batch_sort(keys, batch->count);
+
+    // Replay each run of ops on one name over the patients who have it: adds join
+    // as pending patients, deletes leave
+    uint32_t* handles = NULL;
+    uint64_t* members = NULL;
+    size_t handle_capacity = 0;
+    size_t member_capacity = 0;
+    int ok = 1;
+    for (size_t start = 0, end; start < batch->count && ok; start = end) {
+        int adds_only = batch->ops[keys[start].op].kind == WRITE_ADD;
+        for (end = start + 1; end < batch->count && name_key_compare(keys[end].prefix, keys[end].name, keys[start].prefix, keys[start].name) == 0; end++) {
+            adds_only &= batch->ops[keys[end].op].kind == WRITE_ADD;
+        }
+        if (adds_only) {
+            continue;  // Nothing to find, and adds cannot fail
+        }
+        size_t found = search_patients(index, keys[start].name, handles, handle_capacity);
+        if (found > handle_capacity) {
+            handle_capacity = found * 2;
+            handles = (uint32_t*)realloc(handles, handle_capacity * sizeof(uint32_t));
+            found = search_patients(index, keys[start].name, handles, handle_capacity);
+        }
+        if (found + (end - start) > member_capacity) {
+            member_capacity = (found + (end - start)) * 2;
+            members = (uint64_t*)realloc(members, member_capacity * sizeof(uint64_t));
+        }
+        size_t member_count = found;
+        for (size_t i = 0; i < found; i++) {
+            members[i] = handles[i];
+        }
+
+        for (size_t k = start; k < end && ok; k++) {
+            size_t number = keys[k].op;
+            struct WriteOp* op = &batch->ops[number];
+            if (op->kind == WRITE_ADD) {
+                members[member_count++] = WRITE_PENDING | number;
+                continue;
+            }
+            size_t m = 0;
+            if (op->by_id) {
+                while (m < member_count && members[m] != op->id) {
+                    m++;
+                }
+                if (m == member_count) {
+                    ok = write_batch_fail(batch, number, "patient not found");
+                    break;
+                }
+            } else if (member_count != 1) {
+                ok = write_batch_fail(batch, number, member_count == 0 ? "patient not found" : "several patients have this name; use an ID");
+                break;
+            }
+            op->target = members[m];
+            if (op->kind == WRITE_DELETE) {
+                members[m] = members[--member_count];
+            }
+        }
+    }
+    free(handles);
+    free(members);
+    return ok;
+}
+
+// The patient an update or delete resolved to; one added earlier in the batch has its ID by now
+struct Patient* write_batch_target(struct WriteBatch* batch, struct WriteOp* op) {
+    if (op->target & WRITE_PENDING) {
+        return patient_at(batch->ops[(size_t)(op->target & ~WRITE_PENDING)].id);
+    }
+    return patient_at((uint32_t)op->target);
+}
+
+// Apply one checked op and journal it. While merging, the B+tree is left to
+// write_batch_merge and every other index is kept up to date here. Returns the
+// patient added or updated; a deleted one is freed by then.
+struct Patient* write_batch_apply(struct WriteBatch* batch, struct NameIndex* index, struct AgeIndex* ages, struct WriteOp* op, int merging) {
+    const char* name = batch->text + op->name;
+    const char* fields[4];
+    const char* field = batch->text + op->fields;
+    for (int i = 0; i < (op->kind == WRITE_ADD ? 4 : op->kind == WRITE_UPDATE ? 3 : 0); i++) {
+        fields[i] = field;
+        field += strlen(field) + 1;
+    }
+
+    if (op->kind == WRITE_ADD) {
+        struct Patient* patient = create_patient(name, op->age, fields[0], fields[1], fields[2], fields[3]);
+        if (merging) {
+            // What add_patient does besides the tree insert
+            name_hash_insert(&index->hash, name_hash_of(name), patient->handle);
+            text_index_add(patient);
+            columns_add(patient);
+            secondary_add(patient);
+        } else {
+            add_patient(index, patient);
+        }
+        add_patient_by_age(ages, patient);
+        journal_log_add(patient);
+        op->id = patient->handle;
+        return patient;
+    }
+    struct Patient* patient = write_batch_target(batch, op);
+    if (op->kind == WRITE_UPDATE) {
+        update_patient_notes(patient, fields[0], fields[1], fields[2]);
+        journal_log_update(patient);
+    } else {
+        if (op->target & WRITE_PENDING) {
+            batch->ops[(size_t)(op->target & ~WRITE_PENDING)].id = NO_HANDLE;  // Added and gone again
+        }
+        journal_log_delete(patient);
+        if (merging) {
+            name_index_forget(index, ages, patient);
+        } else {
+            delete_patient_record(index, ages, patient);
+        }
+    }
+    return patient;
+}
+
+// Apply a sorted batch in one pass along the leaf level. Entries before each run
+// of ops on a name are carried over as they are, the entries with the name are
+// gathered and the run applied to them, and once every run is done the tree is
+// rebuilt bottom-up from the merged entries.
+void write_batch_merge(struct WriteBatch* batch, struct NameIndex* index, struct AgeIndex* ages, struct WriteKey* keys) {
+    struct NameKey* entries = (struct NameKey*)malloc((index->count + batch->count) * sizeof(struct NameKey));
+    size_t count = 0;
+    uint32_t* run = NULL;
+    size_t run_capacity = 0;
+    struct BptLeaf* leaf = name_index_first_leaf(index);
+    int pos = 0;
+
+    for (size_t start = 0, end; start <= batch->count; start = end) {
+        // Past the last run, every remaining entry is carried over
+        const char* name = start < batch->count ? keys[start].name : NULL;
+        uint64_t prefix = start < batch->count ? keys[start].prefix : 0;
+        for (end = start + 1; end < batch->count && name_key_compare(keys[end].prefix, keys[end].name, prefix, name) == 0; end++) {
+        }
+
+        size_t run_count = 0;
+        while (leaf != NULL) {
+            if (pos == leaf->count) {
+                leaf = name_index_next_leaf(leaf);
+                pos = 0;
+                heap_release();
+                continue;
+            }
+            uint32_t handle = leaf->patients[pos];
+            int order = name == NULL ? -1
+                        : leaf->prefixes[pos] != prefix ? (leaf->prefixes[pos] < prefix ? -1 : 1)
+                        : name_key_compare(leaf->prefixes[pos], patient_name(patient_at(handle)), prefix, name);
+            if (order > 0) {
+                break;
+            }
+            if (order < 0) {
+                entries[count].prefix = leaf->prefixes[pos];
+                entries[count].patient = handle;
+                entries[count].handle = handle;
+                count++;
+            } else {
+                if (run_count == run_capacity) {
+                    run_capacity = run_capacity ? run_capacity * 2 : 64;
+                    run = (uint32_t*)realloc(run, run_capacity * sizeof(uint32_t));
+                }
+                run[run_count++] = handle;
+            }
+            pos++;
+        }
+        if (name == NULL) {
+            break;
+        }
+
+        for (size_t k = start; k < end; k++) {
+            struct WriteOp* op = &batch->ops[keys[k].op];
+            if (op->kind == WRITE_DELETE) {
+                uint32_t handle = write_batch_target(batch, op)->handle;
+                size_t m = 0;
+                while (run[m] != handle) {
+                    m++;
+                }
+                run[m] = run[--run_count];
+            }
+            struct Patient* patient = write_batch_apply(batch, index, ages, op, 1);
+            if (op->kind == WRITE_ADD) {
+                if (run_count == run_capacity) {
+                    run_capacity = run_capacity ? run_capacity * 2 : 64;
+                    run = (uint32_t*)realloc(run, run_capacity * sizeof(uint32_t));
+                }
+                run[run_count++] = patient->handle;
+            }
+            heap_release();
+        }
+        qsort(run, run_count, sizeof(uint32_t), text_compare_handles);
+        for (size_t i = 0; i < run_count; i++) {
+            entries[count].prefix = prefix;
+            entries[count].patient = run[i];
+            entries[count].handle = run[i];
+            count++;
+        }
+    }
+
+    if (index->root != NO_HANDLE) {
+        name_index_free_nodes(index->root, index->height);
+    }
+    name_index_build(index, entries, count);
+    free(entries);
+    free(run);
+}
+
+// Function to commit a write batch: check it whole, then apply it in name order,
+// holding server readers out meanwhile. Returns 1 once every change is made, with
+// each add's new ID in its op. Returns 0 without changing anything when an op
+// cannot be applied; `failed` and `error` say which and why. The caller clears
+// the batch after reading the results.
+int write_batch_commit(struct WriteBatch* batch, struct NameIndex* index, struct AgeIndex* ages) {
+    if (batch->count == 0) {
+        return 1;
+    }
+    METRIC_START(started);
+    struct WriteKey* keys = (struct WriteKey*)malloc(batch->count * sizeof(struct WriteKey));
+    if (!write_batch_check(batch, index, keys)) {
+        free(keys);
+        return 0;
+    }
+
+    // Adds and deletes change the tree; when they are many, one merge along the
+    // leaves is cheaper than a descent for each
+    size_t changes = 0;
+    for (size_t i = 0; i < batch->count; i++) {
+        changes += batch->ops[i].kind != WRITE_UPDATE;
+    }
+    int merging = changes > 0 && changes * WRITE_BATCH_MERGE_RATIO >= index->count;
+
+    epoch_close();
+    journal_batch_begin();
+    if (merging) {
+        write_batch_merge(batch, index, ages, keys);
+    } else {
+        for (size_t k = 0; k < batch->count; k++) {
+            write_batch_apply(batch, index, ages, &batch->ops[keys[k].op], 0);
+            heap_release();
+        }
+    }
+    journal_batch_end();
+    epoch_open();
+
+    free(keys);
+    METRIC_STOP(METRIC_BATCH, started);
+    METRIC_COUNT(batch_changes, batch->count);
+    METRIC_COUNT(batch_merges, merging);
+    return 1;
+}
+
+// Function to display all patient records (in-order walk along the linked leaves)
+void display_all_records(struct NameIndex* index, int format) {
+    struct BptLeaf* leaf = name_index_first_leaf(index);
+    if (leaf == NULL && format == OUTPUT_TEXT) {
+        printf("No patient records found.\n");
+        return;
+    }
+
+    if (format == OUTPUT_TEXT) {
+        printf("Patient Records:\n");
+    }
+    struct Output out;
+    output_open(&out, 1, format);
+    uint32_t* handles = (uint32_t*)malloc(OUTPUT_SCAN_ROUND * sizeof(uint32_t));
+    size_t count = 0;
+    for (; leaf != NULL; leaf = name_index_next_leaf(leaf)) {
+        if (count + leaf->count > OUTPUT_SCAN_ROUND) {
+            output_patients(&out, handles, count);
+            count = 0;
+        }
+        memcpy(handles + count, leaf->patients, leaf->count * sizeof(uint32_t));
+        count += leaf->count;
+    }
+    output_patients(&out, handles, count);
+    free(handles);
+    output_close(&out);
+}
+
+// Function to write every patient in an age range, youngest first, a round of
+// them at a time
+void output_age_range(struct Output* out, struct AgeIndex* ages, int min_age, int max_age) {
+    struct AgeRange range = search_patients_by_age_range(ages, min_age, max_age);
+    uint32_t* handles = (uint32_t*)malloc(OUTPUT_SCAN_ROUND * sizeof(uint32_t));
+    size_t count = 0;
+    for (struct Patient* patient = age_range_next(&range); patient != NULL; patient = age_range_next(&range)) {
+        if (count == OUTPUT_SCAN_ROUND) {
+            output_patients(out, handles, count);
+            count = 0;
+        }
+        handles[count++] = patient->handle;
+    }
+    output_patients(out, handles, count);
+    free(handles);
+}
+
+// Function to display every patient with a name, lowest ID first. Returns how many there are.
+size_t display_patients_named(struct NameIndex* index, const char* name, int format) {
+    size_t count = search_patients(index, name, NULL, 0);
+    if (count == 0) {
+        return 0;
+    }
+    uint32_t* handles = (uint32_t*)malloc(count * sizeof(uint32_t));
+    count = search_patients(index, name, handles, count);
+    struct Output out;
+    output_open(&out, 1, format);
+    for (size_t i = 0; i < count; i++) {
+        output_patient(&out, patient_at(handles[i]));
+    }
+    output_close(&out);
+    free(handles);
+    return count;
+}
+
+// Function to pick the patient a menu action is about: the only one with the
+// name or, when several share it, the one whose ID the user picks from the list.
+// Returns NULL when there is no such patient.
+struct Patient* choose_patient(struct NameIndex* index, const char* name, char** field, size_t* field_capacity) {
+    uint32_t handle;
+    size_t count = search_patients(index, name, &handle, 1);
+    if (count <= 1) {
+        return count == 1 ? patient_at(handle) : NULL;
+    }
+    printf("%zu patients are named %s:\n", count, name);
+    display_patients_named(index, name, OUTPUT_TEXT);
+    printf("Enter the ID of the patient: ");
+    struct Patient* patient = NULL;
+    if (read_field(stdin, field, field_capacity, 0) > 0 && batch_patient(index, 1, *field, &patient)
+        && patient != NULL && strcmp(patient_name(patient), name) != 0) {
+        patient = NULL;
+    }
+    return patient;
+}
+
+// Save as text, or as a binary snapshot when the file name ends in .snap
+void save_records_to_file(struct NameIndex *index, struct AgeIndex *ages, const char *filename) {
+    background_save_finish(1);  // Its child may be writing the same temporary file
+    METRIC_START(started);
+    int ok = save_records(index, ages, filename);
+    METRIC_STOP(METRIC_SAVE, started);
+    if (ok) {
+        fprintf(status_output(), "Patient records saved to %s successfully.\n", filename);
+    }
+}
+
+// Write the records to a file, as a snapshot when the name ends in ".snap" and as
+// text otherwise, compressed when the name ends in ".lz". Text goes through the
+// output buffer in 1 MB writes, into a temporary file that is renamed over the
+// target. Returns 0 after reporting an error.
+int save_records(struct NameIndex *index, struct AgeIndex *ages, const char *filename) {
+    shards_need(NULL);
+    size_t length = strlen(filename);
+    size_t suffix = strlen(SHARD_SUFFIX);
+    if (length > 5 && strcmp(filename + length - 5, ".snap") == 0) {
+        return save_snapshot(index, ages, filename);
+    }
+    if (length > suffix && strcmp(filename + length - suffix, SHARD_SUFFIX) == 0) {
+        return save_shards(index, filename);
+    }
+
+    uint32_t *handles = (uint32_t *)malloc((index->count > 0 ? index->count : 1) * sizeof(uint32_t));
+    size_t count = 0;
+    for (struct BptLeaf *leaf = name_index_first_leaf(index); leaf != NULL; leaf = name_index_next_leaf(leaf)) {
+        memcpy(handles + count, leaf->patients, leaf->count * sizeof(uint32_t));
+        count += leaf->count;
+    }
+    int ok = save_text_file(filename, handles, count);
+    free(handles);
+    return ok;
+}
+
+// Write patients to a text file, one line each in the format import_parse_chunk
+// reads. With the ".lz" suffix the lines are gathered in memory and written as
+// compressed frames. Returns 0 after reporting an error.
+int save_text_file(const char *filename, const uint32_t *handles, size_t count) {
+    size_t length = strlen(filename);
+    size_t suffix = strlen(COLD_FILE_SUFFIX);
+    int compressed = length > suffix && strcmp(filename + length - suffix, COLD_FILE_SUFFIX) == 0;
+    char *temp_name = (char *)malloc(length + 5);
+    memcpy(temp_name, filename, length);
+    memcpy(temp_name + length, ".tmp", 5);
+    int fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("Error opening file for writing.\n");
+        free(temp_name);
+        return 0;
+    }
+
+    struct Output out;
+    output_open(&out, compressed ? -1 : fd, OUTPUT_RECORDS);
+    if (compressed) {
+        out.failed = write(fd, COLD_FILE_MAGIC, sizeof(COLD_FILE_MAGIC) - 1) != (long)(sizeof(COLD_FILE_MAGIC) - 1);
+    }
+    for (size_t i = 0; i < count; i++) {
+        output_patient(&out, patient_at(handles[i]));
+        if (compressed && (out.length >= COLD_FILE_FRAME || i + 1 == count)) {
+            out.failed |= !cold_file_frame(fd, out.buffer, out.length);
+            out.length = 0;
+        }
+    }
+    output_close(&out);
+    int ok = !out.failed && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+
+#ifdef _WIN32
+    remove(filename);
+#endif
+    if (!ok || rename(temp_name, filename) != 0) {
+        printf("Error writing %s.\n", filename);
+        remove(temp_name);
+        free(temp_name);
+        return 0;
+    }
+    free(temp_name);
+    return 1;
+}
+
+// Function to save the records without stopping for it: a forked child writes the
+// file (see BackgroundSave) and background_save_finish reports the outcome. A save
+// still running from before is waited for first. Without fork the save runs here.
+void save_records_in_background(struct NameIndex *index, struct AgeIndex *ages, const char *filename) {
+#ifdef _WIN32
+    save_records_to_file(index, ages, filename);
+#else
+    background_save_finish(1);
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        background_save.child = 1;
+        int ok = save_records(index, ages, filename);
+        fflush(stdout);  // _exit does not flush the error message
+        _exit(ok ? 0 : 1);
+    }
+    if (child < 0) {
+        save_records_to_file(index, ages, filename);
+        return;
+    }
+    background_save.pid = (long)child;
+    background_save.filename = (char *)malloc(strlen(filename) + 1);
+    strcpy(background_save.filename, filename);
+    printf("Saving patient records to %s in the background.\n", filename);
+#endif
+}
+
+// Report a background save that has finished; with `wait`, wait for it to finish
+void background_save_finish(int wait) {
+#ifndef _WIN32
+    if (background_save.pid == 0) {
+        return;
+    }
+    int status;
+    pid_t done = waitpid((pid_t)background_save.pid, &status, wait ? 0 : WNOHANG);
+    if (done == 0) {
+        return;
+    }
+    if (done > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        printf("Patient records saved to %s successfully.\n", background_save.filename);
+    } else {
+        printf("Error saving patient records to %s.\n", background_save.filename);
+    }
+    free(background_save.filename);
+    background_save.filename = NULL;
+    background_save.pid = 0;
+#else
+    (void)wait;
+#endif
+}
+
+
+// Function to find the patients whose gender, diagnosis or prescription is
+// exactly `value`. The value is looked up in its dictionary once, so each patient
+// costs an integer compare. Sets *results to the handles in name order and
+// returns how many, or -1 for an unknown field.
+long filter_patients(struct NameIndex* index, const char* field, const char* value, uint32_t** results) {
+    int column = strcmp(field, "gender") == 0 ? 0 : strcmp(field, "diagnosis") == 0 ? 1 : strcmp(field, "prescription") == 0 ? 2 : -1;
+    *results = NULL;
+    if (column < 0) {
+        return -1;
+    }
+    uint32_t code = NO_CODE;
+    if (column == 0) {
+        for (int i = 0; i < gender_count; i++) {
+            if (strcmp(heap_string(gender_table[i]), value) == 0) {
+                code = (uint32_t)i;
+            }
+        }
+    } else {
+        code = dictionary_find(column == 1 ? &diagnosis_dictionary : &prescription_dictionary, value);
+    }
+    if (code == NO_CODE) {
+        return 0;
+    }
+
+    size_t count = 0, capacity = 0;
+    for (struct BptLeaf* leaf = name_index_first_leaf(index); leaf != NULL; leaf = name_index_next_leaf(leaf)) {
+        for (int i = 0; i < leaf->count; i++) {
+            struct Patient* patient = patient_at(leaf->patients[i]);
+            uint32_t patient_code = column == 0 ? patient->gender : column == 1 ? patient_diagnosis_code(patient) : patient_prescription_code(patient);
+            if (patient_code == code) {
+                text_push(results, &count, &capacity, patient->handle);
+            }
+            heap_release();
+        }
+    }
+    return (long)count;
+}
+
+void columns_add(struct Patient* patient) {
+    if (!columns.built) {
+        return;
+    }
+    if (columns.count == columns.capacity) {
+        columns.capacity = columns.capacity ? columns.capacity * 2 : 1024;
+        columns.ages = (uint8_t*)realloc(columns.ages, columns.capacity);
+        columns.genders = (uint8_t*)realloc(columns.genders, columns.capacity);
+        columns.diagnoses = (uint32_t*)realloc(columns.diagnoses, columns.capacity * sizeof(uint32_t));
+        columns.prescriptions = (uint32_t*)realloc(columns.prescriptions, columns.capacity * sizeof(uint32_t));
+        columns.handles = (uint32_t*)realloc(columns.handles, columns.capacity * sizeof(uint32_t));
+    }
+    if (patient->handle >= columns.row_capacity) {
+        size_t capacity = columns.row_capacity ? columns.row_capacity : 1024;
+        while (patient->handle >= capacity) {
+            capacity *= 2;
+        }
+        columns.rows = (uint32_t*)realloc(columns.rows, capacity * sizeof(uint32_t));
+        columns.row_capacity = capacity;
+    }
+    size_t row = columns.count++;
+    columns.ages[row] = (uint8_t)patient->age;
+    columns.genders[row] = patient->gender;
+    columns.diagnoses[row] = patient_diagnosis_code(patient);
+    columns.prescriptions[row] = patient_prescription_code(patient);
+    columns.handles[row] = patient->handle;
+    columns.rows[patient->handle] = (uint32_t)row;
+}
+
+void columns_remove(struct Patient* patient) {
+    if (!columns.built) {
+        return;
+    }
+    uint32_t row = columns.rows[patient->handle];
+    size_t last = --columns.count;
+    columns.ages[row] = columns.ages[last];
+    columns.genders[row] = columns.genders[last];
+    columns.diagnoses[row] = columns.diagnoses[last];
+    columns.prescriptions[row] = columns.prescriptions[last];
+    columns.handles[row] = columns.handles[last];
+    columns.rows[columns.handles[row]] = row;
+}
+
+// Pick up new notes codes
+void columns_update(struct Patient* patient) {
+    if (columns.built) {
+        uint32_t row = columns.rows[patient->handle];
+        columns.diagnoses[row] = patient_diagnosis_code(patient);
+        columns.prescriptions[row] = patient_prescription_code(patient);
+    }
+}
+
+// Drop the columns; the next query builds them again
+void columns_reset() {
+    free(columns.ages);
+    free(columns.genders);
+    free(columns.diagnoses);
+    free(columns.prescriptions);
+    free(columns.handles);
+    free(columns.rows);
+    memset(&columns, 0, sizeof(columns));
+}
+
+// Add every patient in handle order, which reads the patient slabs and their
+// notes front to back; the leaves only say which handles are live
+void columns_build(struct NameIndex* index) {
+    uint8_t* live = (uint8_t*)calloc(patient_pool.used + 1, 1);
+    for (struct BptLeaf* leaf = name_index_first_leaf(index); leaf != NULL; leaf = name_index_next_leaf(leaf)) {
+        for (int i = 0; i < leaf->count; i++) {
+            live[leaf->patients[i]] = 1;
+        }
+    }
+    columns.built = 1;
+    for (uint32_t handle = 0; handle < patient_pool.used; handle++) {
+        if (live[handle]) {
+            columns_add(patient_at(handle));
+            heap_release();
+        }
+    }
+    free(live);
+}
+
+// Parse a key: gender, diagnosis, prescription, age, or age/N for bands N years wide.
+// Returns 0 on success, -1 for an unknown key.
+int group_key_parse(struct GroupKey* key, const char* text) {
+    if (strcmp(text, "gender") == 0) {
+        key->column = COLUMN_GENDER;
+        key->cardinality = gender_count;
+    } else if (strcmp(text, "diagnosis") == 0) {
+        key->column = COLUMN_DIAGNOSIS;
+        key->cardinality = diagnosis_dictionary.count;
+    } else if (strcmp(text, "prescription") == 0) {
+        key->column = COLUMN_PRESCRIPTION;
+        key->cardinality = prescription_dictionary.count;
+    } else if (strncmp(text, "age", 3) == 0 && (text[3] == '\0' || text[3] == '/')) {
+        int band = text[3] == '/' ? batch_number(text + 4, MAX_AGE + 1) : 1;
+        if (band <= 0) {
+            return -1;
+        }
+        key->column = COLUMN_AGE;
+        key->band = (uint32_t)band;
+        key->cardinality = MAX_AGE / band + 1;
+        for (int age = 0; age <= MAX_AGE; age++) {
+            key->band_of[age] = (uint8_t)(age / band);
+        }
+    } else {
+        return -1;
+    }
+    if (key->cardinality == 0) {
+        key->cardinality = 1;  // Nothing coded yet, so there are no rows either
+    }
+    return 0;
+}
+
+// Fold one key into the group ids of a block of rows. Each case is a plain loop
+// over one column that the compiler can vectorize.
+void group_key_ids(struct GroupKey* key, size_t begin, size_t count, uint32_t* ids) {
+    uint32_t scale = key->cardinality;
+    if (key->column == COLUMN_GENDER) {
+        const uint8_t* values = columns.genders + begin;
+        for (size_t i = 0; i < count; i++) {
+            ids[i] = ids[i] * scale + values[i];
+        }
+    } else if (key->column == COLUMN_AGE) {
+        const uint8_t* values = columns.ages + begin;
+        for (size_t i = 0; i < count; i++) {
+            ids[i] = ids[i] * scale + key->band_of[values[i]];
+        }
+    } else {
+        const uint32_t* values = (key->column == COLUMN_DIAGNOSIS ? columns.diagnoses : columns.prescriptions) + begin;
+        for (size_t i = 0; i < count; i++) {
+            ids[i] = ids[i] * scale + values[i];
+        }
+    }
+}
+
+// Tally a slice of the rows a block at a time: compute the group ids, then count
+void* group_scan(void* arg) {
+    struct GroupTask* task = (struct GroupTask*)arg;
+    struct GroupBy* query = task->query;
+    uint32_t ids[COLUMN_BLOCK];
+    for (size_t begin = task->begin; begin < task->end; begin += COLUMN_BLOCK) {
+        size_t count = task->end - begin < COLUMN_BLOCK ? task->end - begin : COLUMN_BLOCK;
+        memset(ids, 0, count * sizeof(uint32_t));
+        for (int k = 0; k < query->key_count; k++) {
+            group_key_ids(&query->keys[k], begin, count, ids);
+        }
+        const uint8_t* ages = columns.ages + begin;
+        for (size_t i = 0; i < count; i++) {
+            uint32_t group = ids[i];
+            uint8_t age = ages[i];
+            task->counts[group]++;
+            task->min_ages[group] = age < task->min_ages[group] ? age : task->min_ages[group];
+            task->max_ages[group] = age > task->max_ages[group] ? age : task->max_ages[group];
+        }
+    }
+    return NULL;
+}
+
+// Function to count patients per group of up to two keys, with the youngest and
+// oldest age of each group; no keys gives the totals. Large tables are split
+// across threads that tally separately and are merged after. Returns the number
+// of non-empty groups, or -1 for an invalid query.
+long group_by(struct NameIndex* index, struct GroupBy* query, char** keys, int key_count) {
+    memset(query, 0, sizeof(*query));
+    if (key_count > COLUMN_MAX_KEYS) {
+        return -1;
+    }
+    METRIC_START(started);
+    uint64_t groups = 1;
+    for (int k = 0; k < key_count; k++) {
+        if (group_key_parse(&query->keys[k], keys[k]) < 0) {
+            return -1;
+        }
+        groups *= query->keys[k].cardinality;
+    }
+    if (groups > COLUMN_MAX_GROUPS) {
+        return -1;
+    }
+    query->key_count = key_count;
+    query->groups = (uint32_t)groups;
+    if (!columns.built) {
+        columns_build(index);
+    }
+
+    long threads = 1;
+#ifndef _WIN32
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if ((size_t)threads > columns.count / COLUMN_MIN_THREAD_ROWS) {
+        threads = (long)(columns.count / COLUMN_MIN_THREAD_ROWS);
+    }
+    threads = threads < 1 ? 1 : threads > COLUMN_MAX_THREADS ? COLUMN_MAX_THREADS : threads;
+    struct GroupTask tasks[COLUMN_MAX_THREADS];
+    for (long t = 0; t < threads; t++) {
+        tasks[t].query = query;
+        tasks[t].begin = columns.count * t / threads;
+        tasks[t].end = columns.count * (t + 1) / threads;
+        tasks[t].counts = (uint64_t*)calloc(groups, sizeof(uint64_t));
+        tasks[t].min_ages = (uint8_t*)malloc(groups);
+        tasks[t].max_ages = (uint8_t*)calloc(groups, 1);
+        memset(tasks[t].min_ages, 0xFF, groups);
+    }
+
+#ifdef _WIN32
+    group_scan(&tasks[0]);
+#else
+    pthread_t handles[COLUMN_MAX_THREADS];
+    int running[COLUMN_MAX_THREADS];
+    for (long t = 1; t < threads; t++) {
+        running[t] = pthread_create(&handles[t], NULL, group_scan, &tasks[t]) == 0;
+    }
+    group_scan(&tasks[0]);
+    for (long t = 1; t < threads; t++) {
+        if (running[t]) {
+            pthread_join(handles[t], NULL);
+        } else {
+            group_scan(&tasks[t]);
+        }
+    }
+#endif
+
+    // The first thread's tallies become the result
+    query->counts = tasks[0].counts;
+    query->min_ages = tasks[0].min_ages;
+    query->max_ages = tasks[0].max_ages;
+    for (long t = 1; t < threads; t++) {
+        for (uint32_t g = 0; g < query->groups; g++) {
+            query->counts[g] += tasks[t].counts[g];
+            query->min_ages[g] = tasks[t].min_ages[g] < query->min_ages[g] ? tasks[t].min_ages[g] : query->min_ages[g];
+            query->max_ages[g] = tasks[t].max_ages[g] > query->max_ages[g] ? tasks[t].max_ages[g] : query->max_ages[g];
+        }
+        free(tasks[t].counts);
+        free(tasks[t].min_ages);
+        free(tasks[t].max_ages);
+    }
+    long found = 0;
+    for (uint32_t g = 0; g < query->groups; g++) {
+        found += query->counts[g] > 0;
+    }
+    METRIC_STOP(METRIC_GROUP, started);
+    return found;
+}
+
+// Write one line per non-empty group: its key values, the patient count, and the
+// youngest and oldest age
+void group_output(struct Output* out, struct GroupBy* query) {
+    for (uint32_t g = 0; g < query->groups; g++) {
+        if (query->counts[g] == 0) {
+            continue;
+        }
+        // Split the group id back into key values, last key first
+        uint32_t values[COLUMN_MAX_KEYS];
+        uint32_t rest = g;
+        for (int k = query->key_count - 1; k >= 0; k--) {
+            values[k] = rest % query->keys[k].cardinality;
+            rest /= query->keys[k].cardinality;
+        }
+        for (int k = 0; k < query->key_count; k++) {
+            struct GroupKey* key = &query->keys[k];
+            if (key->column == COLUMN_GENDER) {
+                output_string(out, heap_string(gender_table[values[k]]));
+            } else if (key->column == COLUMN_DIAGNOSIS) {
+                output_string(out, dictionary_string(&diagnosis_dictionary, values[k]));
+            } else if (key->column == COLUMN_PRESCRIPTION) {
+                output_string(out, dictionary_string(&prescription_dictionary, values[k]));
+            } else {
+                output_uint(out, values[k] * key->band);
+                if (key->band > 1) {
+                    output_string(out, "-");
+                    output_uint(out, values[k] * key->band + key->band - 1);
+                }
+            }
+            output_string(out, "\t");
+        }
+        output_uint(out, query->counts[g]);
+        output_string(out, "\t");
+        output_uint(out, query->min_ages[g]);
+        output_string(out, "\t");
+        output_uint(out, query->max_ages[g]);
+        output_string(out, "\n");
+    }
+}
+
+void group_free(struct GroupBy* query) {
+    free(query->counts);
+    free(query->min_ages);
+    free(query->max_ages);
+}
+
+// Value of a patient's field, coded the way the column store keeps it
+uint32_t patient_field(struct Patient* patient, int column) {
+    if (column == COLUMN_GENDER) {
+        return patient->gender;
+    } else if (column == COLUMN_DIAGNOSIS) {
+        return patient_diagnosis_code(patient);
+    } else if (column == COLUMN_PRESCRIPTION) {
+        return patient_prescription_code(patient);
+    }
+    return patient->age;
+}
+
+// Column of a field an index can be declared over, or -1
+int secondary_column(const char* name) {
+    return strcmp(name, "gender") == 0 ? COLUMN_GENDER : strcmp(name, "diagnosis") == 0 ? COLUMN_DIAGNOSIS
+         : strcmp(name, "prescription") == 0 ? COLUMN_PRESCRIPTION : strcmp(name, "age") == 0 ? COLUMN_AGE : -1;
+}
+
+uint32_t secondary_hash(const uint32_t* key, int count) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < count; i++) {
+        hash = (hash ^ key[i]) * 16777619u;
+    }
+    return hash ^ (hash >> 15);
+}
+
+void secondary_rehash(struct SecondaryIndex* secondary, size_t capacity) {
+    free(secondary->slots);
+    secondary->slots = (uint32_t*)calloc(capacity, sizeof(uint32_t));
+    secondary->slot_capacity = capacity;
+    for (size_t list = 0; list < secondary->list_count; list++) {
+        size_t slot = secondary_hash(secondary->lists[list].key, secondary->field_count) & (capacity - 1);
+        while (secondary->slots[slot] != 0) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        secondary->slots[slot] = (uint32_t)list + 1;
+    }
+}
+
+// List of a key, or -1 if no patient has had it; with `create`, a new empty list
+long secondary_find(struct SecondaryIndex* secondary, const uint32_t* key, int create) {
+    size_t size = secondary->field_count * sizeof(uint32_t);
+    if (secondary->slot_capacity > 0) {
+        size_t mask = secondary->slot_capacity - 1;
+        for (size_t slot = secondary_hash(key, secondary->field_count) & mask; secondary->slots[slot] != 0; slot = (slot + 1) & mask) {
+            uint32_t list = secondary->slots[slot] - 1;
+            if (memcmp(secondary->lists[list].key, key, size) == 0) {
+                return (long)list;
+            }
+        }
+    }
+    if (!create) {
+        return -1;
+    }
+    if (secondary->list_count == secondary->list_capacity) {
+        secondary->list_capacity = secondary->list_capacity ? secondary->list_capacity * 2 : 64;
+        secondary->lists = (struct SecondaryList*)realloc(secondary->lists, secondary->list_capacity * sizeof(struct SecondaryList));
+    }
+    size_t list = secondary->list_count++;
+    memset(&secondary->lists[list], 0, sizeof(struct SecondaryList));
+    memcpy(secondary->lists[list].key, key, size);
+    if (secondary->list_count * 2 > secondary->slot_capacity) {
+        secondary_rehash(secondary, secondary->slot_capacity ? secondary->slot_capacity * 2 : 128);
+    } else {
+        size_t mask = secondary->slot_capacity - 1;
+        size_t slot = secondary_hash(key, secondary->field_count) & mask;
+        while (secondary->slots[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        secondary->slots[slot] = (uint32_t)list + 1;
+    }
+    return (long)list;
+}
+
+// Add a patient's handle to the list of their key in one index, or remove it
+void secondary_index_patient(struct SecondaryIndex* secondary, struct Patient* patient, int add) {
+    uint32_t key[SECONDARY_MAX_FIELDS];
+    for (int i = 0; i < secondary->field_count; i++) {
+        key[i] = patient_field(patient, secondary->fields[i]);
+    }
+    long list = secondary_find(secondary, key, add);
+    if (list >= 0) {
+        postings_change(&secondary->lists[list].postings, patient->handle, add);
+    }
+}
+
+void secondary_add(struct Patient* patient) {
+    for (int i = 0; i < secondary_index_count; i++) {
+        if (secondary_indexes[i].built) {
+            secondary_index_patient(&secondary_indexes[i], patient, 1);
+        }
+    }
+}
+
+void secondary_remove(struct Patient* patient) {
+    for (int i = 0; i < secondary_index_count; i++) {
+        if (secondary_indexes[i].built) {
+            secondary_index_patient(&secondary_indexes[i], patient, 0);
+        }
+    }
+}
+
+// Move a patient whose notes change between lists: called with add 0 before the
+// change and 1 after it. Only indexes over diagnosis or prescription notice.
+void secondary_update(struct Patient* patient, int add) {
+    for (int i = 0; i < secondary_index_count; i++) {
+        struct SecondaryIndex* secondary = &secondary_indexes[i];
+        for (int f = 0; secondary->built && f < secondary->field_count; f++) {
+            if (secondary->fields[f] == COLUMN_DIAGNOSIS || secondary->fields[f] == COLUMN_PRESCRIPTION) {
+                secondary_index_patient(secondary, patient, add);
+                break;
+            }
+        }
+    }
+}
+
+// Drop the lists; the declarations stay and the next query builds them again
+void secondary_reset() {
+    for (int i = 0; i < secondary_index_count; i++) {
+        struct SecondaryIndex* secondary = &secondary_indexes[i];
+        for (size_t list = 0; list < secondary->list_count; list++) {
+            struct Postings* postings = &secondary->lists[list].postings;
+            free(postings->data);
+            free(postings->skips);
+            free(postings->added);
+            free(postings->removed);
+        }
+        free(secondary->lists);
+        free(secondary->slots);
+        secondary->lists = NULL;
+        secondary->slots = NULL;
+        secondary->list_count = secondary->list_capacity = secondary->slot_capacity = 0;
+        secondary->built = 0;
+    }
+}
+
+// Index every patient, in handle order so the lists are built by appends alone
+void secondary_build(struct NameIndex* index, struct SecondaryIndex* secondary) {
+    uint32_t* handles = (uint32_t*)malloc((index->count > 0 ? index->count : 1) * sizeof(uint32_t));
+    size_t count = 0;
+    for (struct BptLeaf* leaf = name_index_first_leaf(index); leaf != NULL; leaf = name_index_next_leaf(leaf)) {
+        for (int i = 0; i < leaf->count; i++) {
+            handles[count++] = leaf->patients[i];
+        }
+    }
+    qsort(handles, count, sizeof(uint32_t), text_compare_handles);
+    for (size_t i = 0; i < count; i++) {
+        secondary_index_patient(secondary, patient_at(handles[i]), 1);
+        heap_release();
+    }
+    free(handles);
+    secondary->built = 1;
+}
+
+// Function to declare a secondary index over comma-separated fields, e.g.
+// "gender,age". Returns 1 for a new index, 0 if it was declared already and -1
+// for unknown or repeated fields or when no more indexes fit.
+int secondary_declare(struct NameIndex* index, const char* fields) {
+    struct SecondaryIndex declared;
+    memset(&declared, 0, sizeof(declared));
+    char name[16];
+    const char* cursor = fields;
+    while (1) {
+        size_t length = strcspn(cursor, ",");
+        int column = -1;
+        if (length < sizeof(name)) {
+            snprintf(name, sizeof(name), "%.*s", (int)length, cursor);
+            column = secondary_column(name);
+        }
+        for (int f = 0; f < declared.field_count; f++) {
+            column = declared.fields[f] == column ? -1 : column;
+        }
+        if (column < 0) {
+            return -1;
+        }
+        declared.fields[declared.field_count++] = column;
+        if (cursor[length] == '\0') {
+            break;
+        }
+        cursor += length + 1;
+    }
+    for (int i = 0; i < secondary_index_count; i++) {
+        if (secondary_indexes[i].field_count == declared.field_count
+            && memcmp(secondary_indexes[i].fields, declared.fields, sizeof(declared.fields)) == 0) {
+            return 0;
+        }
+    }
+    if (secondary_index_count == SECONDARY_MAX_INDEXES) {
+        return -1;
+    }
+    secondary_indexes[secondary_index_count] = declared;
+    secondary_build(index, &secondary_indexes[secondary_index_count]);
+    secondary_index_count++;
+    return 1;
+}
+
+// The index's fields as it was declared
+void secondary_describe(struct SecondaryIndex* secondary, char* text, size_t size) {
+    static const char* names[4] = {"gender", "diagnosis", "prescription", "age"};
+    size_t length = 0;
+    text[0] = '\0';
+    for (int f = 0; f < secondary->field_count && length < size; f++) {
+        length += (size_t)snprintf(text + length, size - length, "%s%s", f > 0 ? "," : "", names[secondary->fields[f]]);
+    }
+}
+
+// Parse conditions of the form field=value: name, gender, diagnosis and
+// prescription match exactly, age takes N or MIN-MAX and notes takes words that
+// must all appear. Values are looked up once here, so a value no patient has
+// makes the query empty without touching a record. Returns -1 when a condition
+// is malformed.
+int query_parse(struct NameIndex* index, struct Query* query, char** conditions, int count) {
+    memset(query, 0, sizeof(*query));
+    query->min_age = 0;
+    query->max_age = MAX_AGE;
+    if (count < 1 || count > QUERY_MAX_CONDITIONS) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        char* value = strchr(conditions[i], '=');
+        if (value == NULL) {
+            return -1;
+        }
+        *value++ = '\0';
+        const char* field = conditions[i];
+        if (strcmp(field, "name") == 0) {
+            query->empty |= query->name != NULL && strcmp(query->name, value) != 0;
+            query->name = value;
+            query->conditions |= QUERY_HAS_NAME;
+        } else if (strcmp(field, "age") == 0) {
+            char* end;
+            long low = strtol(value, &end, 10);
+            long high = *end == '-' ? strtol(end + 1, &end, 10) : low;
+            if (!isdigit((unsigned char)value[0]) || *end != '\0' || low < 0 || high > MAX_AGE || low > high) {
+                return -1;
+            }
+            query->min_age = low > query->min_age ? (int)low : query->min_age;
+            query->max_age = high < query->max_age ? (int)high : query->max_age;
+            query->empty |= query->min_age > query->max_age;
+            query->conditions |= 1 << COLUMN_AGE;
+        } else if (strcmp(field, "notes") == 0) {
+            if (!text_index.built) {
+                text_index_build(index);
+            }
+            char token[TEXT_MAX_TERM + 1];
+            size_t tokens = 0;
+            for (const char* at = value; text_next_token(&at, token) > 0; tokens++) {
+                long id = text_term_find(token, 0);
+                if (id < 0) {
+                    query->empty = 1;
+                } else if (query->term_count == TEXT_MAX_QUERY_TERMS) {
+                    return -1;
+                } else {
+                    query->terms[query->term_count++] = (uint32_t)id;
+                }
+            }
+            if (tokens == 0) {
+                return -1;
+            }
+            query->conditions |= QUERY_HAS_NOTES;
+        } else {
+            int column = secondary_column(field);
+            if (column < 0 || column == COLUMN_AGE) {
+                return -1;
+            }
+            uint32_t code = NO_CODE;
+            if (column == COLUMN_GENDER) {
+                for (int g = 0; g < gender_count; g++) {
+                    if (strcmp(heap_string(gender_table[g]), value) == 0) {
+                        code = (uint32_t)g;
+                    }
+                }
+            } else {
+                code = dictionary_find(column == COLUMN_DIAGNOSIS ? &diagnosis_dictionary : &prescription_dictionary, value);
+            }
+            query->empty |= code == NO_CODE || ((query->conditions & (1 << column)) && query->codes[column] != code);
+            query->codes[column] = code;
+            query->conditions |= 1 << column;
+        }
+    }
+    return 0;
+}
+
+// Look up every key of an index the query pins down: one per age when the index
+// has an age field, one otherwise. Returns how many patients the lists hold; with
+// `handles`, also appends them to *handles, each list in order.
+uint64_t query_index_probe(struct SecondaryIndex* secondary, struct Query* query, uint32_t** handles, size_t* count) {
+    uint32_t key[SECONDARY_MAX_FIELDS];
+    int age_field = -1;
+    for (int f = 0; f < secondary->field_count; f++) {
+        if (secondary->fields[f] == COLUMN_AGE) {
+            age_field = f;
+        } else {
+            key[f] = query->codes[secondary->fields[f]];
+        }
+    }
+    int first = age_field < 0 ? 0 : query->min_age;
+    int last = age_field < 0 ? 0 : query->max_age;
+    uint64_t total = 0;
+    for (int age = first; age <= last; age++) {
+        if (age_field >= 0) {
+            key[age_field] = (uint32_t)age;
+        }
+        long list = secondary_find(secondary, key, 0);
+        if (list < 0) {
+            continue;
+        }
+        struct Postings* postings = &secondary->lists[list].postings;
+        if (handles != NULL) {
+            postings_merge(postings);
+            *handles = (uint32_t*)realloc(*handles, (*count + postings->count + 1) * sizeof(uint32_t));
+            postings_decode(postings, *handles + *count);
+            *count += postings->count;
+        }
+        total += postings->count + postings->added_count - postings->removed_count;
+    }
+    return total;
+}
+
+// Pick the access path that yields the fewest patients. Every estimate is cheap:
+// a hash probe, an age prefix sum, a list length or a few index lookups, so all
+// of them are taken and only the winner reads records.
+void query_plan(struct NameIndex* index, struct AgeIndex* ages, struct Query* query) {
+    query->path = QUERY_SCAN;
+    query->estimate = index->count;
+    query->covered = 0;
+    if (query->empty) {
+        query->estimate = 0;
+        return;
+    }
+    if (query->conditions & QUERY_HAS_NAME) {
+        uint64_t estimate = search_patients(index, query->name, NULL, 0);
+        if (estimate < query->estimate) {
+            query->path = QUERY_NAME;
+            query->estimate = estimate;
+            query->covered = QUERY_HAS_NAME;
+        }
+    }
+    if (query->conditions & (1 << COLUMN_AGE)) {
+        uint64_t estimate = count_patients_by_age_range(ages, query->min_age, query->max_age);
+        if (estimate < query->estimate) {
+            query->path = QUERY_AGE;
+            query->estimate = estimate;
+            query->covered = 1 << COLUMN_AGE;
+        }
+    }
+    for (size_t t = 0; t < query->term_count; t++) {
+        // The group search intersects every word and applies the age range itself
+        struct Postings* postings = &text_index.terms[query->terms[t]];
+        uint64_t estimate = postings->count + postings->added_count - postings->removed_count;
+        if (estimate < query->estimate) {
+            query->path = QUERY_NOTES;
+            query->estimate = estimate;
+            query->covered = QUERY_HAS_NOTES | (1 << COLUMN_AGE);
+        }
+    }
+    for (int i = 0; i < secondary_index_count; i++) {
+        struct SecondaryIndex* secondary = &secondary_indexes[i];
+        int fields = 0;
+        for (int f = 0; f < secondary->field_count; f++) {
+            fields |= 1 << secondary->fields[f];
+        }
+        // Usable when the query gives every field but age, which defaults to all ages
+        if ((fields & ~(1 << COLUMN_AGE) & ~query->conditions) != 0 || (fields & query->conditions) == 0) {
+            continue;
+        }
+        if (!secondary->built) {
+            secondary_build(index, secondary);
+        }
+        uint64_t estimate = query_index_probe(secondary, query, NULL, NULL);
+        // On a tie, an index that meets more of the conditions saves checking them
+        if (estimate < query->estimate || (estimate == query->estimate && (fields & query->conditions & ~query->covered) != 0)) {
+            query->path = QUERY_INDEX;
+            query->index = i;
+            query->estimate = estimate;
+            query->covered = fields & query->conditions;
+        }
+    }
+}
+
+// Check the conditions the access path did not meet, except the notes words
+int query_match(struct Query* query, struct Patient* patient) {
+    int pending = query->conditions & ~query->covered;
+    if ((pending & (1 << COLUMN_AGE)) && (patient->age < query->min_age || patient->age > query->max_age)) {
+        return 0;
+    }
+    if ((pending & (1 << COLUMN_GENDER)) && patient->gender != query->codes[COLUMN_GENDER]) {
+        return 0;
+    }
+    if ((pending & (1 << COLUMN_DIAGNOSIS)) && patient_diagnosis_code(patient) != query->codes[COLUMN_DIAGNOSIS]) {
+        return 0;
+    }
+    if ((pending & (1 << COLUMN_PRESCRIPTION)) && patient_prescription_code(patient) != query->codes[COLUMN_PRESCRIPTION]) {
+        return 0;
+    }
+    return !(pending & QUERY_HAS_NAME) || strcmp(patient_name(patient), query->name) == 0;
+}
+
+// Function to run a planned query. Sets *results to the matching handles, lowest
+// ID first, and returns how many there are.
+long query_run(struct NameIndex* index, struct AgeIndex* ages, struct Query* query, uint32_t** results) {
+    METRIC_START(started);
+    *results = NULL;
+    size_t count = 0, capacity = 0;
+    if (query->empty) {
+        METRIC_STOP(METRIC_QUERY, started);
+        return 0;
+    }
+
+    // The driving path: the whole name tree, the hash entries of a name, an age
+    // range, the intersected notes lists or the lists of an index
+    int checked = 0;
+    if (query->path == QUERY_SCAN) {
+        for (struct BptLeaf* leaf = name_index_first_leaf(index); leaf != NULL; leaf = name_index_next_leaf(leaf)) {
+            for (int i = 0; i < leaf->count; i++) {
+                struct Patient* patient = patient_at(leaf->patients[i]);
+                if (query_match(query, patient)) {
+                    text_push(results, &count, &capacity, patient->handle);
+                }
+                heap_release();
+            }
+        }
+        METRIC_COUNT(query_rows, index->count);
+        checked = 1;
+    } else if (query->path == QUERY_NAME) {
+        count = search_patients(index, query->name, NULL, 0);
+        *results = (uint32_t*)malloc((count > 0 ? count : 1) * sizeof(uint32_t));
+        count = search_patients(index, query->name, *results, count);
+    } else if (query->path == QUERY_AGE) {
+        struct AgeRange range = search_patients_by_age_range(ages, query->min_age, query->max_age);
+        for (struct Patient* patient = age_range_next(&range); patient != NULL; patient = age_range_next(&range)) {
+            text_push(results, &count, &capacity, patient->handle);
+        }
+    } else if (query->path == QUERY_NOTES) {
+        count = text_search_group(ages, query->terms, query->term_count, query->min_age, query->max_age, results);
+    } else {
+        query_index_probe(&secondary_indexes[query->index], query, results, &count);
+    }
+    if (query->path != QUERY_SCAN) {
+        METRIC_COUNT(query_rows, count);
+    }
+    if (query->path != QUERY_NOTES && count > 1) {
+        qsort(*results, count, sizeof(uint32_t), text_compare_handles);
+    }
+
+    // Notes words by seeking through their lists, the rest on each record
+    if ((query->conditions & ~query->covered & QUERY_HAS_NOTES) && count > 0) {
+        for (size_t t = 0; t < query->term_count && count > 0; t++) {
+            struct PostingCursor cursor;
+            postings_merge(&text_index.terms[query->terms[t]]);
+            posting_cursor_open(&cursor, &text_index.terms[query->terms[t]]);
+            size_t kept = 0;
+            for (size_t j = 0; j < count; j++) {
+                if (!posting_cursor_seek(&cursor, (*results)[j])) {
+                    break;
+                }
+                if (cursor.value == (*results)[j]) {
+                    (*results)[kept++] = (*results)[j];
+                }
+            }
+            count = kept;
+        }
+    }
+    if (!checked && (query->conditions & ~query->covered & ~QUERY_HAS_NOTES)) {
+        size_t kept = 0;
+        for (size_t j = 0; j < count; j++) {
+            if (query_match(query, patient_at((*results)[j]))) {
+                (*results)[kept++] = (*results)[j];
+            }
+            heap_release();
+        }
+        count = kept;
+    }
+    METRIC_STOP(METRIC_QUERY, started);
+    return (long)count;
+}
+
+// One line saying which path a query takes and how many patients it expects there
+void query_explain(struct Output* out, struct Query* query) {
+    static const char* paths[5] = {"scan", "name", "age", "notes", "index"};
+    output_string(out, "PLAN ");
+    output_string(out, paths[query->path]);
+    if (query->path == QUERY_INDEX) {
+        char fields[64];
+        secondary_describe(&secondary_indexes[query->index], fields, sizeof(fields));
+        output_string(out, " ");
+        output_string(out, fields);
+    }
+    output_string(out, " estimate ");
+    output_uint(out, query->estimate);
+    output_string(out, "\n");
+}
+
+// Load records into an empty index, from text or from a binary snapshot. Returns
+// the number of patients added, or -1 if the file could not be read.
+int load_records_from_file(struct NameIndex *index, struct AgeIndex *ages, const char *filename) {
+    METRIC_START(load_started);
+    struct stat info;
+    if (stat(filename, &info) == 0 && S_ISDIR(info.st_mode)) {
+        int opened = shards_open(index, ages, filename);
+        METRIC_STOP(METRIC_LOAD, load_started);
+        return opened;
+    }
+    if (is_snapshot_file(filename)) {
+        int loaded = load_snapshot(index, ages, filename);
+        METRIC_STOP(METRIC_LOAD, load_started);
+        return loaded;
+    }
+
+    size_t length;
+    char *data = read_file(filename, &length);
+    if (data == NULL) {
+        printf("Error opening file for reading.\n");
+        return -1;
+    }
+
+    // One chunk per core, each ending just after a newline
+    long cores = 1;
+#ifndef _WIN32
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    size_t chunk_count = length / IMPORT_MIN_CHUNK + 1;
+    if (chunk_count > (size_t)cores) {
+        chunk_count = cores > 1 ? (size_t)cores : 1;
+    }
+    if (chunk_count > IMPORT_MAX_THREADS) {
+        chunk_count = IMPORT_MAX_THREADS;
+    }
+    struct ImportChunk chunks[IMPORT_MAX_THREADS];
+    char *cut = data;
+    for (size_t i = 0; i < chunk_count; i++) {
+        memset(&chunks[i], 0, sizeof(chunks[i]));
+        chunks[i].start = cut;
+        char *target = data + (i + 1) * length / chunk_count;
+        if (target < cut) {
+            target = cut;
+        }
+        char *newline = i + 1 < chunk_count ? (char *)memchr(target, '\n', (size_t)(data + length - target)) : NULL;
+        cut = newline != NULL ? newline + 1 : data + length;
+        chunks[i].end = cut;
+    }
+
+    import_parse_all(chunks, chunk_count);
+    int loaded = import_records(index, ages, chunks, chunk_count);
+    free(data);
+    METRIC_STOP(METRIC_LOAD, load_started);
+    fprintf(status_output(), "Patient records loaded from %s successfully.\n", filename);
+
+    return loaded;
+}
+
+// Check that a file would load before the current records are given up for it:
+// it opens, and a snapshot's header or a shard directory's manifest is one this
+// program can read. Reports what is wrong and returns 0 otherwise.
+int load_check(const char* filename) {
+    struct stat info;
+    if (stat(filename, &info) == 0 && S_ISDIR(info.st_mode)) {
+        int count;
+        unsigned long long records;
+        return shards_manifest(filename, &count, &records);
+    }
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        printf("Error opening file for reading.\n");
+        return 0;
+    }
+    struct SnapshotHeader header;
+    int ok = 1;
+    size_t got = fread(&header, 1, sizeof(header), file);
+    if (got >= sizeof(SNAPSHOT_MAGIC) && memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0
+        && (got < sizeof(header) || !snapshot_header_valid(&header, (size_t)info.st_size))) {
+        printf("%s is not a snapshot this program can read.\n", filename);
+        ok = 0;
+    }
+    fclose(file);
+    return ok;
+}
+
+// Function to replace the dataset with the records of a file. The current records
+// are only released once load_check passes, and the open database only takes the
+// new records as its base once they loaded, so a file that cannot be loaded
+// leaves the dataset, the database and its journal as they were. Returns what
+// load_records_from_file does.
+int replace_records_from_file(struct NameIndex* index, struct AgeIndex* ages, const char* filename) {
+    background_save_finish(1);  // It may be writing this very file
+    if (!load_check(filename)) {
+        return -1;
+    }
+    release_all_records(index, ages);
+    int loaded = load_records_from_file(index, ages, filename);
+    if (loaded >= 0) {
+        // The journal only holds changes, so the open database takes the loaded records as its new base
+        journal_checkpoint();
+    }
+    return loaded;
+}
+
+// Read a whole file into a buffer with a spare byte at the end, or return NULL.
+// A compressed text file comes back expanded.
+char *read_file(const char *filename, size_t *length) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    *length = size > 0 ? (size_t)size : 0;
+    char *data = (char *)malloc(*length + 1);  // Room to terminate a last line without a newline
+    *length = fread(data, 1, *length, file);
+    fclose(file);
+    if (*length >= sizeof(COLD_FILE_MAGIC) - 1 && memcmp(data, COLD_FILE_MAGIC, sizeof(COLD_FILE_MAGIC) - 1) == 0) {
+        return cold_file_expand(filename, data, length);
+    }
+    return data;
+}
+
+// Parse chunks in parallel, one thread each
+void import_parse_all(struct ImportChunk *chunks, size_t chunk_count) {
+    if (chunk_count == 0) {
+        return;
+    }
+#ifdef _WIN32
+    for (size_t i = 0; i < chunk_count; i++) {
+        import_parse_chunk(&chunks[i]);
+    }
+#else
+    pthread_t threads[IMPORT_MAX_THREADS];
+    int started[IMPORT_MAX_THREADS];
+    for (size_t i = 1; i < chunk_count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, import_parse_chunk, &chunks[i]) == 0;
+    }
+    import_parse_chunk(&chunks[0]);
+    for (size_t i = 1; i < chunk_count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            import_parse_chunk(&chunks[i]);
+        }
+    }
+#endif
+}
+
+// Create the patients of parsed chunks after reporting their errors, and index
+// them. Returns how many were added.
+int import_records(struct NameIndex *index, struct AgeIndex *ages, struct ImportChunk *chunks, size_t chunk_count) {
+    // Merge in file order: errors first, then the patients. When the index is
+    // empty they are collected and indexed in one bulk build.
+    size_t first_line = 1;
+    for (size_t i = 0; i < chunk_count; i++) {
+        for (size_t j = 0; j < chunks[i].error_count; j++) {
+            struct ImportError *error = &chunks[i].errors[j];
+            printf("Line %zu: skipping invalid record for %s (%s).\n", first_line + error->line - 1, error->name, error->reason);
+        }
+        first_line += chunks[i].lines;
+    }
+
+    struct NameKey *keys = NULL;
+    size_t key_count = 0;
+    int bulk = index->count == 0;
+    int loaded = 0;
+    if (bulk) {
+        size_t total = 0;
+        for (size_t i = 0; i < chunk_count; i++) {
+            total += chunks[i].record_count;
+        }
+        keys = (struct NameKey *)malloc((total > 0 ? total : 1) * sizeof(struct NameKey));
+    }
+    for (size_t i = 0; i < chunk_count; i++) {
+        for (size_t j = 0; j < chunks[i].record_count; j++) {
+            char **fields = chunks[i].records[j].fields;
+            struct Patient *new_patient = create_patient(fields[0], chunks[i].records[j].age, fields[2], fields[3], fields[4], fields[5]);
+            heap_release();
+            if (bulk) {
+                keys[key_count].prefix = name_prefix(fields[0]);
+                keys[key_count].name = new_patient->name;
+                keys[key_count].patient = new_patient->handle;
+                keys[key_count].handle = new_patient->handle;
+                key_count++;
+            } else {
+                add_patient(index, new_patient);
+                add_patient_by_age(ages, new_patient);
+                loaded++;
+            }
+        }
+        free(chunks[i].records);
+        free(chunks[i].errors);
+    }
+    if (bulk) {
+        loaded = (int)name_index_bulk_load(index, ages, keys, key_count);
+    }
+
+    free(keys);
+    return loaded;
+}
+
+// Path of a file in a shard directory: `file`, or shard `shard`'s file when file is NULL
+char* shard_path(const char* directory, const char* file, int shard) {
+    size_t length = strlen(directory) + 32;
+    char* path = (char*)malloc(length);
+    if (file != NULL) {
+        snprintf(path, length, "%s/%s", directory, file);
+    } else {
+        snprintf(path, length, "%s/shard-%03d.txt", directory, shard);
+    }
+    return path;
+}
+
+// Worker: write one shard's text file
+void* shard_save_run(void* argument) {
+    struct ShardSave* shard = (struct ShardSave*)argument;
+    shard->ok = save_text_file(shard->path, shard->handles, shard->count);
+    return NULL;
+}
+
+// Function to save the records as a shard directory: split them by name hash in
+// one pass, write the shard files in parallel, then the manifest that makes the
+// directory loadable. Returns 0 after reporting an error.
+int save_shards(struct NameIndex* index, const char* directory) {
+    struct stat info;
+    mkdir(directory, 0755);
+    if (stat(directory, &info) != 0 || !S_ISDIR(info.st_mode)) {
+        printf("Error creating directory %s.\n", directory);
+        return 0;
+    }
+
+    struct ShardSave saves[SHARD_COUNT];
+    memset(saves, 0, sizeof(saves));
+    for (struct BptLeaf* leaf = name_index_first_leaf(index); leaf != NULL; leaf = name_index_next_leaf(leaf)) {
+        for (int i = 0; i < leaf->count; i++) {
+            struct ShardSave* save = &saves[name_hash_of(patient_name(patient_at(leaf->patients[i]))) % SHARD_COUNT];
+            text_push(&save->handles, &save->count, &save->capacity, leaf->patients[i]);
+            heap_release();
+        }
+    }
+    for (int k = 0; k < SHARD_COUNT; k++) {
+        saves[k].path = shard_path(directory, NULL, k);
+    }
+
+    // A paged heap and the cold store are not thread-safe, and a background save's
+    // forked child must not start threads, so then the shards are written one by one
+#ifdef _WIN32
+    for (int k = 0; k < SHARD_COUNT; k++) {
+        shard_save_run(&saves[k]);
+    }
+#else
+    pthread_t threads[SHARD_COUNT];
+    int started[SHARD_COUNT];
+    for (int k = 1; k < SHARD_COUNT; k++) {
+        started[k] = heap_pool.fd < 0 && !cold_store.enabled && !background_save.child && pthread_create(&threads[k], NULL, shard_save_run, &saves[k]) == 0;
+    }
+    shard_save_run(&saves[0]);
+    for (int k = 1; k < SHARD_COUNT; k++) {
+        if (started[k]) {
+            pthread_join(threads[k], NULL);
+        } else {
+            shard_save_run(&saves[k]);
+        }
+    }
+#endif
+
+    int ok = 1;
+    for (int k = 0; k < SHARD_COUNT; k++) {
+        ok = ok && saves[k].ok;
+        free(saves[k].path);
+        free(saves[k].handles);
+    }
+    if (!ok) {
+        return 0;
+    }
+    char* manifest = shard_path(directory, "manifest", 0);
+    char* temp_name = shard_path(directory, "manifest.tmp", 0);
+    FILE* file = fopen(temp_name, "w");
+    ok = file != NULL && fprintf(file, SHARD_MANIFEST, SHARD_COUNT, (unsigned long long)index->count) > 0;
+    ok = file != NULL && fclose(file) == 0 && ok;
+#ifdef _WIN32
+    remove(manifest);
+#endif
+    if (!ok || rename(temp_name, manifest) != 0) {
+        printf("Error writing %s.\n", manifest);
+        remove(temp_name);
+        ok = 0;
+    }
+    free(manifest);
+    free(temp_name);
+    return ok;
+}
+
+// Function to open a shard directory into an empty dataset. Nothing is read but
+// the manifest; see shards_need. Returns the patients the manifest lists (0 when
+// it predates the count), or -1.
+int shards_open(struct NameIndex* index, struct AgeIndex* ages, const char* directory) {
+    int count;
+    unsigned long long records;
+    if (!shards_manifest(directory, &count, &records)) {
+        return -1;
+    }
+
+    shards_close();
+    shards.directory = (char*)malloc(strlen(directory) + 1);
+    strcpy(shards.directory, directory);
+    shards.count = count;
+    memset(shards.loaded, 0, sizeof(shards.loaded));
+    shards.index = index;
+    shards.ages = ages;
+    fprintf(status_output(), "Opened %d shards of %llu patients in %s; each is read when first needed.\n", count, records, directory);
+    return (int)records;
+}
+
+// Read a shard directory's manifest, or report that it has none this program can
+// read and return 0
+int shards_manifest(const char* directory, int* count, unsigned long long* records) {
+    char* manifest = shard_path(directory, "manifest", 0);
+    FILE* file = fopen(manifest, "r");
+    *count = 0;
+    *records = 0;
+    int ok = file != NULL && fscanf(file, SHARD_MANIFEST, count, records) >= 1 && *count > 0 && *count <= SHARD_MAX
+             && *records <= INT_MAX;
+    if (file != NULL) {
+        fclose(file);
+    }
+    free(manifest);
+    if (!ok) {
+        printf("%s is not a shard directory this program can read.\n", directory);
+    }
+    return ok;
+}
+
+// Function to read the shards still on disk that a command needs: the shard of
+// `name`, or all of them when name is NULL. Each is parsed on a thread of its own.
+void shards_need(const char* name) {
+    if (shards.directory == NULL) {
+        return;
+    }
+    int wanted[SHARD_MAX];
+    int wanted_count = 0;
+    if (name != NULL) {
+        int shard = (int)(name_hash_of(name) % (uint32_t)shards.count);
+        if (shards.loaded[shard]) {
+            return;
+        }
+        wanted[wanted_count++] = shard;
+    } else {
+        for (int k = 0; k < shards.count; k++) {
+            if (!shards.loaded[k]) {
+                wanted[wanted_count++] = k;
+            }
+        }
+    }
+
+    METRIC_START(started);
+    struct ImportChunk chunks[SHARD_MAX];
+    char* data[SHARD_MAX];
+    size_t chunk_count = 0;
+    for (int i = 0; i < wanted_count; i++) {
+        shards.loaded[wanted[i]] = 1;
+        char* path = shard_path(shards.directory, NULL, wanted[i]);
+        size_t length;
+        data[chunk_count] = read_file(path, &length);
+        if (data[chunk_count] == NULL) {
+            printf("Error opening shard %s.\n", path);
+        } else {
+            memset(&chunks[chunk_count], 0, sizeof(chunks[chunk_count]));
+            chunks[chunk_count].start = data[chunk_count];
+            chunks[chunk_count].end = data[chunk_count] + length;
+            chunk_count++;
+        }
+        free(path);
+    }
+    import_parse_all(chunks, chunk_count);
+    import_records(shards.index, shards.ages, chunks, chunk_count);
+    for (size_t i = 0; i < chunk_count; i++) {
+        free(data[i]);
+    }
+    METRIC_STOP(METRIC_LOAD, started);
+
+    int pending = 0;
+    for (int k = 0; k < shards.count; k++) {
+        pending += !shards.loaded[k];
+    }
+    if (pending == 0) {
+        shards_close();
+    }
+}
+
+// Forget the shards that were never read (the dataset is complete or replaced)
+void shards_close() {
+    free(shards.directory);
+    shards.directory = NULL;
+    shards.count = 0;
+}
+
+// Note a bad line in a chunk's own error list
+void import_error(struct ImportChunk* chunk, const char* name, const char* reason) {
+    if (chunk->error_count == chunk->error_capacity) {
+        chunk->error_capacity = chunk->error_capacity ? chunk->error_capacity * 2 : 16;
+        chunk->errors = (struct ImportError*)realloc(chunk->errors, chunk->error_capacity * sizeof(struct ImportError));
+    }
+    chunk->errors[chunk->error_count].line = chunk->lines;
+    chunk->errors[chunk->error_count].name = name;
+    chunk->errors[chunk->error_count].reason = reason;
+    chunk->error_count++;
+}
+
+// Undo the TSV escapes of a field in place and return its new length. An unknown
+// escape keeps its backslash.
+size_t import_unescape(char* field) {
+    char* out = field;
+    for (char* c = field; *c != '\0'; c++) {
+        if (*c == '\\' && c[1] != '\0') {
+            char code = c[1] == '\\' ? '\\' : c[1] == 't' ? '\t' : c[1] == 'n' ? '\n' : c[1] == 'r' ? '\r' : '\0';
+            if (code != '\0') {
+                *out++ = code;
+                c++;
+                continue;
+            }
+        }
+        *out++ = *c;
+    }
+    *out = '\0';
+    return (size_t)(out - field);
+}
+
+// Worker: split every line of a chunk into its fields, terminating them in place.
+// Lines are found with memchr, which the C library vectorizes. A line with a tab
+// is cut at every tab and its fields unescaped; one without is cut into runs of
+// anything but spaces. Blank lines are ignored.
+void* import_parse_chunk(void* argument) {
+    struct ImportChunk* chunk = (struct ImportChunk*)argument;
+    char* line = chunk->start;
+    while (line < chunk->end) {
+        char* newline = (char*)memchr(line, '\n', (size_t)(chunk->end - line));
+        char* end = newline != NULL ? newline : chunk->end;
+        char* next = end + (newline != NULL);
+        while (end > line && end[-1] == '\r') {
+            end--;
+        }
+        chunk->lines++;
+
+        char* fields[IMPORT_FIELDS];
+        int count = 0;
+        int too_long = 0;
+        char* cursor = line;
+        if (memchr(line, '\t', (size_t)(end - line)) != NULL) {
+            *end = '\0';
+            while (cursor != NULL) {
+                char* field = cursor;
+                cursor = strchr(cursor, '\t');
+                if (cursor != NULL) {
+                    *cursor++ = '\0';
+                }
+                too_long |= import_unescape(field) > HEAP_MAX_STRING;
+                if (count < IMPORT_FIELDS) {
+                    fields[count] = field;
+                }
+                count++;
+            }
+        } else {
+            while (1) {
+                while (cursor < end && *cursor == ' ') {
+                    cursor++;
+                }
+                if (cursor == end) {
+                    break;
+                }
+                char* field = cursor;
+                while (cursor < end && *cursor != ' ') {
+                    cursor++;
+                }
+                too_long |= (size_t)(cursor - field) > HEAP_MAX_STRING;
+                if (count < IMPORT_FIELDS) {
+                    fields[count] = field;
+                }
+                count++;
+                if (cursor < end) {
+                    *cursor++ = '\0';
+                }
+            }
+            *end = '\0';
+        }
+        line = next;
+
+        if (count == 0) {
+            continue;
+        }
+        if (count != IMPORT_FIELDS) {
+            import_error(chunk, fields[0], count < IMPORT_FIELDS ? "too few fields" : "too many fields");
+            continue;
+        }
+        if (too_long) {
+            import_error(chunk, fields[0], "field too long");
+            continue;
+        }
+        char* age_end;
+        long age = strtol(fields[1], &age_end, 10);
+        if (*age_end != '\0' || age < 0 || age > MAX_AGE) {
+            import_error(chunk, fields[0], "invalid age");
+            continue;
+        }
+
+        if (chunk->record_count == chunk->record_capacity) {
+            chunk->record_capacity = chunk->record_capacity ? chunk->record_capacity * 2 : 1024;
+            chunk->records = (struct ImportRecord*)realloc(chunk->records, chunk->record_capacity * sizeof(struct ImportRecord));
+        }
+        struct ImportRecord* record = &chunk->records[chunk->record_count++];
+        memcpy(record->fields, fields, sizeof(fields));
+        record->age = (int)age;
+    }
+    return NULL;
+}
+
+// Write `length` bytes, then zero padding up to the next SNAPSHOT_ALIGN boundary
+int snapshot_write(FILE* file, const void* data, size_t length, uint64_t* position) {
+    static const char zeros[SNAPSHOT_ALIGN];
+    if (length > 0 && fwrite(data, 1, length, file) != length) {
+        return 0;
+    }
+    *position += length;
+    size_t padding = (size_t)((SNAPSHOT_ALIGN - *position % SNAPSHOT_ALIGN) % SNAPSHOT_ALIGN);
+    if (padding > 0 && fwrite(zeros, 1, padding, file) != padding) {
+        return 0;
+    }
+    *position += padding;
+    return 1;
+}
+
+// Write every slab a pool has handed objects out of, in handle order
+int snapshot_write_pool(FILE* file, struct SlabPool* pool, struct SnapshotPool* entry, uint64_t* position) {
+    entry->offset = *position;
+    entry->used = pool->used;
+    entry->free_list = pool->free_list;
+    entry->live = pool->live;
+    size_t count = ((size_t)pool->used + SLAB_OBJECTS - 1) >> SLAB_SHIFT;
+    for (size_t i = 0; i < count; i++) {
+        if (!snapshot_write(file, pool->slabs[i], SLAB_OBJECTS * pool->object_size, position)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Save the whole dataset as a binary snapshot. The file is written next to the
+// target and renamed over it, so a snapshot that is currently mapped stays intact.
+int save_snapshot(struct NameIndex* index, struct AgeIndex* ages, const char* filename) {
+    shards_need(NULL);
+    cold_seal();  // The open block is not in the heap yet
+    size_t length = strlen(filename);
+    char* temp_name = (char*)malloc(length + 5);
+    memcpy(temp_name, filename, length);
+    memcpy(temp_name + length, ".tmp", 5);
+
+    FILE* file = fopen(temp_name, "wb");
+    if (file == NULL) {
+        printf("Error opening file for writing.\n");
+        free(temp_name);
+        return 0;
+    }
+
+    struct SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.slab_objects = SLAB_OBJECTS;
+    header.patient_size = (uint32_t)patient_pool.object_size;
+    header.leaf_size = (uint32_t)leaf_pool.object_size;
+    header.inner_size = (uint32_t)inner_pool.object_size;
+    header.gender_count = (uint32_t)gender_count;
+    header.heap_chunk_size = HEAP_CHUNK_SIZE;
+    header.index_root = index->root;
+    header.index_height = index->height;
+    header.index_count = index->count;
+    header.journal_sequence = journal.sequence;
+    header.cold_text = (uint32_t)cold_store.enabled;
+    header.cold_blocks = cold_store.blocks;
+    header.cold_raw_bytes = cold_store.raw_bytes;
+    header.cold_stored_bytes = cold_store.stored_bytes;
+
+    // Reserve the header page, write the sections, then come back for the header
+    uint64_t position = 0;
+    int ok = snapshot_write(file, &header, sizeof(header), &position)
+        && snapshot_write_pool(file, &patient_pool, &header.patients, &position)
+        && snapshot_write_pool(file, &leaf_pool, &header.leaves, &position)
+        && snapshot_write_pool(file, &inner_pool, &header.inners, &position);
+
+    header.heap_offset = position;
+    header.heap_used = string_heap.used;
+    for (uint64_t offset = 0; ok && offset < string_heap.used; offset += HEAP_CHUNK_SIZE) {
+        // Whole chunks are page multiples, so only the last one is followed by padding
+        uint64_t chunk_bytes = string_heap.used - offset < HEAP_CHUNK_SIZE ? string_heap.used - offset : HEAP_CHUNK_SIZE;
+        ok = snapshot_write(file, heap_string(offset), (size_t)chunk_bytes, &position);
+        heap_release();
+    }
+
+    header.genders_offset = position;
+    ok = ok && snapshot_write(file, gender_table, sizeof(gender_table), &position);
+    header.hash_offset = position;
+    header.hash_capacity = index->hash.capacity;
+    ok = ok && snapshot_write(file, index->hash.slots, index->hash.capacity * sizeof(struct NameHashSlot), &position);
+    header.ages_offset = position;
+    ok = ok && snapshot_write(file, ages, sizeof(*ages), &position);
+    header.diagnoses_offset = position;
+    header.diagnosis_count = diagnosis_dictionary.count;
+    ok = ok && snapshot_write(file, diagnosis_dictionary.values, diagnosis_dictionary.count * sizeof(uint64_t), &position);
+    header.prescriptions_offset = position;
+    header.prescription_count = prescription_dictionary.count;
+    ok = ok && snapshot_write(file, prescription_dictionary.values, prescription_dictionary.count * sizeof(uint64_t), &position);
+    header.file_size = position;
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = (fclose(file) == 0) && ok;
+
+#ifdef _WIN32
+    remove(filename);
+#endif
+    if (!ok || rename(temp_name, filename) != 0) {
+        printf("Error writing snapshot %s.\n", filename);
+        remove(temp_name);
+        free(temp_name);
+        return 0;
+    }
+    free(temp_name);
+    return 1;
+}
+
+// Check for the snapshot magic at the start of a file
+int is_snapshot_file(const char* filename) {
+    char magic[8];
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    int match = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0;
+    fclose(file);
+    return match;
+}
+
+// Whether `length` bytes at `offset` are an aligned section inside a file of
+// `size` bytes (written so that a huge offset or length cannot wrap around)
+int snapshot_range_valid(uint64_t offset, uint64_t length, size_t size) {
+    return offset % SNAPSHOT_ALIGN == 0 && offset <= size && length <= size - offset;
+}
+
+// Whether a pool's whole slabs fit in the file and its counts agree with each other
+int snapshot_pool_valid(const struct SnapshotPool* pool, size_t object_size, size_t size) {
+    uint64_t slabs = ((uint64_t)pool->used + SLAB_OBJECTS - 1) >> SLAB_SHIFT;
+    return pool->live <= pool->used && (pool->free_list == NO_HANDLE || pool->free_list < pool->used)
+        && snapshot_range_valid(pool->offset, slabs * SLAB_OBJECTS * object_size, size);
+}
+
+// Whether a snapshot header was written by this build for a file of `size` bytes,
+// with every section inside the file, so a truncated or corrupt snapshot is
+// turned away before anything points into it
+int snapshot_header_valid(const struct SnapshotHeader* header, size_t size) {
+    uint32_t root_pool_used = header->index_height == 1 ? header->leaves.used : header->inners.used;
+    return memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0 && header->version == SNAPSHOT_VERSION
+        && header->slab_objects == SLAB_OBJECTS && header->patient_size == patient_pool.object_size
+        && header->leaf_size == leaf_pool.object_size && header->inner_size == inner_pool.object_size
+        && header->heap_chunk_size == HEAP_CHUNK_SIZE && header->gender_count <= GENDER_CODES
+        && header->file_size == size
+        && snapshot_pool_valid(&header->patients, patient_pool.object_size, size)
+        && snapshot_pool_valid(&header->leaves, leaf_pool.object_size, size)
+        && snapshot_pool_valid(&header->inners, inner_pool.object_size, size)
+        && snapshot_range_valid(header->heap_offset, header->heap_used, size)
+        && snapshot_range_valid(header->genders_offset, sizeof(gender_table), size)
+        && header->index_count <= header->patients.live
+        && (header->index_height == 0 ? header->index_root == NO_HANDLE && header->index_count == 0
+            : header->index_height > 0 && header->index_height <= 64 && header->index_root < root_pool_used)
+        && (header->hash_capacity & (header->hash_capacity - 1)) == 0
+        && header->hash_capacity <= size / sizeof(struct NameHashSlot)
+        && (header->hash_capacity == 0 || header->hash_capacity > header->index_count)
+        && snapshot_range_valid(header->hash_offset, header->hash_capacity * sizeof(struct NameHashSlot), size)
+        && snapshot_range_valid(header->ages_offset, sizeof(struct AgeIndex), size)
+        && snapshot_range_valid(header->diagnoses_offset, (uint64_t)header->diagnosis_count * sizeof(uint64_t), size)
+        && snapshot_range_valid(header->prescriptions_offset, (uint64_t)header->prescription_count * sizeof(uint64_t), size);
+}
+
+// Map a snapshot into an empty dataset. The pools, heap and index are used in
+// place; the mapping lives until release_all_records drops the dataset. Returns
+// the number of patients, or -1 if the file is not a usable snapshot.
+int load_snapshot(struct NameIndex* index, struct AgeIndex* ages, const char* filename) {
+    struct stat info;
+    if (stat(filename, &info) != 0 || (size_t)info.st_size < sizeof(struct SnapshotHeader)) {
+        printf("Error opening file for reading.\n");
+        return -1;
+    }
+    size_t size = (size_t)info.st_size;
+
+#ifdef _WIN32
+    // No mmap here: read the image into memory once, then use it the same way
+    char* base = (char*)malloc(size);
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL || fread(base, 1, size, file) != size) {
+        if (file != NULL) {
+            fclose(file);
+        }
+        free(base);
+        printf("Error opening file for reading.\n");
+        return -1;
+    }
+    fclose(file);
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Error opening file for reading.\n");
+        return -1;
+    }
+    char* base = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == (char*)MAP_FAILED) {
+        printf("Error mapping %s.\n", filename);
+        return -1;
+    }
+#endif
+
+    struct SnapshotHeader* header = (struct SnapshotHeader*)base;
+    if (!snapshot_header_valid(header, size)) {
+        printf("%s is not a snapshot this program can read.\n", filename);
+#ifdef _WIN32
+        free(base);
+#else
+        munmap(base, size);
+#endif
+        return -1;
+    }
+
+    snapshot_base = base;
+    snapshot_size = size;
+    pool_adopt(&patient_pool, base + header->patients.offset, header->patients.used, header->patients.free_list, header->patients.live);
+    pool_adopt(&leaf_pool, base + header->leaves.offset, header->leaves.used, header->leaves.free_list, header->leaves.live);
+    pool_adopt(&inner_pool, base + header->inners.offset, header->inners.used, header->inners.free_list, header->inners.live);
+    heap_adopt(base + header->heap_offset, header->heap_used);
+    memcpy(gender_table, base + header->genders_offset, sizeof(gender_table));
+    gender_count = (int)header->gender_count;
+    index->root = header->index_root;
+    index->height = header->index_height;
+    index->count = (size_t)header->index_count;
+    index->hash.slots = header->hash_capacity > 0 ? (struct NameHashSlot*)(base + header->hash_offset) : NULL;
+    index->hash.capacity = (size_t)header->hash_capacity;
+    index->hash.count = index->count;
+    index->hash.borrowed = 1;
+    memcpy(ages, base + header->ages_offset, sizeof(*ages));
+    struct Dictionary* dictionaries[2] = {&diagnosis_dictionary, &prescription_dictionary};
+    uint64_t offsets[2] = {header->diagnoses_offset, header->prescriptions_offset};
+    uint32_t counts[2] = {header->diagnosis_count, header->prescription_count};
+    for (int i = 0; i < 2; i++) {
+        // The values are used in place; only the lookup table is rebuilt
+        dictionaries[i]->values = (uint64_t*)(base + offsets[i]);
+        dictionaries[i]->count = counts[i];
+        dictionaries[i]->capacity = counts[i];
+        dictionaries[i]->borrowed = 1;
+        dictionary_rehash(dictionaries[i], 128);
+        while (dictionaries[i]->count * 2 > dictionaries[i]->slot_capacity) {
+            dictionary_rehash(dictionaries[i], dictionaries[i]->slot_capacity * 2);
+        }
+    }
+    journal.sequence = header->journal_sequence;
+    cold_store.enabled |= header->cold_text != 0;
+    cold_store.blocks = header->cold_blocks;
+    cold_store.raw_bytes = header->cold_raw_bytes;
+    cold_store.stored_bytes = header->cold_stored_bytes;
+
+    fprintf(status_output(), "Patient records loaded from %s successfully.\n", filename);
+    return (int)index->count;
+}
+
+// FNV-1a hash, used to detect torn or corrupt journal records
+uint32_t journal_checksum(const char* data, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void journal_reserve(size_t extra) {
+    if (journal.length + extra > journal.capacity) {
+        while (journal.length + extra > journal.capacity) {
+            journal.capacity = journal.capacity ? journal.capacity * 2 : 4096;
+        }
+        journal.buffer = (char*)realloc(journal.buffer, journal.capacity);
+    }
+}
+
+void journal_put(const void* data, size_t length) {
+    journal_reserve(length);
+    memcpy(journal.buffer + journal.length, data, length);
+    journal.length += length;
+}
+
+void journal_put_string(const char* text) {
+    uint32_t length = (uint32_t)strlen(text);
+    journal_put(&length, sizeof(length));
+    journal_put(text, length);
+}
+
+// Start a record: [payload length][checksum][sequence][op], payload follows. Inside
+// a batch the record is just [payload length][op]; the batch record carries the rest.
+size_t journal_begin(uint8_t op) {
+    size_t start = journal.length;
+    uint32_t placeholder = 0;
+    if (journal.batching) {
+        journal_put(&placeholder, sizeof(placeholder));
+        journal_put(&op, sizeof(op));
+        return start;
+    }
+    uint64_t sequence = ++journal.sequence;
+    journal_put(&placeholder, sizeof(placeholder));
+    journal_put(&placeholder, sizeof(placeholder));
+    journal_put(&sequence, sizeof(sequence));
+    journal_put(&op, sizeof(op));
+    return start;
+}
+
+// Seal a record and commit the group once it is large enough
+void journal_end(size_t start) {
+    if (journal.batching) {
+        uint32_t length = (uint32_t)(journal.length - start - JOURNAL_ENTRY_BYTES);
+        memcpy(journal.buffer + start, &length, sizeof(length));
+        return;
+    }
+    uint32_t length = (uint32_t)(journal.length - start - JOURNAL_HEADER_BYTES);
+    uint32_t checksum = journal_checksum(journal.buffer + start + 8, journal.length - start - 8);
+    memcpy(journal.buffer + start, &length, sizeof(length));
+    memcpy(journal.buffer + start + 4, &checksum, sizeof(checksum));
+    journal.pending++;
+    if (journal.pending >= JOURNAL_GROUP_RECORDS) {
+        journal_commit();
+    }
+}
+
+void journal_log_add(struct Patient* patient) {
+    if (journal.database == NULL) {
+        return;
+    }
+    size_t start = journal_begin(JOURNAL_ADD);
+    journal_put(&patient->handle, sizeof(patient->handle));
+    journal_put(&patient->age, sizeof(patient->age));
+    journal_put_string(patient_name(patient));
+    journal_put_string(patient_gender(patient));
+    journal_put_string(patient_medical_history(patient));
+    journal_put_string(patient_diagnosis(patient));
+    journal_put_string(patient_prescription(patient));
+    journal_end(start);
+}
+
+void journal_log_update(struct Patient* patient) {
+    if (journal.database == NULL) {
+        return;
+    }
+    size_t start = journal_begin(JOURNAL_UPDATE);
+    journal_put(&patient->handle, sizeof(patient->handle));
+    journal_put_string(patient_name(patient));
+    journal_put_string(patient_medical_history(patient));
+    journal_put_string(patient_diagnosis(patient));
+    journal_put_string(patient_prescription(patient));
+    journal_end(start);
+}
+
+// Log a delete; called while the patient still holds its ID
+void journal_log_delete(struct Patient* patient) {
+    if (journal.database == NULL) {
+        return;
+    }
+    size_t start = journal_begin(JOURNAL_DELETE);
+    journal_put(&patient->handle, sizeof(patient->handle));
+    journal_put_string(patient_name(patient));
+    journal_end(start);
+}
+
+// Log the changes of a write batch as one record until journal_batch_end. The one
+// checksum covers them all, so replay applies the whole batch or none of it.
+void journal_batch_begin() {
+    if (journal.database == NULL) {
+        return;
+    }
+    journal.batch = journal_begin(JOURNAL_BATCH);
+    journal.batching = 1;
+}
+
+void journal_batch_end() {
+    if (!journal.batching) {
+        return;
+    }
+    journal.batching = 0;
+    journal_end(journal.batch);
+}
+
+// Write the pending group with one write and make it durable with one fsync.
+// Also starts a compaction when the journal has grown large.
+void journal_commit() {
+    if (journal.database == NULL || journal.length == 0) {
+        return;
+    }
+    size_t written = 0;
+    while (written < journal.length) {
+        long result = (long)write(journal.fd, journal.buffer + written, (unsigned)(journal.length - written));
+        if (result <= 0) {
+            printf("Error writing journal for %s.\n", journal.database);
+            break;
+        }
+        written += (size_t)result;
+    }
+    fsync(journal.fd);
+    journal.size += written;
+    journal.length = 0;
+    journal.pending = 0;
+
+    if (journal.size >= JOURNAL_COMPACT_BYTES) {
+        journal_compact();
+    }
+}
+
+// Name of the journal (suffix ".journal") or of a sealed segment (".journal.old")
+char* journal_path(const char* database, const char* suffix) {
+    size_t length = strlen(database);
+    char* path = (char*)malloc(length + strlen(suffix) + 1);
+    memcpy(path, database, length);
+    strcpy(path + length, suffix);
+    return path;
+}
+
+// Fold everything into the snapshot now and empty the journal
+int journal_checkpoint() {
+    if (journal.database == NULL) {
+        return 0;
+    }
+    journal_commit();
+    if (!save_snapshot(journal.index, journal.ages, journal.database)) {
+        return 0;
+    }
+    char* sealed = journal_path(journal.database, ".journal.old");
+    remove(sealed);
+    free(sealed);
+    ftruncate(journal.fd, 0);
+    lseek(journal.fd, 0, SEEK_SET);
+    journal.size = 0;
+    return 1;
+}
+
+// Seal the current journal and fold it into the snapshot off the write path: a
+// forked child writes the snapshot from its copy-on-write image of memory while
+// this process keeps appending to a fresh journal. Without fork it checkpoints.
+void journal_compact() {
+    char* sealed = journal_path(journal.database, ".journal.old");
+    struct stat info;
+#ifndef _WIN32
+    if (journal.compactor != 0) {
+        int status;
+        pid_t done = waitpid((pid_t)journal.compactor, &status, WNOHANG);
+        if (done == 0) {
+            free(sealed);
+            return;  // The previous compaction is still running
+        }
+        journal.compactor = 0;
+        if (done < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            journal_checkpoint();  // It failed; fold the sealed segment in synchronously
+            free(sealed);
+            return;
+        }
+    }
+#endif
+    if (stat(sealed, &info) == 0) {
+        free(sealed);
+        journal_checkpoint();
+        return;
+    }
 
-// Function prototypes
-struct Patient* create_patient(const char* name, int age, const char* gender, const char* medical_history, const char* diagnosis, const char* prescription);
-struct Patient* add_patient(struct Patient* root, struct Patient* new_patient);
-struct Patient* search_patient(struct Patient* root, const char* name);
-struct Patient* find_min(struct Patient* root);
-struct Patient* delete_patient_record(struct Patient* root, const char* name);
-void display_all_records(struct Patient* root);
-void save_records_to_file(struct Patient* root, const char* filename);
-struct Patient* load_records_from_file(const char* filename);
-
-// Function prototypes for age-based trees
-struct AgeNode* create_age_node(int age);
-struct AgeNode* add_patient_by_age(struct AgeNode* root, struct Patient* new_patient);
-void search_patients_by_age_range(struct AgeNode* root, int min_age, int max_age);
-
-// Function prototype for save_patient_records
-void save_patient_records(struct Patient* patient, FILE* file);
-
-// Function prototype for load_records_from_file_internal
-struct Patient* load_records_from_file_internal(FILE* file);
-
-// Add patient by age to the age-based tree
-struct AgeNode* add_patient_by_age(struct AgeNode* root, struct Patient* new_patient) {
-    if (root == NULL) {
-        root = create_age_node(new_patient->age);
-        root->patients = new_patient;
-        return root;
-    }
-
-    if (new_patient->age < root->age) {
-        root->left = add_patient_by_age(root->left, new_patient);
-    } else if (new_patient->age > root->age) {
-        root->right = add_patient_by_age(root->right, new_patient);
+#ifdef _WIN32
+    free(sealed);
+    journal_checkpoint();
+#else
+    char* active = journal_path(journal.database, ".journal");
+    close(journal.fd);
+    rename(active, sealed);
+    journal.fd = open(active, O_RDWR | O_CREAT | O_APPEND, 0644);
+    journal.size = 0;
+    free(active);
+
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        int ok = save_snapshot(journal.index, journal.ages, journal.database) && remove(sealed) == 0;
+        _exit(ok ? 0 : 1);
+    }
+    if (child < 0) {
+        journal_checkpoint();
     } else {
-        // Patients with the same age are stored in a linked list
-        new_patient->right = root->patients;
-        root->patients = new_patient;
+        journal.compactor = (long)child;
     }
+    free(sealed);
+#endif
+}
 
-    return root;
+uint32_t journal_get_u32(const char* data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
 }
 
-// Function to print patient details
-void print_patient_details(struct Patient* patient) {
-    printf("Name: %s\n", patient->name);
-    printf("Age: %d\n", patient->age);
-    printf("Gender: %s\n", patient->gender);
-    printf("Medical History: %s\n", patient->medical_history);
-    printf("Diagnosis: %s\n", patient->diagnosis);
-    printf("Prescription: %s\n", patient->prescription);
-    printf("-----------------------------\n");
+// Read one length-prefixed string from a record payload, NUL-terminating it in a
+// scratch buffer. Returns 0 if it would run past the end of the payload.
+int journal_get_string(const char** cursor, const char* end, char** buffer, size_t* capacity) {
+    if (end - *cursor < 4) {
+        return 0;
+    }
+    uint32_t length = journal_get_u32(*cursor);
+    *cursor += 4;
+    if ((size_t)(end - *cursor) < length) {
+        return 0;
+    }
+    if (length + 1 > *capacity) {
+        *capacity = length + 1;
+        *buffer = (char*)realloc(*buffer, *capacity);
+    }
+    memcpy(*buffer, *cursor, length);
+    (*buffer)[length] = '\0';
+    *cursor += length;
+    return 1;
 }
 
-// Search for patients by age range in the age-based tree
-void search_patients_by_age_range(struct AgeNode* root, int min_age, int max_age) {
-    if (root == NULL) {
-        return;
+// Apply one journal record's payload: an add, or an update or delete of a patient
+// by ID. `fields` and `capacities` are scratch buffers for five strings. Returns 0
+// if the record does not fit the dataset: its ID is taken, or names a different
+// patient or none.
+int journal_apply(uint8_t op, const char* cursor, const char* end, char** fields, size_t* capacities, struct NameIndex* index, struct AgeIndex* ages) {
+    if (op == JOURNAL_ADD || op == JOURNAL_ADD_UNNUMBERED) {
+        uint32_t id = NO_HANDLE;
+        uint16_t age;
+        int ok = end - cursor >= (op == JOURNAL_ADD ? 6 : 2);
+        if (ok && op == JOURNAL_ADD) {
+            id = journal_get_u32(cursor);
+            cursor += 4;
+        }
+        if (ok) {
+            memcpy(&age, cursor, sizeof(age));
+            cursor += sizeof(age);
+        }
+        for (int i = 0; i < 5 && ok; i++) {
+            ok = journal_get_string(&cursor, end, &fields[i], &capacities[i]);
+        }
+        if (!ok) {
+            return 0;
+        }
+        struct Patient* patient;
+        if (op == JOURNAL_ADD_UNNUMBERED) {
+            patient = create_patient(fields[0], age, fields[1], fields[2], fields[3], fields[4]);
+        } else if (id < NO_HANDLE && pool_claim(&patient_pool, id)) {
+            patient = fill_patient(id, fields[0], age, fields[1], fields[2], fields[3], fields[4]);
+        } else {
+            return 0;
+        }
+        add_patient(index, patient);
+        add_patient_by_age(ages, patient);
+    } else if (op == JOURNAL_UPDATE || op == JOURNAL_DELETE) {
+        // The name is checked as well as the ID, so a record never lands on a
+        // different patient
+        int ok = end - cursor >= 4;
+        uint32_t id = ok ? journal_get_u32(cursor) : NO_HANDLE;
+        cursor += ok ? 4 : 0;
+        for (int i = 0; i < (op == JOURNAL_UPDATE ? 4 : 1) && ok; i++) {
+            ok = journal_get_string(&cursor, end, &fields[i], &capacities[i]);
+        }
+        struct Patient* patient = ok ? patient_by_id(index, id) : NULL;
+        if (patient == NULL || strcmp(patient_name(patient), fields[0]) != 0) {
+            return 0;
+        }
+        if (op == JOURNAL_UPDATE) {
+            update_patient_notes(patient, fields[1], fields[2], fields[3]);
+        } else {
+            delete_patient_record(index, ages, patient);
+        }
     }
+    return 1;
+}
 
-    // Recursively search in the left subtree if needed
-    if (root->age > min_age) {
-        search_patients_by_age_range(root->left, min_age, max_age);
+// Apply every intact record of a journal file whose sequence number is newer than
+// the dataset. Returns the length of the intact prefix; a torn tail is ignored. A
+// record that does not fit the dataset stops replay and sets `*mismatch`.
+uint64_t journal_replay(const char* path, struct NameIndex* index, struct AgeIndex* ages, int* mismatch) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return 0;
     }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* data = (char*)malloc(size > 0 ? (size_t)size : 1);
+    size_t length = fread(data, 1, (size_t)size, file);
+    fclose(file);
+
+    char* fields[5] = {NULL, NULL, NULL, NULL, NULL};
+    size_t capacities[5] = {0, 0, 0, 0, 0};
+    size_t offset = 0;
+    int applied = 0;
+    int fits = 1;
+    while (fits && length - offset >= JOURNAL_HEADER_BYTES) {
+        uint32_t payload = journal_get_u32(data + offset);
+        if (length - offset - JOURNAL_HEADER_BYTES < payload
+            || journal_get_u32(data + offset + 4) != journal_checksum(data + offset + 8, JOURNAL_HEADER_BYTES - 8 + payload)) {
+            break;
+        }
+        uint64_t sequence;
+        memcpy(&sequence, data + offset + 8, sizeof(sequence));
+        uint8_t op = (uint8_t)data[offset + 16];
+        const char* cursor = data + offset + JOURNAL_HEADER_BYTES;
+        const char* end = cursor + payload;
+        offset += JOURNAL_HEADER_BYTES + payload;
+        if (sequence <= journal.sequence) {
+            continue;  // Already part of the snapshot
+        }
+        journal.sequence = sequence;
+        applied++;
+        heap_release();
 
-    // Print patient details for each patient within the specified range
-    struct Patient* current_patient = root->patients;
-    while (current_patient != NULL) {
-        if (current_patient->age >= min_age && current_patient->age <= max_age) {
-            print_patient_details(current_patient);
+        if (op != JOURNAL_BATCH) {
+            fits = journal_apply(op, cursor, end, fields, capacities, index, ages);
+        }
+        while (op == JOURNAL_BATCH && fits && end - cursor >= JOURNAL_ENTRY_BYTES) {
+            uint32_t entry = journal_get_u32(cursor);
+            uint8_t entry_op = (uint8_t)cursor[4];
+            cursor += JOURNAL_ENTRY_BYTES;
+            if ((size_t)(end - cursor) < entry) {
+                break;
+            }
+            fits = journal_apply(entry_op, cursor, cursor + entry, fields, capacities, index, ages);
+            cursor += entry;
+            heap_release();
         }
-        current_patient = current_patient->right;
     }
 
-    // Recursively search in the right subtree if needed
-    if (root->age < max_age) {
-        search_patients_by_age_range(root->right, min_age, max_age);
+    for (int i = 0; i < 5; i++) {
+        free(fields[i]);
     }
+    free(data);
+    if (!fits) {
+        printf("Error: journal record %llu in %s does not match the database.\n", (unsigned long long)journal.sequence, path);
+        *mismatch = 1;
+    } else if (applied > 0) {
+        printf("Replayed %d journal records from %s.\n", applied, path);
+    }
+    return offset;
 }
 
-// Create a new AgeNode
-struct AgeNode* create_age_node(int age) {
-    struct AgeNode* new_age_node = (struct AgeNode*)malloc(sizeof(struct AgeNode));
-    new_age_node->age = age;
-    new_age_node->patients = NULL;
-    new_age_node->left = NULL;
-    new_age_node->right = NULL;
-    return new_age_node;
+// Open a database: map its snapshot, replay the journal tail on top, then keep
+// journaling every change. A sealed segment left by an interrupted compaction is
+// replayed first and folded in right away.
+int journal_open_database(const char* database, struct NameIndex* index, struct AgeIndex* ages) {
+    struct stat info;
+    if (stat(database, &info) == 0 && load_snapshot(index, ages, database) < 0) {
+        return 0;
+    }
+
+    char* sealed = journal_path(database, ".journal.old");
+    char* active = journal_path(database, ".journal");
+    int had_sealed = stat(sealed, &info) == 0;
+    int mismatch = 0;
+    if (had_sealed) {
+        journal_replay(sealed, index, ages, &mismatch);
+    }
+    uint64_t intact = mismatch ? 0 : journal_replay(active, index, ages, &mismatch);
+    if (mismatch) {
+        // Leave the journal as it is rather than truncate or checkpoint over it
+        free(sealed);
+        free(active);
+        return 0;
+    }
+
+    journal.database = (char*)malloc(strlen(database) + 1);
+    strcpy(journal.database, database);
+    journal.index = index;
+    journal.ages = ages;
+    journal.fd = open(active, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (journal.fd < 0) {
+        printf("Error opening journal %s.\n", active);
+        free(journal.database);
+        journal.database = NULL;
+        free(sealed);
+        free(active);
+        return 0;
+    }
+    ftruncate(journal.fd, (off_t)intact);  // Drop a torn tail so new records follow intact ones
+    journal.size = intact;
+    free(sealed);
+    free(active);
+
+    if (had_sealed) {
+        journal_checkpoint();
+    }
+    printf("Opened database %s with %zu patients.\n", database, index->count);
+    return 1;
 }
 
-// Function to create a new patient node
-struct Patient* create_patient(const char* name, int age, const char* gender, const char* medical_history, const char* diagnosis, const char* prescription) {
-    struct Patient* new_patient = (struct Patient*)malloc(sizeof(struct Patient));
-    strcpy(new_patient->name, name);
-    new_patient->age = age;
-    strcpy(new_patient->gender, gender);
-    strcpy(new_patient->medical_history, medical_history);
-    strcpy(new_patient->diagnosis, diagnosis);
-    strcpy(new_patient->prescription, prescription);
-    new_patient->left = NULL;
-    new_patient->right = NULL;
-    return new_patient;
+// Commit anything pending and stop journaling
+void journal_close() {
+    if (journal.database == NULL) {
+        return;
+    }
+    journal_commit();
+#ifndef _WIN32
+    if (journal.compactor != 0) {
+        waitpid((pid_t)journal.compactor, NULL, 0);
+        journal.compactor = 0;
+    }
+#endif
+    close(journal.fd);
+    free(journal.database);
+    free(journal.buffer);
+    journal.database = NULL;
+    journal.buffer = NULL;
+    journal.length = journal.capacity = 0;
+}
+
+// Undo the TSV escapes of a batch field in place
+void batch_unescape(char* field) {
+    char* out = field;
+    for (char* c = field; *c != '\0'; c++) {
+        if (*c == '\\' && c[1] != '\0') {
+            c++;
+            *out++ = *c == 't' ? '\t' : *c == 'n' ? '\n' : *c == 'r' ? '\r' : *c;
+        } else {
+            *out++ = *c;
+        }
+    }
+    *out = '\0';
+}
+
+int batch_error(struct Output* out, size_t line_number, const char* reason) {
+    output_string(out, "ERROR line ");
+    output_uint(out, line_number);
+    output_string(out, ": ");
+    output_string(out, reason);
+    output_string(out, "\n");
+    return 0;
 }
 
-// Function to add a new patient to the binary search tree
-struct Patient* add_patient(struct Patient* root, struct Patient* new_patient) {
-    if (root == NULL) {
-        return new_patient;
+// Parse a whole field as a number from 0 to `max`, or return -1
+int batch_number(const char* field, long max) {
+    char* end;
+    long number = strtol(field, &end, 10);
+    return (*field == '\0' || *end != '\0' || number < 0 || number > max) ? -1 : (int)number;
+}
+
+// Parse an age field; returns -1 if it is not a whole number in range
+int batch_age(const char* field) {
+    return batch_number(field, MAX_AGE);
+}
+
+// Parse a whole field as a patient ID. Returns 0 if it is not one.
+int batch_id(const char* field, uint32_t* id) {
+    char* end;
+    unsigned long value = strtoul(field, &end, 10);
+    if (!isdigit((unsigned char)field[0]) || *end != '\0' || value >= NO_HANDLE) {
+        return 0;
     }
+    *id = (uint32_t)value;
+    return 1;
+}
 
-    int cmp = strcmp(new_patient->name, root->name);
-    if (cmp < 0) {
-        root->left = add_patient(root->left, new_patient);
-    } else if (cmp > 0) {
-        root->right = add_patient(root->right, new_patient);
+// Find the one patient a command is about: by ID, or by a name no other patient
+// has. Sets *patient, to NULL when there is none, and returns 1; returns 0 for a
+// malformed ID or a shared name.
+int batch_patient(struct NameIndex* index, int by_id, const char* field, struct Patient** patient) {
+    *patient = NULL;
+    if (by_id) {
+        uint32_t id;
+        if (!batch_id(field, &id)) {
+            return 0;
+        }
+        *patient = patient_by_id(index, id);
+        return 1;
     }
+    uint32_t handle;
+    size_t found = search_patients(index, field, &handle, 1);
+    if (found > 1) {
+        return 0;
+    }
+    *patient = found == 1 ? patient_at(handle) : NULL;
+    return 1;
+}
 
-    return root;
+// Whether a command is a write, which an open batch stages instead of running
+int batch_write_command(const char* command) {
+    return strcmp(command, "ADD") == 0 || strncmp(command, "UPDATE", 6) == 0 || strncmp(command, "DELETE", 6) == 0;
 }
 
-// Function to search for a patient by name in the binary search tree
-struct Patient* search_patient(struct Patient* root, const char* name) {
-    if (root == NULL || strcmp(root->name, name) == 0) {
-        return root;
+// Answer an error for a write that could not be staged, spoiling its batch so
+// that COMMIT discards it instead of committing the rest
+int batch_reject(struct Output* out, size_t line_number, const char* reason, struct WriteBatch* batch) {
+    if (batch->rejected == 0) {
+        batch->rejected = line_number;
     }
+    return batch_error(out, line_number, reason);
+}
 
-    int cmp = strcmp(name, root->name);
-    if (cmp < 0) {
-        return search_patient(root->left, name);
+// Stage a write of an open batch instead of running it. Answers QUEUED; returns 0
+// if it answered with an error.
+int batch_stage(char** fields, int count, size_t line_number, struct Output* out, struct WriteBatch* batch) {
+    const char* command = fields[0];
+    struct WriteOp* op;
+    if (batch->rejected != 0) {
+        return batch_error(out, line_number, "the batch has a write that could not be staged; ABORT it");
+    }
+    if (strcmp(command, "ADD") == 0 && count == 7) {
+        int age = batch_age(fields[2]);
+        if (fields[1][0] == '\0' || age < 0) {
+            return batch_reject(out, line_number, "invalid patient details", batch);
+        }
+        op = write_batch_add(batch, fields[1], age, fields[3], fields[4], fields[5], fields[6]);
+    } else if (((strcmp(command, "UPDATE") == 0 || strcmp(command, "UPDATEID") == 0) && count == 5)
+               || ((strcmp(command, "DELETE") == 0 || strcmp(command, "DELETEID") == 0) && count == 2)) {
+        int by_id = command[6] == 'I';
+        uint32_t id = NO_HANDLE;
+        if (by_id && !batch_id(fields[1], &id)) {
+            return batch_reject(out, line_number, "invalid patient ID", batch);
+        }
+        const char* name = by_id ? NULL : fields[1];
+        op = command[0] == 'U' ? write_batch_update(batch, name, id, fields[2], fields[3], fields[4]) : write_batch_delete(batch, name, id);
     } else {
-        return search_patient(root->right, name);
+        return batch_reject(out, line_number, "unknown command or wrong number of fields", batch);
     }
+    op->line = line_number;
+    output_string(out, "QUEUED\n");
+    return 1;
 }
 
-// Function to find the minimum node (leftmost) in the binary search tree
-struct Patient* find_min(struct Patient* root) {
-    if (root == NULL) {
-        return NULL;
+// Run one command line, answering into `out`. Writes are staged in `batch` while
+// it is open. Returns 0 if it answered with an error.
+int batch_command(char* line, size_t line_number, struct Output* out, struct NameIndex* index, struct AgeIndex* ages, struct WriteBatch* batch) {
+    char* fields[BATCH_MAX_FIELDS];
+    int count = 1;
+    fields[0] = line;
+    for (char* tab = strchr(line, '\t'); tab != NULL && count < BATCH_MAX_FIELDS; tab = strchr(tab, '\t')) {
+        *tab++ = '\0';
+        fields[count++] = tab;
+    }
+    for (int i = 1; i < count; i++) {
+        batch_unescape(fields[i]);
+        if (strlen(fields[i]) > HEAP_MAX_STRING) {
+            if (batch->open && batch_write_command(fields[0])) {
+                return batch_reject(out, line_number, "field too long", batch);
+            }
+            return batch_error(out, line_number, "field too long");
+        }
     }
+    const char* command = fields[0];
+    int control = strcmp(command, "BEGIN") == 0 || strcmp(command, "COMMIT") == 0 || strcmp(command, "ABORT") == 0;
 
-    while (root->left != NULL) {
-        root = root->left;
+    // A shard directory still loading reads what the command needs first: the
+    // shard of the name for commands by name, every shard for the rest. A batch
+    // needs nothing more at COMMIT; its writes loaded their shards when staged.
+    if (shards.directory != NULL && strcmp(command, "LOAD") != 0 && !control) {
+        int by_name = count >= 2 && (strcmp(command, "ADD") == 0 || strcmp(command, "GET") == 0
+                                     || strcmp(command, "UPDATE") == 0 || strcmp(command, "DELETE") == 0);
+        output_flush(out);  // Loading reports through printf
+        shards_need(by_name ? fields[1] : NULL);
+        fflush(stdout);
     }
-    return root;
-}
 
-// Function to delete a patient's record from the binary search tree
-struct Patient* delete_patient_record(struct Patient* root, const char* name) {
-    if (root == NULL) {
-        return root;
+    if (batch->open && batch_write_command(command)) {
+        return batch_stage(fields, count, line_number, out, batch);
     }
 
-    int cmp = strcmp(name, root->name);
-    if (cmp < 0) {
-        root->left = delete_patient_record(root->left, name);
-    } else if (cmp > 0) {
-        root->right = delete_patient_record(root->right, name);
-    } else {
-        if (root->left == NULL) {
-            struct Patient* temp = root->right;
-            free(root);
-            return temp;
-        } else if (root->right == NULL) {
-            struct Patient* temp = root->left;
-            free(root);
-            return temp;
+    if (strcmp(command, "ADD") == 0 && count == 7) {
+        int age = batch_age(fields[2]);
+        if (fields[1][0] == '\0' || age < 0) {
+            return batch_error(out, line_number, "invalid patient details");
+        }
+        struct Patient* patient = create_patient(fields[1], age, fields[3], fields[4], fields[5], fields[6]);
+        add_patient(index, patient);
+        add_patient_by_age(ages, patient);
+        journal_log_add(patient);
+        output_string(out, "OK ");
+        output_uint(out, patient->handle);
+        output_string(out, "\n");
+    } else if (strcmp(command, "GET") == 0 && count == 2) {
+        // Every patient with the name, lowest ID first
+        uint32_t buffer[BATCH_NAME_MATCHES];
+        uint32_t* handles = buffer;
+        size_t capacity = BATCH_NAME_MATCHES;
+        size_t found = search_patients(index, fields[1], handles, capacity);
+        while (found > capacity) {
+            capacity = found * 2;
+            handles = (uint32_t*)(handles == buffer ? malloc(capacity * sizeof(uint32_t)) : realloc(handles, capacity * sizeof(uint32_t)));
+            found = search_patients(index, fields[1], handles, capacity);
+        }
+        for (size_t i = 0; i < found; i++) {
+            output_patient(out, patient_at(handles[i]));
+        }
+        if (handles != buffer) {
+            free(handles);
+        }
+        output_string(out, found > 0 ? "OK\n" : "NOT FOUND\n");
+    } else if (strcmp(command, "GETID") == 0 && count == 2) {
+        struct Patient* patient;
+        if (!batch_patient(index, 1, fields[1], &patient)) {
+            return batch_error(out, line_number, "invalid patient ID");
+        }
+        if (patient == NULL) {
+            output_string(out, "NOT FOUND\n");
+            return 1;
+        }
+        output_patient(out, patient);
+        output_string(out, "OK\n");
+    } else if ((strcmp(command, "UPDATE") == 0 || strcmp(command, "UPDATEID") == 0) && count == 5) {
+        struct Patient* patient;
+        int by_id = command[6] == 'I';
+        if (!batch_patient(index, by_id, fields[1], &patient)) {
+            return batch_error(out, line_number, by_id ? "invalid patient ID" : "several patients have this name; use UPDATEID");
+        }
+        if (patient == NULL) {
+            output_string(out, "NOT FOUND\n");
+            return 1;
+        }
+        update_patient_notes(patient, fields[2], fields[3], fields[4]);
+        journal_log_update(patient);
+        output_string(out, "OK\n");
+    } else if ((strcmp(command, "DELETE") == 0 || strcmp(command, "DELETEID") == 0) && count == 2) {
+        struct Patient* patient;
+        int by_id = command[6] == 'I';
+        if (!batch_patient(index, by_id, fields[1], &patient)) {
+            return batch_error(out, line_number, by_id ? "invalid patient ID" : "several patients have this name; use DELETEID");
+        }
+        if (patient == NULL) {
+            output_string(out, "NOT FOUND\n");
+            return 1;
+        }
+        journal_log_delete(patient);
+        delete_patient_record(index, ages, patient);
+        output_string(out, "OK\n");
+    } else if (strcmp(command, "RANGE") == 0 && count == 3) {
+        int min_age = batch_age(fields[1]);
+        int max_age = batch_age(fields[2]);
+        if (min_age < 0 || max_age < 0) {
+            return batch_error(out, line_number, "invalid age");
+        }
+        size_t before = out->records;
+        output_age_range(out, ages, min_age, max_age);
+        size_t found = out->records - before;
+        output_string(out, "OK ");
+        output_uint(out, found);
+        output_string(out, "\n");
+    } else if (strcmp(command, "FIND") == 0 && count == 2) {
+        uint32_t* handles;
+        long found = text_search(index, ages, fields[1], &handles);
+        if (found < 0) {
+            return batch_error(out, line_number, "invalid query");
+        }
+        for (long i = 0; i < found; i++) {
+            output_patient(out, patient_at(handles[i]));
+        }
+        free(handles);
+        output_string(out, "OK ");
+        output_uint(out, (unsigned long long)found);
+        output_string(out, "\n");
+    } else if ((strcmp(command, "PREFIX") == 0 || strcmp(command, "FUZZY") == 0) && count >= 2 && count <= 4) {
+        // Optional fields: the edits allowed (0 for PREFIX, 2 for FUZZY) and the number of results
+        int prefix = command[0] == 'P';
+        int edits = count > 2 ? batch_number(fields[2], NAME_SEARCH_MAX_EDITS) : (prefix ? 0 : 2);
+        int limit = count > 3 ? batch_number(fields[3], NAME_SEARCH_MAX_RESULTS) : NAME_SEARCH_DEFAULT_RESULTS;
+        struct NameMatch matches[NAME_SEARCH_MAX_RESULTS];
+        long found = edits < 0 || limit < 0 ? -1 : name_search(index, fields[1], edits, prefix, (size_t)limit, matches);
+        if (found < 0) {
+            return batch_error(out, line_number, "invalid name search");
+        }
+        for (long i = 0; i < found; i++) {
+            output_patient(out, patient_at(matches[i].handle));
+        }
+        output_string(out, "OK ");
+        output_uint(out, (unsigned long long)found);
+        output_string(out, "\n");
+    } else if (strcmp(command, "WHERE") == 0 && count == 3) {
+        uint32_t* handles;
+        long found = filter_patients(index, fields[1], fields[2], &handles);
+        if (found < 0) {
+            return batch_error(out, line_number, "unknown field");
+        }
+        for (long i = 0; i < found; i++) {
+            output_patient(out, patient_at(handles[i]));
+        }
+        free(handles);
+        output_string(out, "OK ");
+        output_uint(out, (unsigned long long)found);
+        output_string(out, "\n");
+    } else if ((strcmp(command, "QUERY") == 0 || strcmp(command, "EXPLAIN") == 0) && count >= 2) {
+        // Conditions follow in their own fields: QUERY<TAB>gender=F<TAB>age=30-45
+        struct Query query;
+        if (query_parse(index, &query, fields + 1, count - 1) < 0) {
+            return batch_error(out, line_number, "invalid condition");
+        }
+        query_plan(index, ages, &query);
+        if (command[0] == 'E') {
+            query_explain(out, &query);
+            output_string(out, "OK\n");
+            return 1;
+        }
+        uint32_t* handles;
+        long found = query_run(index, ages, &query, &handles);
+        output_patients(out, handles, (size_t)found);
+        free(handles);
+        output_string(out, "OK ");
+        output_uint(out, (unsigned long long)found);
+        output_string(out, "\n");
+    } else if (strcmp(command, "INDEX") == 0 && count == 2) {
+        if (secondary_declare(index, fields[1]) < 0) {
+            return batch_error(out, line_number, "invalid index fields or too many indexes");
+        }
+        output_string(out, "OK\n");
+    } else if (strcmp(command, "GROUP") == 0) {
+        // Keys, if any, follow in their own fields: GROUP<TAB>gender<TAB>age/10
+        struct GroupBy query;
+        long found = group_by(index, &query, fields + 1, count - 1);
+        if (found < 0) {
+            return batch_error(out, line_number, "invalid group keys");
+        }
+        group_output(out, &query);
+        group_free(&query);
+        output_string(out, "OK ");
+        output_uint(out, (unsigned long long)found);
+        output_string(out, "\n");
+    } else if (strcmp(command, "BEGIN") == 0 && count == 1) {
+        if (batch->open) {
+            return batch_error(out, line_number, "a batch is already open");
+        }
+        batch->open = 1;
+        output_string(out, "OK\n");
+    } else if ((strcmp(command, "COMMIT") == 0 || strcmp(command, "ABORT") == 0) && count == 1) {
+        if (!batch->open) {
+            return batch_error(out, line_number, "no batch is open");
         }
+        if (command[0] == 'A') {
+            write_batch_clear(batch);
+            output_string(out, "OK\n");
+            return 1;
+        }
+        if (batch->rejected != 0) {
+            size_t rejected = batch->rejected;
+            write_batch_clear(batch);
+            return batch_error(out, rejected, "batch discarded; this write could not be staged");
+        }
+        // The new patients' rows come first, in the order they were staged
+        if (!write_batch_commit(batch, index, ages)) {
+            size_t failed = batch->ops[batch->failed].line;
+            const char* error = batch->error;
+            write_batch_clear(batch);
+            return batch_error(out, failed, error);
+        }
+        for (size_t i = 0; i < batch->count; i++) {
+            if (batch->ops[i].kind == WRITE_ADD && batch->ops[i].id != NO_HANDLE) {
+                output_patient(out, patient_at(batch->ops[i].id));
+            }
+        }
+        output_string(out, "OK ");
+        output_uint(out, batch->count);
+        output_string(out, "\n");
+        write_batch_clear(batch);
+    } else if (strcmp(command, "STATS") == 0 && count == 1) {
+        metrics_report(out, index, ages);
+        output_string(out, "OK\n");
+    } else if ((strcmp(command, "SAVE") == 0 || strcmp(command, "LOAD") == 0) && count == 2) {
+        // These report through printf, so keep the responses in order around them
+        output_flush(out);
+        int loaded = 0;
+        if (command[0] == 'L') {
+            loaded = replace_records_from_file(index, ages, fields[1]);
+        } else if (journal.database != NULL && strcmp(fields[1], journal.database) == 0) {
+            journal_checkpoint();
+        } else {
+            save_records_to_file(index, ages, fields[1]);
+        }
+        fflush(stdout);
+        if (loaded < 0) {
+            return batch_error(out, line_number, "could not load file");
+        }
+        output_string(out, "OK");
+        if (command[0] == 'L') {
+            output_string(out, " ");
+            output_uint(out, (unsigned long long)loaded);
+        }
+        output_string(out, "\n");
+    } else if (strcmp(command, "BGSAVE") == 0 && count == 2) {
+        // Answers at once; the outcome is reported on stdout when the save finishes
+        output_flush(out);
+        if (journal.database != NULL && strcmp(fields[1], journal.database) == 0) {
+            journal_commit();
+            journal_compact();
+        } else {
+            save_records_in_background(index, ages, fields[1]);
+        }
+        fflush(stdout);
+        output_string(out, "OK\n");
+    } else {
+        return batch_error(out, line_number, "unknown command or wrong number of fields");
+    }
+    return 1;
+}
 
-        struct Patient* temp = find_min(root->right);
-        strcpy(root->name, temp->name);
-        root->right = delete_patient_record(root->right, temp->name);
+// Run one command of a session. Server connections run reads inside an epoch read
+// section and writes under the writer mutex; a batch run has the dataset to itself.
+void batch_dispatch(struct BatchSession* session, char* line) {
+    if (session->reader < 0) {
+        session->failures += !batch_command(line, session->line_number, &session->out, session->index, session->ages, &session->batch);
+        heap_release();
+        return;
+    }
+#ifndef _WIN32
+    // A read of a paged heap can evict pages and one of cold text fills the block
+    // cache, so then reads take the writer lock too
+    if (heap_pool.fd < 0 && !cold_store.enabled && (strncmp(line, "GET\t", 4) == 0 || strncmp(line, "RANGE\t", 6) == 0)) {
+        epoch_enter(session->reader);
+        session->failures += !batch_command(line, session->line_number, &session->out, session->index, session->ages, &session->batch);
+        epoch_leave(session->reader);
+    } else if (strncmp(line, "LOAD\t", 5) == 0) {
+        session->failures += !batch_error(&session->out, session->line_number, "LOAD is not available while serving");
+    } else {
+        pthread_mutex_lock(&server.writer);
+        session->failures += !batch_command(line, session->line_number, &session->out, session->index, session->ages, &session->batch);
+        heap_release();
+        epoch_reclaim();
+        background_save_finish(0);
+        pthread_mutex_unlock(&server.writer);
+        session->wrote = 1;
     }
+#endif
+}
 
-    return root;
+// Run every complete line of a block of commands. Returns the bytes used; a
+// partial line after them is left for the next block.
+size_t batch_run_lines(struct BatchSession* session, char* buffer, size_t length) {
+    char* line = buffer;
+    char* end = buffer + length;
+    char* newline;
+    while ((newline = (char*)memchr(line, '\n', (size_t)(end - line))) != NULL) {
+        char* stop = newline;
+        while (stop > line && stop[-1] == '\r') {
+            stop--;
+        }
+        *stop = '\0';
+        session->line_number++;
+        if (line[0] != '\0' && line[0] != '#') {
+            batch_dispatch(session, line);
+        }
+        line = newline + 1;
+    }
+    return (size_t)(line - buffer);
 }
 
-// Function to display all patient records (in-order traversal of the binary search tree)
-void display_patient(struct Patient* patient) 
-{
-    if (patient != NULL) 
-    {
-        printf("Name: %s\n", patient->name);
-        printf("Age: %d\n", patient->age);
-        printf("Gender: %s\n", patient->gender);
-        printf("Medical History: %s\n", patient->medical_history);
-        printf("Diagnosis: %s\n", patient->diagnosis);
-        printf("Prescription: %s\n", patient->prescription);
-        printf("-----------------------------\n");
-        
-        display_patient(patient->left); // Display patients in the left subtree
-        display_patient(patient->right); // Display patients in the right subtree
+// Read blocks of commands from a file descriptor or stream until it ends, running
+// each block and committing the journal after it
+void batch_run_input(struct BatchSession* session, int fd, FILE* in) {
+    size_t capacity = BATCH_BUFFER_SIZE;
+    char* buffer = (char*)malloc(capacity + 1);
+    size_t length = 0;
+    int done = 0;
+    while (!done) {
+        if (length == capacity) {
+            capacity *= 2;  // A single line longer than the buffer
+            buffer = (char*)realloc(buffer, capacity + 1);
+        }
+        long got = in != NULL ? (long)fread(buffer + length, 1, capacity - length, in)
+                              : (long)read(fd, buffer + length, (unsigned)(capacity - length));
+        done = got <= 0;
+        length += done ? 0 : (size_t)got;
+        if (done && length > 0 && buffer[length - 1] != '\n') {
+            buffer[length++] = '\n';  // Last line without a newline; capacity + 1 leaves room
+        }
+
+        size_t used = batch_run_lines(session, buffer, length);
+        length -= used;
+        memmove(buffer, buffer + used, length);
+        if (session->reader < 0) {
+            journal_commit();
+            background_save_finish(0);
+        }
+#ifndef _WIN32
+        else if (session->wrote) {
+            pthread_mutex_lock(&server.writer);
+            journal_commit();
+            pthread_mutex_unlock(&server.writer);
+            session->wrote = 0;
+        }
+#endif
+        output_flush(&session->out);
     }
+    free(buffer);
 }
 
-void display_all_records(struct Patient* root) {
-    if (root != NULL) {
-        printf("Patient Records:\n");
-        display_patient(root);
-    } else {
-        printf("No patient records found.\n");
+void batch_session_open(struct BatchSession* session, int fd, struct NameIndex* index, struct AgeIndex* ages, int reader) {
+    output_open(&session->out, fd, OUTPUT_TSV);
+    session->out.length = 0;  // Responses carry no header row
+    session->index = index;
+    session->ages = ages;
+    session->line_number = 0;
+    session->failures = 0;
+    session->reader = reader;
+    session->wrote = 0;
+    memset(&session->batch, 0, sizeof(session->batch));
+}
+
+// Run commands from a stream until it ends. Returns the number of commands that
+// failed.
+int run_batch(FILE* in, struct NameIndex* index, struct AgeIndex* ages) {
+    struct BatchSession session;
+    batch_session_open(&session, 1, index, ages, -1);
+    batch_run_input(&session, -1, in);
+    output_close(&session.out);
+    write_batch_free(&session.batch);  // A batch still open when the input ends is dropped
+    return session.failures;
+}
+
+#ifndef _WIN32
+void server_stop(int signal_number) {
+    (void)signal_number;
+    server_stopping = 1;
+}
+
+// Worker thread: serve one connection after another from the accept queue
+void* server_worker(void* argument) {
+    int reader = (int)(intptr_t)argument;
+    while (1) {
+        pthread_mutex_lock(&server.queue_lock);
+        while (server.queue_count == 0) {
+            pthread_cond_wait(&server.queue_ready, &server.queue_lock);
+        }
+        int fd = server.queue[server.queue_head];
+        server.queue_head = (server.queue_head + 1) % SERVER_QUEUE;
+        server.queue_count--;
+        pthread_mutex_unlock(&server.queue_lock);
+
+        struct BatchSession session;
+        batch_session_open(&session, fd, server.index, server.ages, reader);
+        batch_run_input(&session, fd, NULL);
+        output_close(&session.out);
+        write_batch_free(&session.batch);
+        close(fd);
     }
+    return NULL;
 }
 
+// Serve the dataset on a Unix domain socket until SIGINT or SIGTERM. Returns with
+// the writer mutex held, so no write is in progress or can start.
+int run_server(const char* path, struct NameIndex* index, struct AgeIndex* ages) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        printf("Socket path %s is too long.\n", path);
+        return 0;
+    }
+    strcpy(address.sun_path, path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, SERVER_QUEUE) != 0) {
+        printf("Error listening on %s.\n", path);
+        if (listener >= 0) {
+            close(listener);
+        }
+        return 0;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, server_stop);
+    signal(SIGTERM, server_stop);
+    server.index = index;
+    server.ages = ages;
+    epochs.active = 1;
+
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < SERVER_MIN_THREADS) {
+        threads = SERVER_MIN_THREADS;
+    }
+    if (threads > EPOCH_MAX_READERS) {
+        threads = EPOCH_MAX_READERS;
+    }
+    for (long i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, server_worker, (void*)(intptr_t)i) == 0) {
+            pthread_detach(thread);
+        }
+    }
+    printf("Serving %zu patients on %s with %ld threads.\n", index->count, path, threads);
+    fflush(stdout);
 
-void save_patient_records(struct Patient *patient, FILE *file) {
-    if (patient != NULL) {
-        fprintf(file, "%s %d %s %s %s %s\n", patient->name, patient->age, patient->gender,
-                patient->medical_history, patient->diagnosis, patient->prescription);
-        save_patient_records(patient->left, file);
-        save_patient_records(patient->right, file);
+    while (!server_stopping) {
+        struct pollfd ready = {listener, POLLIN, 0};
+        if (poll(&ready, 1, 250) <= 0) {
+            continue;
+        }
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        pthread_mutex_lock(&server.queue_lock);
+        if (server.queue_count == SERVER_QUEUE) {
+            pthread_mutex_unlock(&server.queue_lock);
+            const char* busy = "ERROR server busy\n";
+            write(fd, busy, strlen(busy));
+            close(fd);
+            continue;
+        }
+        server.queue[(server.queue_head + server.queue_count) % SERVER_QUEUE] = fd;
+        server.queue_count++;
+        pthread_cond_signal(&server.queue_ready);
+        pthread_mutex_unlock(&server.queue_lock);
     }
+
+    close(listener);
+    unlink(path);
+    pthread_mutex_lock(&server.writer);
+    printf("Server stopped.\n");
+    return 1;
 }
+#else
+int run_server(const char* path, struct NameIndex* index, struct AgeIndex* ages) {
+    (void)path;
+    (void)index;
+    (void)ages;
+    printf("Server mode is not available on this platform.\n");
+    return 0;
+}
+#endif
 
-void save_records_to_file(struct Patient *root, const char *filename) {
-    FILE *file = fopen(filename, "w");
-    if (file == NULL) {
-        printf("Error opening file for writing.\n");
-        return;
+// splitmix64: small, fast and the same sequence on every platform
+uint64_t bench_random(uint64_t* state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Uniform in [0, 1)
+double bench_uniform(uint64_t* state) {
+    return (double)(bench_random(state) >> 11) / 9007199254740992.0;
+}
+
+// Pick from a table with a skew toward its first entries, the way a few surnames
+// and diagnoses account for most records
+int bench_skewed(uint64_t* state, int count) {
+    double u = bench_uniform(state);
+    return (int)(u * u * u * count);
+}
+
+long bench_peak_rss_kb() {
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+#endif
+}
+
+int bench_compare_u64(const void* a, const void* b) {
+    uint64_t left = *(const uint64_t*)a;
+    uint64_t right = *(const uint64_t*)b;
+    return left < right ? -1 : left > right;
+}
+
+int bench_compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Print one result. With per-operation latencies the percentiles come from them
+// (they are sorted in place); a single timed operation reports null percentiles.
+void bench_report(const char* op, const char* order, size_t records, size_t ops, uint64_t total_ns, uint64_t* latencies) {
+    printf("{\"op\":\"%s\",\"order\":\"%s\",\"records\":%zu,\"ops\":%zu,\"seconds\":%.6f,\"ops_per_second\":%.1f,",
+           op, order, records, ops, total_ns / 1e9, total_ns > 0 ? ops * 1e9 / total_ns : 0.0);
+    if (latencies != NULL && ops > 0) {
+        qsort(latencies, ops, sizeof(uint64_t), bench_compare_u64);
+        printf("\"p50_ns\":%llu,\"p99_ns\":%llu,", (unsigned long long)latencies[ops / 2], (unsigned long long)latencies[ops * 99 / 100]);
+    } else {
+        printf("\"p50_ns\":null,\"p99_ns\":null,");
     }
+    printf("\"peak_rss_kb\":%ld}\n", bench_peak_rss_kb());
+    fflush(stdout);
+}
 
-    save_patient_records(root, file);
+// Where loads and saves report success: stdout, except during the benchmark
+FILE* status_output() {
+    return bench_running ? stderr : stdout;
+}
 
-    fclose(file);
-    printf("Patient records saved to %s successfully.\n", filename);
+// Check that a load brought every record back
+int bench_check_load(struct NameIndex* index, size_t records, const char* filename) {
+    if (index->count == records) {
+        return 1;
+    }
+    printf("Loaded %zu of %zu records from %s.\n", index->count, records, filename);
+    return 0;
 }
 
+// Time every operation on `records` synthetic patients: inserts in sorted and in
+// random order and as one write batch, then lookups, age ranges, text, compressed
+// text, snapshot and shard save and load, and deletes, all on the random-order
+// dataset. Returns 0 if a load lost records.
+int bench_run(size_t records, struct NameIndex* index, struct AgeIndex* ages) {
+    static const char* surnames[] = {"Smith", "Johnson", "Williams", "Brown", "Jones", "Garcia", "Miller", "Davis",
+        "Rodriguez", "Martinez", "Hernandez", "Lopez", "Gonzalez", "Wilson", "Anderson", "Thomas", "Taylor", "Moore",
+        "Jackson", "Martin", "Lee", "Perez", "Thompson", "White", "Harris", "Sanchez", "Clark", "Ramirez", "Lewis",
+        "Robinson", "Walker", "Young"};
+    static const char* given[] = {"James", "Mary", "Robert", "Patricia", "John", "Jennifer", "Michael", "Linda",
+        "David", "Elizabeth", "William", "Barbara", "Richard", "Susan", "Joseph", "Jessica"};
+    static const char* diagnoses[] = {"Hypertension", "Diabetes", "Asthma", "Influenza", "Bronchitis", "Migraine",
+        "Arthritis", "Anemia", "Pneumonia", "Gastritis", "Dermatitis", "Sinusitis"};
+    static const char* prescriptions[] = {"Lisinopril", "Metformin", "Albuterol", "Oseltamivir", "Amoxicillin",
+        "Sumatriptan", "Ibuprofen", "Ferrous sulfate", "Azithromycin", "Omeprazole", "Hydrocortisone", "Fluticasone"};
+    static const char* histories[] = {"None", "Smoker", "Allergies", "Family history of heart disease", "Surgery in 2019"};
+    int surname_count = (int)(sizeof(surnames) / sizeof(surnames[0]));
+    int given_count = (int)(sizeof(given) / sizeof(given[0]));
+    int diagnosis_count = (int)(sizeof(diagnoses) / sizeof(diagnoses[0]));
+    int history_count = (int)(sizeof(histories) / sizeof(histories[0]));
 
-struct Patient *load_records_from_file(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        printf("Error opening file for reading.\n");
-        return NULL;
+    // Generate the patients once; names are a skewed surname and given name with a
+    // random serial, so many share a prefix the way real names do
+    uint64_t state = records;
+    char** names = (char**)malloc(records * sizeof(char*));
+    char* name_text = (char*)malloc(records * 40);
+    int* patient_ages = (int*)malloc(records * sizeof(int));
+    int* patient_diagnoses = (int*)malloc(records * sizeof(int));
+    int* patient_histories = (int*)malloc(records * sizeof(int));
+    for (size_t i = 0; i < records; i++) {
+        names[i] = name_text + i * 40;
+        snprintf(names[i], 40, "%s_%s_%08u", surnames[bench_skewed(&state, surname_count)],
+                 given[bench_skewed(&state, given_count)], (unsigned)(bench_random(&state) % 100000000));
+        // Mostly adults around middle age, with a tail of young children
+        double u = (bench_uniform(&state) + bench_uniform(&state) + bench_uniform(&state)) / 3;
+        patient_ages[i] = bench_uniform(&state) < 0.1 ? (int)(bench_uniform(&state) * 6) : (int)(10 + u * 90);
+        patient_diagnoses[i] = bench_skewed(&state, diagnosis_count);
+        patient_histories[i] = bench_skewed(&state, history_count);
+    }
+    // A serial can repeat; rename repeats after their position, which is unique
+    char** sorted = (char**)malloc(records * sizeof(char*));
+    memcpy(sorted, names, records * sizeof(char*));
+    qsort(sorted, records, sizeof(char*), bench_compare_names);
+    for (size_t i = 1; i < records; i++) {
+        if (strcmp(sorted[i - 1], sorted[i]) == 0) {
+            size_t position = (size_t)(sorted[i] - name_text) / 40;
+            snprintf(sorted[i], 40, "%s_%zu", surnames[position % surname_count], position);
+        }
+    }
+    qsort(sorted, records, sizeof(char*), bench_compare_names);
+    size_t* shuffled = (size_t*)malloc(records * sizeof(size_t));
+    for (size_t i = 0; i < records; i++) {
+        shuffled[i] = i;
     }
+    for (size_t i = records; i > 1; i--) {
+        size_t j = (size_t)(bench_random(&state) % i);
+        size_t swap = shuffled[i - 1];
+        shuffled[i - 1] = shuffled[j];
+        shuffled[j] = swap;
+    }
+    uint64_t* latencies = (uint64_t*)malloc((records > BENCH_RANGE_QUERIES ? records : BENCH_RANGE_QUERIES) * sizeof(uint64_t));
+
+    for (int pass = 0; pass < 2; pass++) {
+        // Pass 0 inserts in name order, pass 1 in random order
+        uint64_t started = clock_ns();
+        for (size_t i = 0; i < records; i++) {
+            size_t k = pass == 0 ? (size_t)(sorted[i] - name_text) / 40 : shuffled[i];
+            const char* name = names[k];
+            uint64_t before = clock_ns();
+            struct Patient* patient = create_patient(name, patient_ages[k], k % 2 ? "F" : "M", histories[patient_histories[k]],
+                                                     diagnoses[patient_diagnoses[k]], prescriptions[patient_diagnoses[k]]);
+            add_patient(index, patient);
+            add_patient_by_age(ages, patient);
+            latencies[i] = clock_ns() - before;
+        }
+        bench_report("add", pass == 0 ? "sorted" : "random", records, records, clock_ns() - started, latencies);
+        if (pass == 0) {
+            release_all_records(index, ages);
 
-    struct Patient *root = NULL;
+            // The same patients in random order, staged and committed as one write batch
+            struct WriteBatch batch;
+            memset(&batch, 0, sizeof(batch));
+            started = clock_ns();
+            for (size_t i = 0; i < records; i++) {
+                size_t k = shuffled[i];
+                write_batch_add(&batch, names[k], patient_ages[k], k % 2 ? "F" : "M", histories[patient_histories[k]],
+                                diagnoses[patient_diagnoses[k]], prescriptions[patient_diagnoses[k]]);
+            }
+            write_batch_commit(&batch, index, ages);
+            bench_report("add_batch", "random", records, records, clock_ns() - started, NULL);
+            write_batch_free(&batch);
+            release_all_records(index, ages);
+        }
+    }
 
-    while (!feof(file)) {
-        char name[50];
-        int age;
-        char gender[10];
-        char medical_history[100];
-        char diagnosis[100];
-        char prescription[100];
+    uint64_t started = clock_ns();
+    for (size_t i = 0; i < records; i++) {
+        uint64_t before = clock_ns();
+        search_patient(index, names[shuffled[(i * 7919) % records]]);
+        latencies[i] = clock_ns() - before;
+    }
+    bench_report("search", "random", records, records, clock_ns() - started, latencies);
 
-        if (fscanf(file, "%s %d %s %s %s %s\n", name, &age, gender, medical_history, diagnosis, prescription) == 6) {
-            struct Patient *new_patient = create_patient(name, age, gender, medical_history, diagnosis, prescription);
-            root = add_patient(root, new_patient);
+    started = clock_ns();
+    size_t found = 0;
+    for (size_t i = 0; i < BENCH_RANGE_QUERIES; i++) {
+        int min_age = (int)(bench_random(&state) % (100 - BENCH_RANGE_WIDTH));
+        uint64_t before = clock_ns();
+        struct AgeRange range = search_patients_by_age_range(ages, min_age, min_age + BENCH_RANGE_WIDTH - 1);
+        while (age_range_next(&range) != NULL) {
+            found++;
         }
+        latencies[i] = clock_ns() - before;
     }
+    bench_report("age_range", "random", records, BENCH_RANGE_QUERIES, clock_ns() - started, latencies);
 
-    fclose(file);
-    printf("Patient records loaded from %s successfully.\n", filename);
+    // The first group-by builds the column store, so that is timed on its own
+    started = clock_ns();
+    columns_build(index);
+    bench_report("column_build", "random", records, records, clock_ns() - started, NULL);
+    char* group_keys[3][COLUMN_MAX_KEYS] = {{"diagnosis", NULL}, {"gender", "age/10"}, {"age/5", NULL}};
+    int group_key_counts[3] = {1, 2, 1};
+    started = clock_ns();
+    for (size_t i = 0; i < BENCH_GROUP_QUERIES; i++) {
+        uint64_t before = clock_ns();
+        struct GroupBy query;
+        group_by(index, &query, group_keys[i % 3], group_key_counts[i % 3]);
+        group_free(&query);
+        latencies[i] = clock_ns() - before;
+    }
+    bench_report("group_by", "random", records, BENCH_GROUP_QUERIES, clock_ns() - started, latencies);
+
+    started = clock_ns();
+    save_records_to_file(index, ages, BENCH_TEXT_FILE);
+    bench_report("save_text", "random", records, records, clock_ns() - started, NULL);
+    started = clock_ns();
+    save_records_to_file(index, ages, BENCH_COMPRESSED_FILE);
+    bench_report("save_text_lz", "random", records, records, clock_ns() - started, NULL);
+    started = clock_ns();
+    save_records_to_file(index, ages, BENCH_SNAPSHOT_FILE);
+    bench_report("save_snapshot", "random", records, records, clock_ns() - started, NULL);
+    started = clock_ns();
+    save_records_to_file(index, ages, BENCH_SHARD_DIRECTORY);
+    bench_report("save_shards", "random", records, records, clock_ns() - started, NULL);
 
-    return root;
+    release_all_records(index, ages);
+    started = clock_ns();
+    load_records_from_file(index, ages, BENCH_SNAPSHOT_FILE);
+    bench_report("load_snapshot", "random", records, records, clock_ns() - started, NULL);
+    int ok = bench_check_load(index, records, BENCH_SNAPSHOT_FILE);
+    release_all_records(index, ages);
+    started = clock_ns();
+    load_records_from_file(index, ages, BENCH_TEXT_FILE);
+    bench_report("load_text", "random", records, records, clock_ns() - started, NULL);
+    ok = bench_check_load(index, records, BENCH_TEXT_FILE) && ok;
+    release_all_records(index, ages);
+    started = clock_ns();
+    load_records_from_file(index, ages, BENCH_COMPRESSED_FILE);
+    bench_report("load_text_lz", "random", records, records, clock_ns() - started, NULL);
+    ok = bench_check_load(index, records, BENCH_COMPRESSED_FILE) && ok;
+    release_all_records(index, ages);
+    started = clock_ns();
+    load_records_from_file(index, ages, BENCH_SHARD_DIRECTORY);
+    shards_need(NULL);
+    bench_report("load_shards", "random", records, records, clock_ns() - started, NULL);
+    ok = bench_check_load(index, records, BENCH_SHARD_DIRECTORY) && ok;
+
+    started = clock_ns();
+    for (size_t i = 0; i < records; i++) {
+        uint64_t before = clock_ns();
+        delete_patient_record(index, ages, search_patient(index, names[shuffled[i]]));
+        latencies[i] = clock_ns() - before;
+    }
+    bench_report("delete", "random", records, records, clock_ns() - started, latencies);
+
+    release_all_records(index, ages);
+    remove(BENCH_TEXT_FILE);
+    remove(BENCH_SNAPSHOT_FILE);
+    remove(BENCH_COMPRESSED_FILE);
+    for (int k = 0; k <= SHARD_COUNT; k++) {
+        char* path = shard_path(BENCH_SHARD_DIRECTORY, k < SHARD_COUNT ? NULL : "manifest", k);
+        remove(path);
+        free(path);
+    }
+    rmdir(BENCH_SHARD_DIRECTORY);
+    free(latencies);
+    free(shuffled);
+    free(sorted);
+    free(patient_histories);
+    free(patient_diagnoses);
+    free(patient_ages);
+    free(name_text);
+    free(names);
+    return ok;
+}
+
+// Run the benchmark at each size of a comma-separated list
+int run_bench(const char* sizes) {
+    struct NameIndex index = {NO_HANDLE, 0, 0, {NULL, 0, 0, 0, 0}};
+    struct AgeIndex ages;
+    age_index_clear(&ages);
+    const char* cursor = sizes != NULL ? sizes : BENCH_DEFAULT_SIZES;
+    bench_running = 1;
+    while (*cursor != '\0') {
+        char* end;
+        unsigned long long records = strtoull(cursor, &end, 10);
+        if (end == cursor || records == 0 || records > 100000000ull) {
+            printf("Invalid benchmark size list %s.\n", sizes);
+            return 0;
+        }
+        if (!bench_run((size_t)records, &index, &ages)) {
+            return 0;
+        }
+        cursor = *end == ',' ? end + 1 : end;
+    }
+    bench_running = 0;
+    name_hash_clear(&index.hash);
+    return 1;
 }
-int main() {
-    struct Patient* root = NULL;
-    struct AgeNode* age_tree = NULL;
 
-    char name[50];
+int main(int argc, char* argv[]) {
+    struct NameIndex name_index = {NO_HANDLE, 0, 0, {NULL, 0, 0, 0, 0}};
+    struct AgeIndex age_index;
+    age_index_clear(&age_index);
+
+    // Arguments: an optional database path, and --batch (commands from stdin),
+    // --batch=FILE to run commands without the menu or --serve=SOCKET to serve them.
+    // --bench[=SIZES] runs the benchmark on its own dataset instead. --pages=FILE
+    // keeps the string heap (names and notes) in a page file, with at most --pool=MB
+    // of it in memory; patient slabs and index nodes stay in memory regardless.
+    // --cold keeps medical histories in compressed blocks.
+    const char* database = NULL;
+    const char* script = NULL;
+    const char* socket_path = NULL;
+    const char* page_file = NULL;
+    long pool_megabytes = HEAP_POOL_DEFAULT_MB;
+    int batch = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0) {
+            batch = 1;
+        } else if (strncmp(argv[i], "--batch=", 8) == 0) {
+            batch = 1;
+            script = argv[i] + 8;
+        } else if (strncmp(argv[i], "--serve=", 8) == 0) {
+            socket_path = argv[i] + 8;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            return run_bench(NULL) ? 0 : 1;
+        } else if (strncmp(argv[i], "--bench=", 8) == 0) {
+            return run_bench(argv[i] + 8) ? 0 : 1;
+        } else if (strncmp(argv[i], "--pages=", 8) == 0) {
+            page_file = argv[i] + 8;
+        } else if (strncmp(argv[i], "--pool=", 7) == 0) {
+            pool_megabytes = strtol(argv[i] + 7, NULL, 10);
+        } else if (strcmp(argv[i], "--cold") == 0) {
+            cold_store.enabled = 1;
+        } else {
+            database = argv[i];
+        }
+    }
+
+    if (page_file != NULL && (pool_megabytes <= 0 || !heap_pool_open(page_file, (size_t)pool_megabytes))) {
+        return 1;
+    }
+
+    // With a database argument, changes are journaled and survive a restart
+    if (database != NULL && !journal_open_database(database, &name_index, &age_index)) {
+        return 1;
+    }
+
+    if (socket_path != NULL) {
+        // Readers may still be running when this returns, so the dataset is left to the OS
+        int served = run_server(socket_path, &name_index, &age_index);
+        background_save_finish(1);
+        journal_close();
+        return served ? 0 : 1;
+    }
+
+    if (batch) {
+        FILE* in = script != NULL ? fopen(script, "rb") : stdin;
+        if (in == NULL) {
+            printf("Error opening %s.\n", script);
+            journal_close();
+            release_all_records(&name_index, &age_index);
+            return 1;
+        }
+        int failures = run_batch(in, &name_index, &age_index);
+        if (in != stdin) {
+            fclose(in);
+        }
+        background_save_finish(1);
+        journal_close();
+        release_all_records(&name_index, &age_index);
+        return failures > 0 ? 2 : 0;
+    }
+
+    // Text input is read into buffers that grow to fit, so long notes are kept whole
+    char* name = NULL;
+    char* gender = NULL;
+    char* medical_history = NULL;
+    char* diagnosis = NULL;
+    char* prescription = NULL;
+    char* filename = NULL;
+    char* format = NULL;
+    char* query = NULL;
+    size_t name_capacity = 0, gender_capacity = 0, medical_history_capacity = 0;
+    size_t diagnosis_capacity = 0, prescription_capacity = 0, filename_capacity = 0, format_capacity = 0, query_capacity = 0;
     int age, min_age, max_age;
-    char gender[10];
-    char medical_history[100];
-    char diagnosis[100];
-    char prescription[100];
-    char filename[100];
+    int output_format = OUTPUT_TEXT;
+    struct Output out;
 
     int choice = 0;
     while (choice != 9) {
+        // Make the changes so far durable before waiting for more input
+        journal_commit();
+        background_save_finish(0);
+        heap_release();
+
         printf("Medical Records Management System\n");
         printf("1. Add Patient\n");
         printf("2. Search Patient\n");
@@ -299,65 +7771,82 @@ int main() {
         printf("7. Save Records to File\n");
         printf("8. Load Records from File\n");
         printf("9. Exit\n");
+        printf("10. Set Output Format\n");
+        printf("11. Show Metrics\n");
+        printf("12. Search Clinical Notes\n");
+        printf("13. Find Patients by Partial Name\n");
+        printf("14. Patient Statistics\n");
+        printf("15. Search by Several Fields\n");
+        printf("16. Add Search Index\n");
+        printf("17. Add Several Patients\n");
         printf("Enter your choice: ");
         scanf("%d", &choice);
+        if (choice >= 5 && choice != 8 && choice != 9 && choice != 10) {
+            shards_need(NULL);  // Options 1-4 read just the shard of the name they ask for
+        }
 
         switch (choice) {
             case 1:
                 printf("Enter patient name: ");
-                scanf("%s", name);
+                read_field(stdin, &name, &name_capacity, 0);
+                shards_need(name);
                 printf("Enter patient age: ");
                 scanf("%d", &age);
                 printf("Enter patient gender: ");
-                scanf("%s", gender);
+                read_field(stdin, &gender, &gender_capacity, 0);
                 printf("Enter medical history: ");
-                scanf(" %99[^\n]s", medical_history);
+                int status = read_field(stdin, &medical_history, &medical_history_capacity, 1);
                 printf("Enter diagnosis: ");
-                scanf(" %99[^\n]s", diagnosis);
+                status = status < 0 ? status : read_field(stdin, &diagnosis, &diagnosis_capacity, 1);
                 printf("Enter prescription: ");
-                scanf(" %99[^\n]s", prescription);
+                status = status < 0 ? status : read_field(stdin, &prescription, &prescription_capacity, 1);
+                if (status <= 0 || name[0] == '\0' || age < 0 || age > MAX_AGE) {
+                    printf("Invalid patient details.\n");
+                    break;
+                }
 
                 // Create a new patient
                 struct Patient* new_patient = create_patient(name, age, gender, medical_history, diagnosis, prescription);
 
-                // Add the new patient to the binary search tree
-                root = add_patient(root, new_patient);
+                // Add the new patient to the name index
+                add_patient(&name_index, new_patient);
 
-                // Add the new patient to the age-based tree
-                age_tree = add_patient_by_age(age_tree, new_patient);
+                // Add the new patient to the age index
+                add_patient_by_age(&age_index, new_patient);
+                journal_log_add(new_patient);
+                printf("Patient added with ID %u.\n", new_patient->handle);
                 break;
 
             case 2:
                 printf("Enter patient name to search: ");
-                scanf("%s", name);
-                struct Patient* patient = search_patient(root, name);
-                if (patient != NULL) {
+                read_field(stdin, &name, &name_capacity, 0);
+                shards_need(name);
+                if (output_format == OUTPUT_TEXT && search_patient(&name_index, name) != NULL) {
                     printf("Found patient:\n");
-                    printf("Name: %s\n", patient->name);
-                    printf("Age: %d\n", patient->age);
-                    printf("Gender: %s\n", patient->gender);
-                    printf("Medical History: %s\n", patient->medical_history);
-                    printf("Diagnosis: %s\n", patient->diagnosis);
-                    printf("Prescription: %s\n", patient->prescription);
-                } else {
+                }
+                if (display_patients_named(&name_index, name, output_format) == 0) {
                     printf("Patient not found.\n");
                 }
                 break;
 
             case 3:
                 printf("Enter patient name to update: ");
-                scanf("%s", name);
-                patient = search_patient(root, name);
+                read_field(stdin, &name, &name_capacity, 0);
+                shards_need(name);
+                struct Patient* patient = choose_patient(&name_index, name, &query, &query_capacity);
                 if (patient != NULL) {
                     printf("Enter updated medical history: ");
-                    scanf(" %[^\n]s", medical_history);
+                    status = read_field(stdin, &medical_history, &medical_history_capacity, 1);
                     printf("Enter updated diagnosis: ");
-                    scanf(" %[^\n]s", diagnosis);
+                    status = status < 0 ? status : read_field(stdin, &diagnosis, &diagnosis_capacity, 1);
                     printf("Enter updated prescription: ");
-                    scanf(" %[^\n]s", prescription);
-                    strcpy(patient->medical_history, medical_history);
-                    strcpy(patient->diagnosis, diagnosis);
-                    strcpy(patient->prescription, prescription);
+                    status = status < 0 ? status : read_field(stdin, &prescription, &prescription_capacity, 1);
+                    if (status <= 0) {
+                        printf("Invalid patient details.\n");
+                        break;
+                    }
+                    update_patient_notes(patient, medical_history, diagnosis, prescription);
+                    journal_log_update(patient);
                     printf("Patient record updated successfully.\n");
                 } else {
                     printf("Patient not found.\n");
@@ -366,13 +7855,20 @@ int main() {
 
             case 4:
                 printf("Enter patient name to delete: ");
-                scanf("%s", name);
-                root = delete_patient_record(root, name);
-                printf("Patient record deleted successfully.\n");
+                read_field(stdin, &name, &name_capacity, 0);
+                shards_need(name);
+                patient = choose_patient(&name_index, name, &query, &query_capacity);
+                if (patient != NULL) {
+                    journal_log_delete(patient);
+                    delete_patient_record(&name_index, &age_index, patient);
+                    printf("Patient record deleted successfully.\n");
+                } else {
+                    printf("Patient not found.\n");
+                }
                 break;
 
             case 5:
-                display_all_records(root);
+                display_all_records(&name_index, output_format);
                 break;
 
             case 6:
@@ -381,30 +7877,199 @@ int main() {
                 printf("Enter maximum age: ");
                 scanf("%d", &max_age);
 
-                printf("Patients within the age range %d-%d:\n", min_age, max_age);
-                search_patients_by_age_range(age_tree, min_age, max_age);
+                if (output_format == OUTPUT_TEXT) {
+                    printf("Patients within the age range %d-%d (%llu):\n", min_age, max_age,
+                           (unsigned long long)count_patients_by_age_range(&age_index, min_age, max_age));
+                }
+                output_open(&out, 1, output_format);
+                output_age_range(&out, &age_index, min_age, max_age);
+                output_close(&out);
                 break;
 
             case 7:
-            printf("Enter file name to save patient records: ");
-            scanf("%s", filename);
-            save_records_to_file(root, filename);
-            printf("Patient records saved to file successfully.\n");
+            printf("Enter file name to save patient records (.snap for a binary snapshot): ");
+            read_field(stdin, &filename, &filename_capacity, 0);
+            if (journal.database != NULL && strcmp(filename, journal.database) == 0) {
+                // Saving over the open database folds the journal in, in the background too
+                journal_commit();
+                journal_compact();
+                printf("Saving patient records to %s in the background.\n", filename);
+                break;
+            }
+            save_records_in_background(&name_index, &age_index, filename);
             break;
 
             case 8:
                 printf("Enter file name to load patient records: ");
-                scanf("%s", filename);
-                // Free existing memory before loading new records
-                free(root);
-                root = load_records_from_file(filename);
-                printf("Patient records loaded from file successfully.\n");
+                read_field(stdin, &filename, &filename_capacity, 0);
+                if (replace_records_from_file(&name_index, &age_index, filename) >= 0) {
+                    printf("Patient records loaded from file successfully.\n");
+                }
                 break;
 
             case 9:
                 printf("Exiting the program.\n");
                 break;
 
+            case 10:
+                printf("Enter output format (text, tsv or json): ");
+                read_field(stdin, &format, &format_capacity, 0);
+                if (output_format_code(format) < 0) {
+                    printf("Unknown output format.\n");
+                    break;
+                }
+                output_format = output_format_code(format);
+                printf("Output format set to %s.\n", format);
+                break;
+
+            case 11:
+                output_open(&out, 1, OUTPUT_TEXT);
+                metrics_report(&out, &name_index, &age_index);
+                output_close(&out);
+                break;
+
+            case 12:
+                printf("Enter search (e.g. metformin AND age:50-70): ");
+                read_field(stdin, &query, &query_capacity, 1);
+                uint32_t* handles;
+                long found = text_search(&name_index, &age_index, query, &handles);
+                if (found < 0) {
+                    printf("Invalid search.\n");
+                } else if (found == 0) {
+                    printf("No matching patients.\n");
+                } else {
+                    output_open(&out, 1, output_format);
+                    for (long i = 0; i < found; i++) {
+                        output_patient(&out, patient_at(handles[i]));
+                    }
+                    output_close(&out);
+                }
+                free(handles);
+                break;
+
+            case 13:
+                // Autocomplete that forgives one typo, closest names first
+                printf("Enter the start of the patient's name: ");
+                read_field(stdin, &name, &name_capacity, 0);
+                struct NameMatch matches[NAME_SEARCH_DEFAULT_RESULTS];
+                found = name_search(&name_index, name, 1, 1, NAME_SEARCH_DEFAULT_RESULTS, matches);
+                if (found < 0) {
+                    printf("Name too long to search for.\n");
+                } else if (found == 0) {
+                    printf("No matching patients.\n");
+                } else {
+                    output_open(&out, 1, output_format);
+                    for (long i = 0; i < found; i++) {
+                        output_patient(&out, patient_at(matches[i].handle));
+                    }
+                    output_close(&out);
+                }
+                break;
+
+            case 14:
+                printf("Group by (up to two of gender, diagnosis, prescription, age, age/N; \"all\" for totals): ");
+                read_field(stdin, &query, &query_capacity, 1);
+                char* keys[COLUMN_MAX_KEYS + 1];
+                int key_count = 0;
+                for (char* key = strtok(query, " \t"); key != NULL && key_count <= COLUMN_MAX_KEYS; key = strtok(NULL, " \t")) {
+                    if (strcmp(key, "all") != 0) {
+                        keys[key_count++] = key;
+                    }
+                }
+                struct GroupBy report;
+                if (group_by(&name_index, &report, keys, key_count) < 0) {
+                    printf("Invalid grouping.\n");
+                    break;
+                }
+                output_open(&out, 1, OUTPUT_TEXT);
+                group_output(&out, &report);
+                output_close(&out);
+                group_free(&report);
+                break;
+
+            case 15:
+                printf("Enter conditions separated by ';' (e.g. gender=F; age=30-45; diagnosis=Flu): ");
+                read_field(stdin, &query, &query_capacity, 1);
+                char* conditions[QUERY_MAX_CONDITIONS + 1];
+                int condition_count = 0;
+                for (char* condition = strtok(query, ";"); condition != NULL && condition_count <= QUERY_MAX_CONDITIONS; condition = strtok(NULL, ";")) {
+                    while (isspace((unsigned char)*condition)) {
+                        condition++;
+                    }
+                    size_t length = strlen(condition);
+                    while (length > 0 && isspace((unsigned char)condition[length - 1])) {
+                        condition[--length] = '\0';
+                    }
+                    conditions[condition_count++] = condition;
+                }
+                struct Query search;
+                if (query_parse(&name_index, &search, conditions, condition_count) < 0) {
+                    printf("Invalid conditions.\n");
+                    break;
+                }
+                query_plan(&name_index, &age_index, &search);
+                found = query_run(&name_index, &age_index, &search, &handles);
+                if (found == 0) {
+                    printf("No matching patients.\n");
+                } else {
+                    output_open(&out, 1, output_format);
+                    output_patients(&out, handles, (size_t)found);
+                    output_close(&out);
+                }
+                free(handles);
+                break;
+
+            case 16:
+                printf("Index fields, comma separated (from gender, diagnosis, prescription, age): ");
+                read_field(stdin, &query, &query_capacity, 0);
+                int declared = secondary_declare(&name_index, query);
+                if (declared < 0) {
+                    printf("Invalid index fields, or too many indexes.\n");
+                } else {
+                    printf(declared ? "Index on %s added.\n" : "Index on %s already exists.\n", query);
+                }
+                break;
+
+            case 17:
+                // The patients are added together once all are entered, or not at all
+                printf("Enter the number of patients: ");
+                int patient_count = 0;
+                scanf("%d", &patient_count);
+                struct WriteBatch intake;
+                memset(&intake, 0, sizeof(intake));
+                for (int i = 0; i < patient_count; i++) {
+                    printf("Patient %d of %d\n", i + 1, patient_count);
+                    printf("Enter patient name: ");
+                    read_field(stdin, &name, &name_capacity, 0);
+                    shards_need(name);
+                    printf("Enter patient age: ");
+                    age = -1;
+                    scanf("%d", &age);
+                    printf("Enter patient gender: ");
+                    read_field(stdin, &gender, &gender_capacity, 0);
+                    printf("Enter medical history: ");
+                    status = read_field(stdin, &medical_history, &medical_history_capacity, 1);
+                    printf("Enter diagnosis: ");
+                    status = status < 0 ? status : read_field(stdin, &diagnosis, &diagnosis_capacity, 1);
+                    printf("Enter prescription: ");
+                    status = status < 0 ? status : read_field(stdin, &prescription, &prescription_capacity, 1);
+                    if (status <= 0 || name[0] == '\0' || age < 0 || age > MAX_AGE) {
+                        printf("Invalid patient details.\n");
+                        write_batch_clear(&intake);
+                        break;
+                    }
+                    write_batch_add(&intake, name, age, gender, medical_history, diagnosis, prescription);
+                }
+                if (intake.count < (size_t)(patient_count > 0 ? patient_count : 0)) {
+                    printf("No patients were added.\n");
+                } else if (write_batch_commit(&intake, &name_index, &age_index)) {
+                    for (size_t i = 0; i < intake.count; i++) {
+                        printf("Patient %s added with ID %u.\n", intake.text + intake.ops[i].name, intake.ops[i].id);
+                    }
+                }
+                write_batch_free(&intake);
+                break;
+
             default:
                     printf("Invalid choice. Please try again.\n");
                     break;
@@ -413,10 +8078,19 @@ int main() {
         printf("\n");
     }
 
-    // Clean up: Free memory used by the patient and age trees
-    // You can add this code if you want to free the memory before exiting.
-    // free(root);
-    // free(age_tree);
+    // Clean up: finish a background save, commit the journal, then release the
+    // dataset (and any mapped snapshot) and the input buffers
+    background_save_finish(1);
+    journal_close();
+    release_all_records(&name_index, &age_index);
+    free(name);
+    free(gender);
+    free(medical_history);
+    free(diagnosis);
+    free(prescription);
+    free(filename);
+    free(format);
+    free(query);
 
     return 0;
 }
\ No newline at end of file